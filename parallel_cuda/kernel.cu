@@ -13,8 +13,7 @@ __global__ void classifyPointsKernel(Color4 *centroid, int *label, Color4 *pixel
         {
             int dist = (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r)\
              + (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g) + \
-             (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b) +\
-              (pixels[i].a - centroid[j].a) * (pixels[i].a - centroid[j].a);
+             (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
             //printf("%d ",pixels[i].r);
             if (dist < min_dist)
             {   
@@ -49,6 +48,7 @@ void host_classify_points(Color4 *centroid, int *label, Color4 *pixels, int *mig
 
     int *migration_count_d;
     cudaMalloc(&migration_count_d, sizeof(int));
+    cudaMemset(migration_count_d, 0, sizeof(int));
 
     dim3 threadsPerBlock(256);
     dim3 numBlocks((total_pixel + threadsPerBlock.x - 1) / threadsPerBlock.x);
@@ -73,18 +73,6 @@ __global__ void updateCentroidKernel(Color4_SUM* labelSum, int* labelCount, Colo
     extern __shared__ Color4_SUM sharedLabelSum[];
     //extern __shared__ int sharedLabelCount[];
 
-    if (tid == 0){
-        for (int i = 0; i < cluster_count; i++)
-        {
-            labelSum[i].r = 0;
-            labelSum[i].g = 0;
-            labelSum[i].b = 0;
-            labelSum[i].a = 0;
-
-            labelCount[i] = 0;
-        }
-    }
-
     if (threadIdx.x == 0){
         for (int i = 0; i < cluster_count; i++)
         {
@@ -105,10 +93,10 @@ __global__ void updateCentroidKernel(Color4_SUM* labelSum, int* labelCount, Colo
     {
         int currentLabel = label[tid];
         //atomicAdd(&sharedLabelCount[currentLabel], 1);
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].r), static_cast<unsigned int>(pixels[tid].r));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].g), static_cast<unsigned int>(pixels[tid].g));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].b), static_cast<unsigned int>(pixels[tid].b));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].a), 1);
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].r), static_cast<unsigned long long>(pixels[tid].r));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].g), static_cast<unsigned long long>(pixels[tid].g));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].b), static_cast<unsigned long long>(pixels[tid].b));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].a), 1ull);
     }
 
     __syncthreads();
@@ -120,10 +108,10 @@ __global__ void updateCentroidKernel(Color4_SUM* labelSum, int* labelCount, Colo
         {
             //atomicAdd(&labelCount[i], sharedLabelCount[i]);
             //printf("slc: %d ", sharedLabelCount[i]);
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].r), static_cast<unsigned int>(sharedLabelSum[i].r));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].g), static_cast<unsigned int>(sharedLabelSum[i].g));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].b), static_cast<unsigned int>(sharedLabelSum[i].b));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].a), static_cast<unsigned int>(sharedLabelSum[i].a));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].r), static_cast<unsigned long long>(sharedLabelSum[i].r));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].g), static_cast<unsigned long long>(sharedLabelSum[i].g));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].b), static_cast<unsigned long long>(sharedLabelSum[i].b));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].a), static_cast<unsigned long long>(sharedLabelSum[i].a));
         }
     }
 }
@@ -141,6 +129,8 @@ void host_update_centroid(Color4 *centroid, int *label, Color4_SUM* label_sum, i
     //Color4_SUM *label_sum = (Color4_SUM *)malloc(cluster_count * sizeof(Color4_SUM));
     Color4_SUM *label_sum_d;
     cudaMalloc(&label_sum_d, cluster_count*sizeof(Color4_SUM));
+    // NOTE: cleared before the launch, zeroing it from one thread of the kernel raced with the other blocks
+    cudaMemset(label_sum_d, 0, cluster_count*sizeof(Color4_SUM));
 
     //int *label_count = (int *)malloc(cluster_count * sizeof(int));
     int *label_count_d;
@@ -170,14 +160,14 @@ void host_update_centroid(Color4 *centroid, int *label, Color4_SUM* label_sum, i
 
     for (int i = 0; i < cluster_count; i++)
     {
-        if (label_sum[i].r != 0 && label_count[i] != 0)
+        // NOTE: round down and keep the old centroid of an empty cluster, same as the other backends
+        if (label_count[i] != 0)
+        {
             centroid[i].r = label_sum[i].r / label_count[i];
-        if (label_sum[i].g != 0 && label_count[i] != 0)
             centroid[i].g = label_sum[i].g / label_count[i];
-        if (label_sum[i].b != 0 && label_count[i] != 0)
             centroid[i].b = label_sum[i].b / label_count[i];
-        if (label_sum[i].a != 0 && label_count[i] != 0)
             centroid[i].a = 0;
+        }
     }
 
     cudaFree(label_sum_d);
@@ -199,8 +189,7 @@ __global__ void classfy_updateCentroidKernel(Color4* centroid, int* label, Color
         {
             int dist = (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r)\
              + (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g) + \
-             (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b) +\
-              (pixels[i].a - centroid[j].a) * (pixels[i].a - centroid[j].a);
+             (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
             //printf("%d ",pixels[i].r);
             if (dist < min_dist)
             {   
@@ -220,18 +209,6 @@ __global__ void classfy_updateCentroidKernel(Color4* centroid, int* label, Color
     extern __shared__ Color4_SUM sharedLabelSum[];
     //extern __shared__ int sharedLabelCount[];
 
-    if (i == 0){
-        for (int i = 0; i < cluster_count; i++)
-        {
-            labelSum[i].r = 0;
-            labelSum[i].g = 0;
-            labelSum[i].b = 0;
-            labelSum[i].a = 0;
-
-            labelCount[i] = 0;
-        }
-    }
-
     if (threadIdx.x == 0){
         for (int i = 0; i < cluster_count; i++)
         {
@@ -252,10 +229,10 @@ __global__ void classfy_updateCentroidKernel(Color4* centroid, int* label, Color
     {
         int currentLabel = label[i];
         //atomicAdd(&sharedLabelCount[currentLabel], 1);
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].r), static_cast<unsigned int>(pixels[i].r));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].g), static_cast<unsigned int>(pixels[i].g));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].b), static_cast<unsigned int>(pixels[i].b));
-        atomicAdd(reinterpret_cast<unsigned int*>(&sharedLabelSum[currentLabel].a), 1);
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].r), static_cast<unsigned long long>(pixels[i].r));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].g), static_cast<unsigned long long>(pixels[i].g));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].b), static_cast<unsigned long long>(pixels[i].b));
+        atomicAdd(reinterpret_cast<unsigned long long*>(&sharedLabelSum[currentLabel].a), 1ull);
     }
 
     __syncthreads();
@@ -267,10 +244,10 @@ __global__ void classfy_updateCentroidKernel(Color4* centroid, int* label, Color
         {
             //atomicAdd(&labelCount[i], sharedLabelCount[i]);
             //printf("slc: %d ", sharedLabelCount[i]);
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].r), static_cast<unsigned int>(sharedLabelSum[i].r));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].g), static_cast<unsigned int>(sharedLabelSum[i].g));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].b), static_cast<unsigned int>(sharedLabelSum[i].b));
-            atomicAdd(reinterpret_cast<unsigned int*>(&labelSum[i].a), static_cast<unsigned int>(sharedLabelSum[i].a));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].r), static_cast<unsigned long long>(sharedLabelSum[i].r));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].g), static_cast<unsigned long long>(sharedLabelSum[i].g));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].b), static_cast<unsigned long long>(sharedLabelSum[i].b));
+            atomicAdd(reinterpret_cast<unsigned long long*>(&labelSum[i].a), static_cast<unsigned long long>(sharedLabelSum[i].a));
         }
     }
 
@@ -293,9 +270,12 @@ void host_classfy_updateCentroid(Color4 *centroid, int *label, Color4_SUM* label
 
     int *migration_count_d;
     cudaMalloc(&migration_count_d, sizeof(int));
+    cudaMemset(migration_count_d, 0, sizeof(int));
 
     Color4_SUM *label_sum_d;
     cudaMalloc(&label_sum_d, cluster_count*sizeof(Color4_SUM));
+    // NOTE: cleared before the launch, zeroing it from one thread of the kernel raced with the other blocks
+    cudaMemset(label_sum_d, 0, cluster_count*sizeof(Color4_SUM));
 
     //int *label_count = (int *)malloc(cluster_count * sizeof(int));
     int *label_count_d;
@@ -314,14 +294,14 @@ void host_classfy_updateCentroid(Color4 *centroid, int *label, Color4_SUM* label
 
     for (int i = 0; i < cluster_count; i++)
     {
-        if (label_sum[i].r != 0 && label_count[i] != 0)
+        // NOTE: round down and keep the old centroid of an empty cluster, same as the other backends
+        if (label_count[i] != 0)
+        {
             centroid[i].r = label_sum[i].r / label_count[i];
-        if (label_sum[i].g != 0 && label_count[i] != 0)
             centroid[i].g = label_sum[i].g / label_count[i];
-        if (label_sum[i].b != 0 && label_count[i] != 0)
             centroid[i].b = label_sum[i].b / label_count[i];
-        if (label_sum[i].a != 0 && label_count[i] != 0)
             centroid[i].a = 0;
+        }
     }
 
     cudaMemcpy(label, label_d, total_pixel*sizeof(int), cudaMemcpyDeviceToHost);
@@ -11,7 +11,7 @@ typedef struct Color4
 
 typedef struct Color4_SUM
 {
-    long r, g, b, a;
+    long long r, g, b, a;
 } Color4_SUM;
 
 typedef struct Image
@@ -145,6 +145,7 @@ Kmean(Color4 *output, Color4 *pixels, int width, int height,
     int pixel_count = width * height;
     Color4 *centroid = (Color4 *)malloc(cluster_count * sizeof(Color4));
     int *label = (int *)malloc(pixel_count * sizeof(int));
+    clear_memory(label, pixel_count * sizeof(int));
     Color4_SUM *label_sum = (Color4_SUM *)malloc(cluster_count * sizeof(Color4_SUM));
     int *label_count = (int *)malloc(cluster_count * sizeof(int));
 
@@ -160,7 +161,7 @@ Kmean(Color4 *output, Color4 *pixels, int width, int height,
         //host_update_centroid(centroid, label, label_sum, label_count, pixels, cluster_count, pixel_count);
         host_classfy_updateCentroid(centroid, label, label_sum, label_count, pixels, &migration_count, cluster_count, pixel_count);
 
-        if (migration_count / (float)pixel_count < migration_threshold)
+        if (migration_count < migration_threshold * pixel_count)
         {
             *out_iteration = i;
             break;
@@ -11,6 +11,18 @@ string_len(char *string)
     return result;
 }
 
+// NOTE: returns the rest of the string when it starts with prefix, otherwise 0
+static char *
+string_skip_prefix(char *string, char *prefix)
+{
+    while(*prefix && *string == *prefix)
+    {
+        ++string;
+        ++prefix;
+    }
+    return *prefix ? 0 : string;
+}
+
 static size_t
 align_to(size_t value, size_t alignment)
 {
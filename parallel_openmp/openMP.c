@@ -7,6 +7,21 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <omp.h>
+#include <limits.h>
+
+#define MEMO_CELL_BITS 6
+#define MEMO_CELL_COUNT (1 << (3 * MEMO_CELL_BITS))
+#define MEMO_AMBIGUOUS 0xffff
+#define LANE_COUNT 8
+// NOTE: above the largest specialised count the distances are computed in blocks, see
+// classify_points_large
+#define LARGE_CLUSTER_COUNT 64
+#define LARGE_PIXEL_BLOCK 256
+#define LARGE_CLUSTER_BLOCK 128
+// NOTE: the Morton code of a color is 24 bits, sorted 8 bits per pass
+#define RADIX_BITS 8
+#define RADIX_BUCKET_COUNT (1 << RADIX_BITS)
+#define RADIX_PASS_COUNT 3
 
 typedef struct Color4
 {
@@ -15,7 +30,7 @@ typedef struct Color4
 
 typedef struct Color4_SUM
 {
-    long r, g, b, a;
+    long long r, g, b, a;
 } Color4_SUM;
 
 typedef struct Image
@@ -141,34 +156,279 @@ void AllocateRandomClusters(Color4 *centroid, Color4 *pixels, int pixel_count, s
     }
 }
 
-void classify_points(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, int cluster_count, int total_pixel,int thread_count)
-{      
+// NOTE: the centroid that is strictly nearest everywhere in the grid cell, or MEMO_AMBIGUOUS when
+// another one could tie or win somewhere in it (same rule as the pthread backend)
+int find_memo_cell_centroid(Color4 *centroid, int cluster_count, int cell)
+{
+    int low[3], high[3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        int shift = (2 - channel) * MEMO_CELL_BITS;
+        low[channel] = ((cell >> shift) & ((1 << MEMO_CELL_BITS) - 1)) << (8 - MEMO_CELL_BITS);
+        high[channel] = low[channel] + (1 << (8 - MEMO_CELL_BITS)) - 1;
+    }
+
+    int best_index = 0;
+    int best_max_dist = INT_MAX;
+    for (int j = 0; j < cluster_count; j++)
+    {
+        int values[3] = {centroid[j].r, centroid[j].g, centroid[j].b};
+        int max_dist = 0;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int low_diff = (values[channel] - low[channel]) * (values[channel] - low[channel]);
+            int high_diff = (values[channel] - high[channel]) * (values[channel] - high[channel]);
+            max_dist += (low_diff > high_diff) ? low_diff : high_diff;
+        }
+        if (max_dist < best_max_dist)
+        {
+            best_index = j;
+            best_max_dist = max_dist;
+        }
+    }
+
+    for (int j = 0; j < cluster_count; j++)
+    {
+        int values[3] = {centroid[j].r, centroid[j].g, centroid[j].b};
+        int min_dist = 0;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            int diff = 0;
+            if (values[channel] < low[channel]) diff = low[channel] - values[channel];
+            else if (values[channel] > high[channel]) diff = values[channel] - high[channel];
+            min_dist += diff * diff;
+        }
+        if (j != best_index && min_dist <= best_max_dist)
+            return MEMO_AMBIGUOUS;
+    }
+    return best_index;
+}
+
+// NOTE: memo_cells is an optional grid filled lazily during the pass: an entry is
+// (generation << 16 | centroid), every thread computes the same entry for a generation, so the
+// atomic read and write are only there to keep the word whole, no thread ever waits on another.
+// LANE_COUNT pixels are scanned side by side with the centroid broadcast to every lane, the
+// minimum is a select instead of a branch and the lowest index still wins ties.
+// NOTE: forced inline, the constant count only reaches the scan when it is inlined into the loop
+static inline __attribute__((always_inline)) void classify_point_block(Color4 *centroid, int *label, Color4 *pixels, int first, int cluster_count, int total_pixel,
+                                                                       unsigned int *memo_cells, unsigned int memo_generation, int *migration_count, long long *sse)
+{
+    int lane_count = total_pixel - first;
+    if (lane_count > LANE_COUNT)
+        lane_count = LANE_COUNT;
+
+    int index[LANE_COUNT];
+    int scan_count = lane_count;
+    if (memo_cells)
+    {
+        scan_count = 0;
+        for (int lane = 0; lane < lane_count; lane++)
+        {
+            Color4 pixel = pixels[first + lane];
+            int shift = 8 - MEMO_CELL_BITS;
+            int cell = ((pixel.r >> shift) << (2 * MEMO_CELL_BITS)) | ((pixel.g >> shift) << MEMO_CELL_BITS) | (pixel.b >> shift);
+            unsigned int entry;
+            #pragma omp atomic read
+            entry = memo_cells[cell];
+            if ((entry >> 16) != memo_generation)
+            {
+                entry = (memo_generation << 16) | (unsigned int)find_memo_cell_centroid(centroid, cluster_count, cell);
+                #pragma omp atomic write
+                memo_cells[cell] = entry;
+            }
+            index[lane] = entry & 0xffff;
+            if (index[lane] == MEMO_AMBIGUOUS)
+                scan_count++;
+        }
+    }
+
+    if (scan_count)
+    {
+        int r[LANE_COUNT], g[LANE_COUNT], b[LANE_COUNT];
+        int min_dist[LANE_COUNT], min_index[LANE_COUNT];
+        for (int lane = 0; lane < LANE_COUNT; lane++)
+        {
+            Color4 pixel = pixels[first + ((lane < lane_count) ? lane : lane_count - 1)];
+            r[lane] = pixel.r;
+            g[lane] = pixel.g;
+            b[lane] = pixel.b;
+            min_dist[lane] = INT_MAX;
+            min_index[lane] = 0;
+        }
+        for (int j = 0; j < cluster_count; j++)
+        {
+            int centroid_r = centroid[j].r, centroid_g = centroid[j].g, centroid_b = centroid[j].b;
+            for (int lane = 0; lane < LANE_COUNT; lane++)
+            {
+                int dist = 0;
+                dist = dist + (r[lane] - centroid_r) * (r[lane] - centroid_r);
+                dist = dist + (g[lane] - centroid_g) * (g[lane] - centroid_g);
+                dist = dist + (b[lane] - centroid_b) * (b[lane] - centroid_b);
+                int take = dist < min_dist[lane];
+                min_dist[lane] = take ? dist : min_dist[lane];
+                min_index[lane] = take ? j : min_index[lane];
+            }
+        }
+        for (int lane = 0; lane < lane_count; lane++)
+        {
+            if (!memo_cells || index[lane] == MEMO_AMBIGUOUS)
+                index[lane] = min_index[lane];
+        }
+    }
+
+    for (int lane = 0; lane < lane_count; lane++)
+    {
+        int i = first + lane;
+        int j = index[lane];
+        if (j != label[i])
+            (*migration_count)++;
+        label[i] = j;
+        *sse += (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r) +
+                (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g) +
+                (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
+    }
+}
+
+// NOTE: the parallel loop is stamped out per count, so every count gets its own outlined loop
+// with classify_point_block inlined into it and a constant cluster count
+#define DEFINE_CLASSIFY_POINTS(name, count) \
+static void name(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int cluster_count, int total_pixel, int thread_count, \
+                 unsigned int *memo_cells, unsigned int memo_generation) \
+{ \
+    int migration = 0; \
+    long long total_dist = 0; \
+    int block_count = (total_pixel + LANE_COUNT - 1) / LANE_COUNT; \
+    omp_set_num_threads(thread_count); \
+    _Pragma("omp parallel for reduction(+:migration,total_dist)") \
+    for (int block = 0; block < block_count; block++) \
+        classify_point_block(centroid, label, pixels, block * LANE_COUNT, count, total_pixel, memo_cells, memo_generation, \
+                             &migration, &total_dist); \
+    *migration_count = migration; \
+    *sse = total_dist; \
+}
+
+DEFINE_CLASSIFY_POINTS(classify_points_with_count, cluster_count)
+
+// NOTE: a constant cluster count lets the compiler unroll the scan and keep the centroids in
+// registers, the other counts go through the generic one
+DEFINE_CLASSIFY_POINTS(classify_points_2, 2)
+DEFINE_CLASSIFY_POINTS(classify_points_4, 4)
+DEFINE_CLASSIFY_POINTS(classify_points_8, 8)
+DEFINE_CLASSIFY_POINTS(classify_points_16, 16)
+DEFINE_CLASSIFY_POINTS(classify_points_32, 32)
+DEFINE_CLASSIFY_POINTS(classify_points_64, 64)
+
+// NOTE: for large cluster counts the nearest centroid is the one with the smallest
+// |c|^2 - 2 p.c, |p|^2 is the same for every centroid. Every product and sum is an integer below
+// 2^24, so the float math is exact and the score is compared as an integer, the lowest index
+// still wins ties. Like a matrix multiply the points are cut into blocks of LARGE_PIXEL_BLOCK
+// pixels that run against blocks of LARGE_CLUSTER_BLOCK centroids, so both stay in the L1 cache
+// while one group of lanes goes through a whole centroid block.
+void classify_points_large(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int cluster_count, int total_pixel, int thread_count)
+{
     int count = 0;
+    long long total_dist = 0;
+    int block_count = (total_pixel + LARGE_PIXEL_BLOCK - 1) / LARGE_PIXEL_BLOCK;
     omp_set_num_threads(thread_count);
-    #pragma omp parallel for reduction(+:count)
-    for (int i = 0; i < total_pixel; i++)
+    #pragma omp parallel for reduction(+:count,total_dist)
+    for (int block = 0; block < block_count; block++)
     {
-        int index = -1;
-        int min_dist = 1000000;
-        for (int j = 0; j < cluster_count; j++)
+        int first = block * LARGE_PIXEL_BLOCK;
+        int block_pixel_count = total_pixel - first;
+        if (block_pixel_count > LARGE_PIXEL_BLOCK)
+            block_pixel_count = LARGE_PIXEL_BLOCK;
+        int padded_count = (block_pixel_count + LANE_COUNT - 1) / LANE_COUNT * LANE_COUNT;
+
+        float r[LARGE_PIXEL_BLOCK], g[LARGE_PIXEL_BLOCK], b[LARGE_PIXEL_BLOCK];
+        int min_score[LARGE_PIXEL_BLOCK], min_index[LARGE_PIXEL_BLOCK];
+        for (int k = 0; k < padded_count; k++)
         {
-            int dist = 0;
-            dist = dist + (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r);
-            dist = dist + (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g);
-            dist = dist + (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
-            // printf("%d ",dist);
-            if (dist < min_dist)
+            Color4 pixel = pixels[first + ((k < block_pixel_count) ? k : block_pixel_count - 1)];
+            r[k] = pixel.r;
+            g[k] = pixel.g;
+            b[k] = pixel.b;
+            min_score[k] = INT_MAX;
+            min_index[k] = 0;
+        }
+
+        float centroid_r[LARGE_CLUSTER_BLOCK], centroid_g[LARGE_CLUSTER_BLOCK], centroid_b[LARGE_CLUSTER_BLOCK];
+        float centroid_norm[LARGE_CLUSTER_BLOCK];
+        for (int centroid_first = 0; centroid_first < cluster_count; centroid_first += LARGE_CLUSTER_BLOCK)
+        {
+            int block_cluster_count = cluster_count - centroid_first;
+            if (block_cluster_count > LARGE_CLUSTER_BLOCK)
+                block_cluster_count = LARGE_CLUSTER_BLOCK;
+            for (int j = 0; j < block_cluster_count; j++)
             {
-                index = j;
-                min_dist = dist;
+                Color4 c = centroid[centroid_first + j];
+                centroid_r[j] = -2.0f * c.r;
+                centroid_g[j] = -2.0f * c.g;
+                centroid_b[j] = -2.0f * c.b;
+                centroid_norm[j] = (float)(c.r * c.r + c.g * c.g + c.b * c.b);
+            }
+
+            for (int group = 0; group < padded_count; group += LANE_COUNT)
+            {
+                int score[LANE_COUNT], index[LANE_COUNT];
+                for (int lane = 0; lane < LANE_COUNT; lane++)
+                {
+                    score[lane] = min_score[group + lane];
+                    index[lane] = min_index[group + lane];
+                }
+                for (int j = 0; j < block_cluster_count; j++)
+                {
+                    float cr = centroid_r[j], cg = centroid_g[j], cb = centroid_b[j], norm = centroid_norm[j];
+                    int centroid_index = centroid_first + j;
+                    for (int lane = 0; lane < LANE_COUNT; lane++)
+                    {
+                        int s = (int)(norm + r[group + lane] * cr + g[group + lane] * cg + b[group + lane] * cb);
+                        int take = s < score[lane];
+                        score[lane] = take ? s : score[lane];
+                        index[lane] = take ? centroid_index : index[lane];
+                    }
+                }
+                for (int lane = 0; lane < LANE_COUNT; lane++)
+                {
+                    min_score[group + lane] = score[lane];
+                    min_index[group + lane] = index[lane];
+                }
             }
         }
-        // printf("%d\n",index);
-        if (index != label[i])
-            count++;
-        label[i] = index;
+
+        for (int k = 0; k < block_pixel_count; k++)
+        {
+            int i = first + k;
+            int j = min_index[k];
+            if (j != label[i])
+                count++;
+            label[i] = j;
+            total_dist += (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r) +
+                          (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g) +
+                          (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
+        }
     }
     *migration_count = count;
+    *sse = total_dist;
+}
+
+void classify_points(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int cluster_count, int total_pixel,int thread_count,
+                     unsigned int *memo_cells, unsigned int memo_generation)
+{
+    switch (cluster_count)
+    {
+    case 2: classify_points_2(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    case 4: classify_points_4(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    case 8: classify_points_8(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    case 16: classify_points_16(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    case 32: classify_points_32(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    case 64: classify_points_64(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation); break;
+    default:
+        if (cluster_count > LARGE_CLUSTER_COUNT && !memo_cells)
+            classify_points_large(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count);
+        else
+            classify_points_with_count(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel, thread_count, memo_cells, memo_generation);
+        break;
+    }
 }
 
 void update_centroid(Color4_SUM *label_sum, int *label_count, 
@@ -195,13 +455,13 @@ void update_centroid(Color4_SUM *label_sum, int *label_count,
     #pragma omp parallel for 
     for (int i = 0; i < cluster_count; i++)
     {
-        // printf("%ld",label_sum[i].r/label_count[i]);
-        if (label_sum[i].r != 0 && label_count[i] != 0)
+        // NOTE: round down and keep the old centroid of an empty cluster, same as the other backends
+        if (label_count[i] != 0)
+        {
             centroid[i].r = label_sum[i].r / label_count[i];
-        if (label_sum[i].g != 0 && label_count[i] != 0)
             centroid[i].g = label_sum[i].g / label_count[i];
-        if (label_sum[i].b != 0 && label_count[i] != 0)
             centroid[i].b = label_sum[i].b / label_count[i];
+        }
     }
 }
 
@@ -217,39 +477,215 @@ void output_result(int *label, Color4 *output, Color4 *centroid, int cluster_cou
     }
 }
 
+// NOTE: moves bit i of an 8 bit value to bit 3*i
+static unsigned int spread_morton_bits(unsigned int value)
+{
+    value = (value | (value << 8)) & 0x0000f00f;
+    value = (value | (value << 4)) & 0x000c30c3;
+    value = (value | (value << 2)) & 0x00249249;
+    return value;
+}
+
+// NOTE: interleaves the bits of the channels from the top, r above g above b, so colors that
+// are close end up close in the sorted order
+static unsigned int get_morton_code(Color4 color)
+{
+    return (spread_morton_bits(color.r) << 2) | (spread_morton_bits(color.g) << 1) | spread_morton_bits(color.b);
+}
+
+// NOTE: least significant digit first radix sort of the Morton codes, every thread counts the
+// digits of its slice, one thread turns the counts into offsets and then every thread scatters
+// its slice in order, so each pass is stable. order[i] is the index of the pixel that lands at
+// i, the pass count is odd so the last pass writes straight into order.
+int sort_pixels_by_morton_code(Color4 *pixels, Color4 *sorted_pixels, int *order, int total_pixel, int thread_count)
+{
+    unsigned int *keys = (unsigned int *)malloc(total_pixel * sizeof(unsigned int));
+    unsigned int *next_keys = (unsigned int *)malloc(total_pixel * sizeof(unsigned int));
+    int *indices = (int *)malloc(total_pixel * sizeof(int));
+    int *histograms = (int *)malloc(thread_count * RADIX_BUCKET_COUNT * sizeof(int));
+    int result = keys && next_keys && indices && histograms;
+    if (result)
+    {
+        omp_set_num_threads(thread_count);
+        #pragma omp parallel for
+        for (int i = 0; i < total_pixel; i++)
+        {
+            keys[i] = get_morton_code(pixels[i]);
+            indices[i] = i;
+        }
+
+        int *source_indices = indices;
+        int *dest_indices = order;
+        for (int pass = 0; pass < RADIX_PASS_COUNT; pass++)
+        {
+            int shift = pass * RADIX_BITS;
+            #pragma omp parallel
+            {
+                int thread = omp_get_thread_num();
+                int team_size = omp_get_num_threads();
+                int slice = (total_pixel + team_size - 1) / team_size;
+                int first = thread * slice < total_pixel ? thread * slice : total_pixel;
+                int last = first + slice < total_pixel ? first + slice : total_pixel;
+                int *histogram = histograms + thread * RADIX_BUCKET_COUNT;
+                clear_memory(histogram, RADIX_BUCKET_COUNT * sizeof(int));
+                for (int i = first; i < last; i++)
+                    histogram[(keys[i] >> shift) & (RADIX_BUCKET_COUNT - 1)]++;
+
+                #pragma omp barrier
+                #pragma omp single
+                {
+                    int offset = 0;
+                    for (int bucket = 0; bucket < RADIX_BUCKET_COUNT; bucket++)
+                    {
+                        for (int t = 0; t < team_size; t++)
+                        {
+                            int count = histograms[t * RADIX_BUCKET_COUNT + bucket];
+                            histograms[t * RADIX_BUCKET_COUNT + bucket] = offset;
+                            offset += count;
+                        }
+                    }
+                }
+
+                for (int i = first; i < last; i++)
+                {
+                    int dest = histogram[(keys[i] >> shift) & (RADIX_BUCKET_COUNT - 1)]++;
+                    next_keys[dest] = keys[i];
+                    dest_indices[dest] = source_indices[i];
+                }
+            }
+            unsigned int *swap_keys = keys;
+            keys = next_keys;
+            next_keys = swap_keys;
+            int *swap_indices = source_indices;
+            source_indices = dest_indices;
+            dest_indices = swap_indices;
+        }
+
+        #pragma omp parallel for
+        for (int i = 0; i < total_pixel; i++)
+            sorted_pixels[i] = pixels[order[i]];
+    }
+
+    if (keys)
+        free(keys);
+    if (next_keys)
+        free(next_keys);
+    if (indices)
+        free(indices);
+    if (histograms)
+        free(histograms);
+    return result;
+}
+
 static void
 Kmean(Color4 *output, Color4 *pixels, int width, int height,
       int cluster_count, int max_iteration, float migration_threshold,
+      float sse_tolerance, float max_shift, int use_memo_grid, int use_color_sort, long long *out_sse,
       int *out_iteration,int thread_count)
 {
     int pixel_count = width * height;
     Color4 *centroid = (Color4 *)malloc(cluster_count * sizeof(Color4));
     int *label = (int *)malloc(pixel_count * sizeof(int));
+    clear_memory(label, pixel_count * sizeof(int));
 
     AllocateRandomClusters(centroid, pixels, pixel_count, cluster_count);
 
+    // NOTE: seeded from the unsorted pixels, so the clusters come out the same with the sort.
+    // Neighbouring pixels then have similar colors, the nearest centroid mostly repeats and
+    // the sums run over long stretches of the same label.
+    Color4 *sorted_pixels = 0;
+    int *pixel_order = 0;
+    if (use_color_sort)
+    {
+        sorted_pixels = (Color4 *)malloc(pixel_count * sizeof(Color4));
+        pixel_order = (int *)malloc(pixel_count * sizeof(int));
+        if (sorted_pixels && pixel_order &&
+            sort_pixels_by_morton_code(pixels, sorted_pixels, pixel_order, pixel_count, thread_count))
+        {
+            pixels = sorted_pixels;
+        }
+    }
+
     int migration_count;
+    long long sse = 0;
+    long long previous_sse = 0;
+    Color4 *previous_centroid = (Color4 *)malloc(cluster_count * sizeof(Color4));
     int i = 0;
     Color4_SUM *label_sum = (Color4_SUM *)malloc(cluster_count * sizeof(Color4_SUM));
     int *label_count = (int *)malloc(cluster_count * sizeof(int));
+    // NOTE: zeroed cells are generation 0, the first pass uses generation 1
+    unsigned int *memo_cells = 0;
+    unsigned int memo_generation = 0;
+    if (use_memo_grid && cluster_count < MEMO_AMBIGUOUS)
+        memo_cells = (unsigned int *)calloc(MEMO_CELL_COUNT, sizeof(unsigned int));
+    // NOTE: stays at max_iteration when no stopping rule fires before -m runs out
+    *out_iteration = max_iteration;
     while (i++ < max_iteration)
     {
+        memo_generation = (memo_generation + 1) & 0xffff;
+        if (memo_cells && memo_generation == 0)
+        {
+            clear_memory(memo_cells, MEMO_CELL_COUNT * sizeof(unsigned int));
+            memo_generation = 1;
+        }
         migration_count = 0;
+        previous_sse = sse;
+        sse = 0;
+        for (int j = 0; j < cluster_count; j++)
+            previous_centroid[j] = centroid[j];
 
-        classify_points(centroid, label, pixels, &migration_count, cluster_count, pixel_count,thread_count);
+        classify_points(centroid, label, pixels, &migration_count, &sse, cluster_count, pixel_count,thread_count,
+                        memo_cells, memo_generation);
         update_centroid(label_sum, label_count, centroid, label, pixels, cluster_count, pixel_count,thread_count);
 
-        if (migration_count / (float)pixel_count < migration_threshold)
+        int max_shift_squared = 0;
+        for (int j = 0; j < cluster_count; j++)
+        {
+            int r_diff = centroid[j].r - previous_centroid[j].r;
+            int g_diff = centroid[j].g - previous_centroid[j].g;
+            int b_diff = centroid[j].b - previous_centroid[j].b;
+            int shift_squared = r_diff * r_diff + g_diff * g_diff + b_diff * b_diff;
+            if (shift_squared > max_shift_squared)
+                max_shift_squared = shift_squared;
+        }
+
+        // NOTE: same stopping rules as the pthread backend, any of them ends the loop
+        int converged = (migration_count < migration_threshold * pixel_count);
+        if (sse_tolerance > 0 && i > 1 && previous_sse > 0 &&
+            ((double)previous_sse - (double)sse) / (double)previous_sse < sse_tolerance)
+            converged = 1;
+        if (max_shift >= 0 && max_shift_squared <= max_shift * max_shift)
+            converged = 1;
+
+        if (converged)
         {
             *out_iteration = i;
             break;
         }
     }
-    printf("out_iteration: %d\n", *out_iteration);
+    if (pixels == sorted_pixels)
+    {
+        int *unsorted_label = (int *)malloc(pixel_count * sizeof(int));
+        #pragma omp parallel for
+        for (int j = 0; j < pixel_count; j++)
+            unsorted_label[pixel_order[j]] = label[j];
+        free(label);
+        label = unsorted_label;
+    }
     output_result(label, output, centroid, cluster_count, pixel_count, thread_count);
 
+    *out_sse = sse;
     free(label);
     free(centroid);
+    free(previous_centroid);
+    free(label_sum);
+    free(label_count);
+    if (memo_cells)
+        free(memo_cells);
+    if (sorted_pixels)
+        free(sorted_pixels);
+    if (pixel_order)
+        free(pixel_order);
 }
 
 int main(int arg_count, char **args)
@@ -261,6 +697,10 @@ int main(int arg_count, char **args)
     int cluster_count = 4;
     int max_iteration = 200;
     float migration_threshold = 0.01f;
+    float sse_tolerance = 0.0f;
+    float max_shift = -1.0f;
+    int use_memo_grid = 0;
+    int use_color_sort = 0;
 
     for (; parsing_arg_index < arg_count; ++parsing_arg_index)
     {
@@ -284,6 +724,22 @@ int main(int arg_count, char **args)
         {
             migration_threshold = atof(option + 3);
         }
+        else if (string_skip_prefix(option, "--sse-tolerance="))
+        {
+            sse_tolerance = atof(string_skip_prefix(option, "--sse-tolerance="));
+        }
+        else if (string_skip_prefix(option, "--max-shift="))
+        {
+            max_shift = atof(string_skip_prefix(option, "--max-shift="));
+        }
+        else if (string_skip_prefix(option, "--memo-grid") && !*string_skip_prefix(option, "--memo-grid"))
+        {
+            use_memo_grid = 1;
+        }
+        else if (string_skip_prefix(option, "--color-sort") && !*string_skip_prefix(option, "--color-sort"))
+        {
+            use_color_sort = 1;
+        }
         else if (option[1] == 'q' && option[2] == 0)
         {
             verbose = 0;
@@ -305,6 +761,12 @@ int main(int arg_count, char **args)
                       "    -n={cluster_count}  number of clusters (default is 4)\n"
                       "    -m={max_iteration}  max iteration of kmean clustering (default is 200)\n"
                       "    -r={threshold}      exit when the data point migration ratio between clusters exceeds this value (default is 0.01)\n"
+                      "    --sse-tolerance={x} also exit when the SSE improved by less than this fraction (default is off)\n"
+                      "    --max-shift={d}     also exit when no cluster moved further than d (default is off)\n"
+                      "    --memo-grid         resolve pixels through a coarse color grid that is filled lazily every iteration\n"
+                      "                        with the centroid that wins the whole cell, only boundary cells compute distances\n"
+                      "    --color-sort        iterate on the pixels sorted by the Morton code of their color and put the\n"
+                      "                        labels back in place at the end\n"
                       "    -q                  quiet mode (no output)\n"
                       "    -h                  print this help information\n";
         // NOTE: pass the string via '%s' to shut up the compiler warning
@@ -333,15 +795,18 @@ int main(int arg_count, char **args)
             {
                 load_image_data(input, &image);
                 int used_iteration;
+                long long sse;
                 unsigned long long start_time = get_microsecond_from_epoch();
                 Kmean(output, input, image.width, image.height,
                       cluster_count, max_iteration, migration_threshold,
+                      sse_tolerance, max_shift, use_memo_grid, use_color_sort, &sse,
                       &used_iteration,thread_count);
                 unsigned long long end_time = get_microsecond_from_epoch();
                 if (verbose)
                 {
                     printf("[summary]\n");
                     printf("    used iteration = %d\n", used_iteration);
+                    printf("    sse = %lld\n", sse);
                     printf("    time = %fs\n", (end_time - start_time) / 1000000.0f);
                 }
 
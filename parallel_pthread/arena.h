@@ -0,0 +1,221 @@
+#define MEMORY_ARENA_ALIGNMENT 128
+#define MEMORY_ARENA_MIN_BLOCK_SIZE (64ull << 20)
+#define MEMORY_ARENA_HUGE_PAGE_SIZE (2ull << 20)
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#endif
+
+typedef enum HugePageMode
+{
+    HugePageMode_off,
+    HugePageMode_transparent,
+    HugePageMode_explicit,
+} HugePageMode;
+
+// NOTE: one mapping, the header sits at its start and the memory handed out follows it
+typedef struct MemoryArenaBlock MemoryArenaBlock;
+struct MemoryArenaBlock
+{
+    MemoryArenaBlock *next;
+    size_t mapped_size;
+    size_t size;
+    size_t used;
+    int uses_huge_pages;
+};
+
+// NOTE: a stack of blocks that are mapped once and then reused, popping or resetting the arena
+// only moves the top back. Blocks after the current one are free and get reused in order before
+// a new one is mapped. Pushes are not thread safe, the arena belongs to the thread running jobs.
+typedef struct MemoryArena
+{
+    MemoryArenaBlock *first_block;
+    MemoryArenaBlock *current_block;
+    HugePageMode huge_page_mode;
+    size_t mapped_size;
+    size_t huge_page_size; // the part of mapped_size on explicit huge pages
+} MemoryArena;
+
+typedef struct TemporaryMemory
+{
+    MemoryArena *arena;
+    MemoryArenaBlock *block;
+    size_t used;
+} TemporaryMemory;
+
+static int
+parse_huge_page_mode(HugePageMode *mode, char *text)
+{
+    int result = 1;
+    if(string_equal(text, "off")) *mode = HugePageMode_off;
+    else if(string_equal(text, "transparent") || string_equal(text, "thp")) *mode = HugePageMode_transparent;
+    else if(string_equal(text, "explicit") || string_equal(text, "hugetlb")) *mode = HugePageMode_explicit;
+    else result = 0;
+    return result;
+}
+
+static void
+init_memory_arena(MemoryArena *arena, HugePageMode huge_page_mode)
+{
+    clear_memory(arena, sizeof(*arena));
+    arena->huge_page_mode = huge_page_mode;
+}
+
+// NOTE: explicit huge pages come from the pool reserved by the system (vm.nr_hugepages on Linux,
+// the lock pages privilege on Windows), when that fails the block falls back to normal pages.
+// Transparent huge pages only back 2MB aligned ranges, so normal blocks are mapped a huge page
+// larger and trimmed to an aligned start.
+static MemoryArenaBlock *
+map_memory_arena_block(MemoryArena *arena, size_t min_size)
+{
+    size_t header_size = align_to(sizeof(MemoryArenaBlock), MEMORY_ARENA_ALIGNMENT);
+    size_t mapped_size = align_to(header_size + min_size, MEMORY_ARENA_HUGE_PAGE_SIZE);
+    if(mapped_size < MEMORY_ARENA_MIN_BLOCK_SIZE) mapped_size = MEMORY_ARENA_MIN_BLOCK_SIZE;
+
+    char *memory = 0;
+    int uses_huge_pages = 0;
+#if defined(_WIN32) || defined(_WIN64)
+    if(arena->huge_page_mode == HugePageMode_explicit)
+    {
+        size_t large_page_size = GetLargePageMinimum();
+        if(large_page_size && is_pow_of_two(large_page_size))
+        {
+            size_t large_mapped_size = align_to(mapped_size, large_page_size);
+            memory = (char *)VirtualAlloc(0, large_mapped_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if(memory)
+            {
+                mapped_size = large_mapped_size;
+                uses_huge_pages = 1;
+            }
+        }
+    }
+    if(!memory)
+    {
+        memory = (char *)VirtualAlloc(0, mapped_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+#elif defined(__unix__)
+#if defined(MAP_HUGETLB)
+    if(arena->huge_page_mode == HugePageMode_explicit)
+    {
+        void *mapped = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mapped != MAP_FAILED)
+        {
+            memory = (char *)mapped;
+            uses_huge_pages = 1;
+        }
+    }
+#endif
+    if(!memory)
+    {
+        size_t padded_size = mapped_size + MEMORY_ARENA_HUGE_PAGE_SIZE;
+        void *mapped = mmap(0, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapped != MAP_FAILED)
+        {
+            char *padded = (char *)mapped;
+            memory = (char *)align_to((size_t)padded, MEMORY_ARENA_HUGE_PAGE_SIZE);
+            if(memory != padded) munmap(padded, memory - padded);
+            size_t tail_size = (padded + padded_size) - (memory + mapped_size);
+            if(tail_size) munmap(memory + mapped_size, tail_size);
+#if defined(MADV_HUGEPAGE)
+            if(arena->huge_page_mode != HugePageMode_off) madvise(memory, mapped_size, MADV_HUGEPAGE);
+#endif
+        }
+    }
+#endif
+
+    MemoryArenaBlock *result = (MemoryArenaBlock *)memory;
+    if(result)
+    {
+        result->next = 0;
+        result->mapped_size = mapped_size;
+        result->size = mapped_size - header_size;
+        result->used = 0;
+        result->uses_huge_pages = uses_huge_pages;
+        arena->mapped_size += mapped_size;
+        if(uses_huge_pages) arena->huge_page_size += mapped_size;
+    }
+    return result;
+}
+
+static void
+unmap_memory_arena_block(MemoryArenaBlock *block)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    VirtualFree(block, 0, MEM_RELEASE);
+#elif defined(__unix__)
+    munmap(block, block->mapped_size);
+#endif
+}
+
+// NOTE: 128 byte aligned like the rest of the working memory, 0 when no block can be mapped.
+// The memory is not cleared, blocks are reused as they were left.
+static void *
+push_size(MemoryArena *arena, size_t size)
+{
+    void *result = 0;
+    MemoryArenaBlock *block = arena->current_block;
+    for(;;)
+    {
+        if(block)
+        {
+            size_t offset = align_to(block->used, MEMORY_ARENA_ALIGNMENT);
+            if(offset + size <= block->size)
+            {
+                block->used = offset + size;
+                arena->current_block = block;
+                result = (char *)block + align_to(sizeof(MemoryArenaBlock), MEMORY_ARENA_ALIGNMENT) + offset;
+                break;
+            }
+        }
+
+        MemoryArenaBlock *next_block = block ? block->next : arena->first_block;
+        if(!next_block)
+        {
+            next_block = map_memory_arena_block(arena, size);
+            if(!next_block) break;
+            if(block) block->next = next_block;
+            else arena->first_block = next_block;
+        }
+        next_block->used = 0;
+        block = next_block;
+    }
+    return result;
+}
+
+#define push_array(arena, count, type) (type *)push_size(arena, (size_t)(count)*sizeof(type))
+
+static TemporaryMemory
+begin_temporary_memory(MemoryArena *arena)
+{
+    TemporaryMemory result;
+    result.arena = arena;
+    result.block = arena->current_block;
+    result.used = arena->current_block ? arena->current_block->used : 0;
+    return result;
+}
+
+static void
+end_temporary_memory(TemporaryMemory temporary)
+{
+    temporary.arena->current_block = temporary.block;
+    if(temporary.block) temporary.block->used = temporary.used;
+}
+
+static void
+reset_memory_arena(MemoryArena *arena)
+{
+    arena->current_block = 0;
+}
+
+static void
+free_memory_arena(MemoryArena *arena)
+{
+    MemoryArenaBlock *block = arena->first_block;
+    while(block)
+    {
+        MemoryArenaBlock *next_block = block->next;
+        unmap_memory_arena_block(block);
+        block = next_block;
+    }
+    init_memory_arena(arena, arena->huge_page_mode);
+}
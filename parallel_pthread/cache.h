@@ -0,0 +1,327 @@
+#define KMEANS_CACHE_MAGIC 0x31434d4b // "KMC1"
+#define KMEANS_CACHE_LABEL_PASS_THROUGH 0xffff
+#define KMEANS_CACHE_MAX_PALETTE_COUNT 0xffff
+
+#if defined(__unix__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+// NOTE: an entry is the output of one run as a palette and one label per pixel, the labels are
+// deflated with stb's zlib. KMEANS_CACHE_LABEL_PASS_THROUGH means the pixel keeps its input color.
+typedef struct KmeansCacheHeader
+{
+    unsigned int magic;
+    int width;
+    int height;
+    int palette_count;
+    int compressed_label_size;
+    int used_iteration;
+    int coarse_iteration;
+    int best_restart;
+    unsigned long long sse;
+    double feature_sse;
+} KmeansCacheHeader;
+
+typedef struct KmeansCacheEntry
+{
+    KmeansCacheHeader header;
+    unsigned char *palette_rgb;
+    unsigned short *labels;
+} KmeansCacheEntry;
+
+typedef struct KmeansCache
+{
+    char *directory;
+    unsigned long long size_limit;
+    unsigned long long hit_count;
+    unsigned long long miss_count;
+} KmeansCache;
+
+static unsigned long long
+rotate_left_64(unsigned long long value, int shift)
+{
+    return (value << shift) | (value >> (64 - shift));
+}
+
+static unsigned long long
+read_u64(unsigned char *at)
+{
+    unsigned long long result = 0;
+    for(int i = 7; i >= 0; --i) result = (result << 8) | at[i];
+    return result;
+}
+
+static unsigned int
+read_u32(unsigned char *at)
+{
+    return (unsigned int)at[0] | ((unsigned int)at[1] << 8) | ((unsigned int)at[2] << 16) | ((unsigned int)at[3] << 24);
+}
+
+// NOTE: XXH64, four independent lanes over 32 byte stripes so the multiplies overlap
+#define XXH64_PRIME_1 0x9e3779b185ebca87ull
+#define XXH64_PRIME_2 0xc2b2ae3d27d4eb4full
+#define XXH64_PRIME_3 0x165667b19e3779f9ull
+#define XXH64_PRIME_4 0x85ebca77c2b2ae63ull
+#define XXH64_PRIME_5 0x27d4eb2f165667c5ull
+
+static unsigned long long
+xxh64_round(unsigned long long accumulator, unsigned long long input)
+{
+    accumulator += input * XXH64_PRIME_2;
+    accumulator = rotate_left_64(accumulator, 31);
+    return accumulator * XXH64_PRIME_1;
+}
+
+static unsigned long long
+xxh64_merge_round(unsigned long long accumulator, unsigned long long value)
+{
+    accumulator ^= xxh64_round(0, value);
+    return accumulator * XXH64_PRIME_1 + XXH64_PRIME_4;
+}
+
+static unsigned long long
+hash_bytes(void *data, size_t size, unsigned long long seed)
+{
+    unsigned char *at = (unsigned char *)data;
+    unsigned char *end = at + size;
+    unsigned long long result;
+    if(size >= 32)
+    {
+        unsigned long long v1 = seed + XXH64_PRIME_1 + XXH64_PRIME_2;
+        unsigned long long v2 = seed + XXH64_PRIME_2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - XXH64_PRIME_1;
+        while(at + 32 <= end)
+        {
+            v1 = xxh64_round(v1, read_u64(at + 0));
+            v2 = xxh64_round(v2, read_u64(at + 8));
+            v3 = xxh64_round(v3, read_u64(at + 16));
+            v4 = xxh64_round(v4, read_u64(at + 24));
+            at += 32;
+        }
+        result = rotate_left_64(v1, 1) + rotate_left_64(v2, 7) + rotate_left_64(v3, 12) + rotate_left_64(v4, 18);
+        result = xxh64_merge_round(result, v1);
+        result = xxh64_merge_round(result, v2);
+        result = xxh64_merge_round(result, v3);
+        result = xxh64_merge_round(result, v4);
+    }
+    else
+    {
+        result = seed + XXH64_PRIME_5;
+    }
+
+    result += (unsigned long long)size;
+    while(at + 8 <= end)
+    {
+        result ^= xxh64_round(0, read_u64(at));
+        result = rotate_left_64(result, 27) * XXH64_PRIME_1 + XXH64_PRIME_4;
+        at += 8;
+    }
+    if(at + 4 <= end)
+    {
+        result ^= (unsigned long long)read_u32(at) * XXH64_PRIME_1;
+        result = rotate_left_64(result, 23) * XXH64_PRIME_2 + XXH64_PRIME_3;
+        at += 4;
+    }
+    while(at < end)
+    {
+        result ^= (*at++) * XXH64_PRIME_5;
+        result = rotate_left_64(result, 11) * XXH64_PRIME_1;
+    }
+
+    result ^= result >> 33;
+    result *= XXH64_PRIME_2;
+    result ^= result >> 29;
+    result *= XXH64_PRIME_3;
+    result ^= result >> 32;
+    return result;
+}
+
+static void
+get_cache_entry_path(KmeansCache *cache, unsigned long long key, char *out_path, size_t path_size)
+{
+    snprintf(out_path, path_size, "%s/%016llx.kmc", cache->directory, key);
+}
+
+static void
+free_cache_entry(KmeansCacheEntry *entry)
+{
+    if(entry->palette_rgb) free(entry->palette_rgb);
+    if(entry->labels) free(entry->labels);
+    clear_memory(entry, sizeof(*entry));
+}
+
+#if defined(__unix__)
+// NOTE: returns 1 and fills the entry on a hit, the entry has to match the image size. A hit
+// touches the file so that eviction sees it as recently used.
+static int
+load_cache_entry(KmeansCache *cache, unsigned long long key, int width, int height, KmeansCacheEntry *out_entry)
+{
+    int result = 0;
+    char path[4096];
+    get_cache_entry_path(cache, key, path, sizeof(path));
+    clear_memory(out_entry, sizeof(*out_entry));
+    FILE *file = fopen(path, "rb");
+    if(file)
+    {
+        KmeansCacheHeader *header = &out_entry->header;
+        if(fread(header, sizeof(*header), 1, file) == 1 && header->magic == KMEANS_CACHE_MAGIC &&
+           header->width == width && header->height == height &&
+           header->palette_count >= 0 && header->palette_count <= KMEANS_CACHE_MAX_PALETTE_COUNT &&
+           header->compressed_label_size > 0)
+        {
+            int label_size = width * height * (int)sizeof(unsigned short);
+            char *compressed = (char *)malloc(header->compressed_label_size);
+            out_entry->palette_rgb = (unsigned char *)malloc(header->palette_count*3 + 1);
+            out_entry->labels = (unsigned short *)malloc(label_size);
+            if(compressed && out_entry->palette_rgb && out_entry->labels &&
+               fread(out_entry->palette_rgb, 1, header->palette_count*3, file) == (size_t)header->palette_count*3 &&
+               fread(compressed, 1, header->compressed_label_size, file) == (size_t)header->compressed_label_size &&
+               stbi_zlib_decode_buffer((char *)out_entry->labels, label_size, compressed,
+                                       header->compressed_label_size) == label_size)
+            {
+                result = 1;
+            }
+            if(compressed) free(compressed);
+        }
+        fclose(file);
+
+        if(result) utime(path, 0);
+        else free_cache_entry(out_entry);
+    }
+    return result;
+}
+
+// NOTE: written to a temporary name first, so concurrent runs never read half an entry
+static int
+store_cache_entry(KmeansCache *cache, unsigned long long key, KmeansCacheEntry *entry)
+{
+    int result = 0;
+    char path[4096];
+    char temporary_path[4096 + 32];
+    get_cache_entry_path(cache, key, path, sizeof(path));
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", path, (int)getpid());
+
+    KmeansCacheHeader header = entry->header;
+    header.magic = KMEANS_CACHE_MAGIC;
+    int label_size = header.width * header.height * (int)sizeof(unsigned short);
+    unsigned char *compressed = stbi_zlib_compress((unsigned char *)entry->labels, label_size,
+                                                   &header.compressed_label_size, 8);
+    FILE *file = compressed ? fopen(temporary_path, "wb") : 0;
+    if(compressed && !file)
+    {
+        // NOTE: the directory is created on the first store, but not its parents
+        mkdir(cache->directory, 0755);
+        file = fopen(temporary_path, "wb");
+    }
+    if(file)
+    {
+        result = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+                 (fwrite(entry->palette_rgb, 1, header.palette_count*3, file) == (size_t)header.palette_count*3) &&
+                 (fwrite(compressed, 1, header.compressed_label_size, file) == (size_t)header.compressed_label_size);
+        result = (fclose(file) == 0) && result;
+        result = result && (rename(temporary_path, path) == 0);
+        if(!result) remove(temporary_path);
+    }
+    if(compressed) free(compressed);
+    return result;
+}
+
+// NOTE: removes the least recently used entries until the directory fits in size_limit
+static void
+evict_cache_entries(KmeansCache *cache)
+{
+    for(;;)
+    {
+        DIR *directory = opendir(cache->directory);
+        if(!directory) break;
+
+        unsigned long long total_size = 0;
+        char oldest_name[256] = {0};
+        time_t oldest_time = 0;
+        struct dirent *item;
+        while((item = readdir(directory)) != 0)
+        {
+            size_t name_len = string_len(item->d_name);
+            if(name_len < 4 || !string_equal(item->d_name + name_len - 4, ".kmc")) continue;
+
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", cache->directory, item->d_name);
+            struct stat status;
+            if(stat(path, &status) == 0)
+            {
+                total_size += (unsigned long long)status.st_size;
+                if(!oldest_name[0] || status.st_mtime < oldest_time)
+                {
+                    oldest_time = status.st_mtime;
+                    snprintf(oldest_name, sizeof(oldest_name), "%s", item->d_name);
+                }
+            }
+        }
+        closedir(directory);
+
+        if(total_size <= cache->size_limit || !oldest_name[0]) break;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, oldest_name);
+        if(remove(path) != 0) break;
+    }
+}
+
+// NOTE: the counters live next to the entries and are shared by every run on the directory,
+// the lock keeps concurrent runs from losing counts
+static void
+update_cache_counters(KmeansCache *cache, int is_hit)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/counters", cache->directory);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd != -1)
+    {
+        if(flock(fd, LOCK_EX) == 0)
+        {
+            unsigned long long counts[2] = {0, 0};
+            if(read(fd, counts, sizeof(counts)) != sizeof(counts))
+            {
+                counts[0] = 0;
+                counts[1] = 0;
+            }
+            counts[is_hit ? 0 : 1] += 1;
+            if(lseek(fd, 0, SEEK_SET) == 0 && write(fd, counts, sizeof(counts)) == sizeof(counts))
+            {
+                cache->hit_count = counts[0];
+                cache->miss_count = counts[1];
+            }
+            flock(fd, LOCK_UN);
+        }
+        close(fd);
+    }
+}
+#else
+static int
+load_cache_entry(KmeansCache *cache, unsigned long long key, int width, int height, KmeansCacheEntry *out_entry)
+{
+    clear_memory(out_entry, sizeof(*out_entry));
+    return 0;
+}
+
+static int
+store_cache_entry(KmeansCache *cache, unsigned long long key, KmeansCacheEntry *entry)
+{
+    return 0;
+}
+
+static void
+evict_cache_entries(KmeansCache *cache)
+{
+}
+
+static void
+update_cache_counters(KmeansCache *cache, int is_hit)
+{
+}
+#endif
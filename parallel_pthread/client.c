@@ -0,0 +1,221 @@
+
+#include "common.h"
+#include "daemon.h"
+#include <stdio.h>
+#include <limits.h>
+
+// NOTE: the daemon runs in its own working directory, so relative paths are sent absolute
+static char *
+make_absolute_path(char *path, char *buffer, size_t buffer_size)
+{
+    char *result = path;
+    if(path[0] != '/' && !string_equal(path, "-"))
+    {
+        char directory[PATH_MAX];
+        if(getcwd(directory, sizeof(directory)))
+        {
+            snprintf(buffer, buffer_size, "%s/%s", directory, path);
+            result = buffer;
+        }
+    }
+    return result;
+}
+
+static int
+connect_to_socket(char *path)
+{
+    int result = -1;
+    struct sockaddr_un address;
+    if(fill_socket_address(&address, path))
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd != -1)
+        {
+            if(connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) result = fd;
+            else close(fd);
+        }
+    }
+    return result;
+}
+
+static void *
+read_entire_file(char *path, long long *out_size)
+{
+    void *result = 0;
+    *out_size = 0;
+    FILE *file = string_equal(path, "-") ? stdin : fopen(path, "rb");
+    if(file)
+    {
+        size_t capacity = 1 << 20;
+        size_t size = 0;
+        char *buffer = (char *)malloc(capacity);
+        while(buffer)
+        {
+            size += fread(buffer + size, 1, capacity - size, file);
+            if(size < capacity) break;
+            capacity = align_to(capacity + capacity / 2, 4096);
+            char *grown = (char *)realloc(buffer, capacity);
+            if(!grown) free(buffer);
+            buffer = grown;
+        }
+        if(buffer && !ferror(file))
+        {
+            result = buffer;
+            *out_size = (long long)size;
+        }
+        else if(buffer)
+        {
+            free(buffer);
+        }
+        if(file != stdin) fclose(file);
+    }
+    return result;
+}
+
+int
+main(int arg_count, char **args)
+{
+    char *socket_path = 0;
+    int send_inline = 0;
+    int send_shutdown = 0;
+    int verbose = 1;
+    int parsing_arg_index = 1;
+    for(; parsing_arg_index < arg_count; ++parsing_arg_index)
+    {
+        char *option = args[parsing_arg_index];
+        if(string_skip_prefix(option, "--socket="))
+        {
+            socket_path = string_skip_prefix(option, "--socket=");
+        }
+        else if(string_equal(option, "--inline"))
+        {
+            send_inline = 1;
+        }
+        else if(string_equal(option, "--shutdown"))
+        {
+            send_shutdown = 1;
+        }
+        else if(string_equal(option, "--quiet"))
+        {
+            verbose = 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // NOTE: everything after the client options is passed on as the kmeans arguments
+    int job_arg_count = arg_count - parsing_arg_index;
+    char **job_args = args + parsing_arg_index;
+    if(!socket_path || (!send_shutdown && job_arg_count < 2))
+    {
+        printf("usage: kmeans_client --socket={path} [--inline] [--quiet] [kmeans option] ... input_path output_path\n"
+               "       kmeans_client --socket={path} --shutdown\n"
+               "    --inline  send the content of input_path ('-' reads stdin) instead of the path\n"
+               "    --quiet   only report through the exit code\n");
+        return 2;
+    }
+
+    int result = 1;
+    char input_path[PATH_MAX + 256];
+    char output_path[PATH_MAX + 256];
+    char cache_directory[PATH_MAX + 256];
+    char cache_path[PATH_MAX + 256];
+    void *inline_data = 0;
+    long long inline_size = 0;
+    KmeansDaemonRequest request;
+    clear_memory(&request, sizeof(request));
+    request.magic = KMEANS_DAEMON_MAGIC;
+    request.command = send_shutdown ? KmeansDaemonCommand_shutdown : KmeansDaemonCommand_run;
+    if(send_shutdown) job_arg_count = 0;
+
+    char **sent_args = (char **)malloc((job_arg_count + 1) * sizeof(char *));
+    for(int i = 0; sent_args && i < job_arg_count; ++i)
+    {
+        char *arg = job_args[i];
+        if(i == job_arg_count - 2)
+        {
+            if(send_inline)
+            {
+                inline_data = read_entire_file(arg, &inline_size);
+                if(!inline_data && verbose) printf("ERROR: read '%s' failed\n", arg);
+                arg = "-";
+            }
+            else
+            {
+                arg = make_absolute_path(arg, input_path, sizeof(input_path));
+            }
+        }
+        else if(i == job_arg_count - 1)
+        {
+            arg = make_absolute_path(arg, output_path, sizeof(output_path));
+        }
+        else if(string_skip_prefix(arg, "--cache="))
+        {
+            snprintf(cache_path, sizeof(cache_path), "--cache=%s",
+                     make_absolute_path(string_skip_prefix(arg, "--cache="), cache_directory, sizeof(cache_directory)));
+            arg = cache_path;
+        }
+        sent_args[i] = arg;
+        request.arg_count += 1;
+        request.args_size += (int)string_len(arg) + 1;
+    }
+    request.inline_size = inline_size;
+
+    if(sent_args && (!send_inline || inline_data))
+    {
+        int fd = connect_to_socket(socket_path);
+        if(fd != -1)
+        {
+            int sent = write_socket_exact(fd, &request, sizeof(request));
+            for(int i = 0; sent && i < request.arg_count; ++i)
+            {
+                sent = write_socket_exact(fd, sent_args[i], string_len(sent_args[i]) + 1);
+            }
+            if(sent && inline_size) sent = write_socket_exact(fd, inline_data, (size_t)inline_size);
+
+            KmeansDaemonResponse response;
+            if(sent && read_socket_exact(fd, &response, sizeof(response)) && response.magic == KMEANS_DAEMON_MAGIC)
+            {
+                response.message[sizeof(response.message) - 1] = 0;
+                result = response.status ? 1 : 0;
+                if(verbose)
+                {
+                    if(send_shutdown || response.status)
+                    {
+                        printf("%s%s\n", response.status ? "ERROR: " : "", response.message);
+                    }
+                    else
+                    {
+                        printf("[summary]\n");
+                        printf("    size = %dx%d\n", response.width, response.height);
+                        printf("    used iteration = %d\n", response.used_iteration);
+                        if(!response.use_features) printf("    sse = %llu\n", response.sse);
+                        else printf("    sse = %f\n", response.feature_sse);
+                        printf("    best restart = %d\n", response.best_restart);
+                        if(response.coarse_iteration) printf("    coarse iteration = %d\n", response.coarse_iteration);
+                        printf("    cache = %s\n", response.cache_hit ? "hit" : "miss");
+                        printf("    queue time = %fs\n", response.queue_seconds);
+                        printf("    decode time = %fs\n", response.decode_seconds);
+                        printf("    time = %fs\n", response.cluster_seconds);
+                        printf("    encode time = %fs\n", response.encode_seconds);
+                    }
+                }
+            }
+            else
+            {
+                if(verbose) printf("ERROR: no answer from '%s'\n", socket_path);
+            }
+            close(fd);
+        }
+        else
+        {
+            if(verbose) printf("ERROR: connect to '%s' failed\n", socket_path);
+        }
+    }
+
+    if(inline_data) free(inline_data);
+    if(sent_args) free(sent_args);
+    return result;
+}
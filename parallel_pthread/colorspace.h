@@ -0,0 +1,321 @@
+#include <math.h>
+
+typedef enum ColorSpace
+{
+    ColorSpace_srgb,
+    ColorSpace_oklab,
+    ColorSpace_cielab,
+} ColorSpace;
+
+// NOTE: sRGB bytes to linear light, filled by init_color_space_tables
+static float srgb_to_linear_table[256];
+
+static int
+parse_color_space(ColorSpace *space, char *text)
+{
+    int result = 1;
+    if(string_equal(text, "srgb")) *space = ColorSpace_srgb;
+    else if(string_equal(text, "oklab")) *space = ColorSpace_oklab;
+    else if(string_equal(text, "cielab") || string_equal(text, "lab")) *space = ColorSpace_cielab;
+    else result = 0;
+    return result;
+}
+
+// NOTE: roughly the extent of the lightness axis, used to weigh other features against the color
+static float
+get_color_space_range(ColorSpace space)
+{
+    float result = 255.0f;
+    if(space == ColorSpace_oklab) result = 1.0f;
+    else if(space == ColorSpace_cielab) result = 100.0f;
+    return result;
+}
+
+static float
+srgb_to_linear(float value)
+{
+    float result = (value <= 0.04045f) ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+    return result;
+}
+
+static float
+linear_to_srgb(float value)
+{
+    float result = (value <= 0.0031308f) ? value * 12.92f : 1.055f*powf(value, 1.0f / 2.4f) - 0.055f;
+    return result;
+}
+
+static void
+init_color_space_tables(void)
+{
+    for(int i = 0; i < 256; ++i)
+    {
+        srgb_to_linear_table[i] = srgb_to_linear(i / 255.0f);
+    }
+}
+
+static unsigned char
+unit_to_byte(float value)
+{
+    float scaled = value*255.0f + 0.5f;
+    if(scaled < 0.0f) scaled = 0.0f;
+    if(scaled > 255.0f) scaled = 255.0f;
+    return (unsigned char)scaled;
+}
+
+// NOTE: the linearisation fills rows of this many pixels first, so that the arithmetic after it has
+// no table lookups, and that runs on lanes copied to locals so that it has no aliasing either
+#define COLOR_SPACE_BLOCK_SIZE 256
+#define COLOR_SPACE_LANE_COUNT 8
+
+// NOTE: selects of floats, and of anything computed on only one side, become branches that stop the
+// vectoriser. The ones below compare the bits as ints, which orders the same as the floats for non
+// negative values, and blend them with a mask.
+static inline int
+get_float_bits(float value)
+{
+    union { float f; int i; } bits;
+    bits.f = value;
+    return bits.i;
+}
+
+static inline float
+get_bits_float(int value)
+{
+    union { float f; int i; } bits;
+    bits.i = value;
+    return bits.f;
+}
+
+// NOTE: branch free so that it vectorises unlike cbrtf. The exponent is divided by three on the bits
+// for a seed within a few percent, two Halley steps take that to float precision. 0 stays 0.
+static inline float
+cube_root(float value)
+{
+    int value_bits = get_float_bits(value);
+    float x = get_bits_float((int)((unsigned int)value_bits / 3 + 0x2a5137a0));
+    for(int step = 0; step < 2; ++step)
+    {
+        float cube = x*x*x;
+        x = x*(cube + 2.0f*value) / (2.0f*cube + value);
+    }
+    int keep_mask = -(value_bits > 0);
+    return get_bits_float(get_float_bits(x) & keep_mask);
+}
+
+static inline float
+cielab_f(float t)
+{
+    // NOTE: (6/29)^3 and 1/(3*(6/29)^2), both sides are computed so that the select vectorises
+    int root_bits = get_float_bits(cube_root(t));
+    int line_bits = get_float_bits(t*7.787037f + 4.0f / 29.0f);
+    int root_mask = -(get_float_bits(t) > get_float_bits(0.008856452f));
+    return get_bits_float((root_bits & root_mask) | (line_bits & ~root_mask));
+}
+
+static float
+cielab_f_inverse(float t)
+{
+    return (t > 6.0f / 29.0f) ? t*t*t : (t - 4.0f / 29.0f) / 7.787037f;
+}
+
+// NOTE: count pixels of linear light into the space, srgb keeps the encoded values instead and never
+// comes through here
+static void
+convert_linear_to_color_space(ColorSpace space, float *linear_r, float *linear_g, float *linear_b, int count, 
+                              float *out_x, float *out_y, float *out_z)
+{
+    for(int group_first = 0; group_first < count; group_first += COLOR_SPACE_LANE_COUNT)
+    {
+        int lane_count = count - group_first;
+        if(lane_count > COLOR_SPACE_LANE_COUNT) lane_count = COLOR_SPACE_LANE_COUNT;
+        float r[COLOR_SPACE_LANE_COUNT] = {0}, g[COLOR_SPACE_LANE_COUNT] = {0}, b[COLOR_SPACE_LANE_COUNT] = {0};
+        for(int lane = 0; lane < lane_count; ++lane)
+        {
+            r[lane] = linear_r[group_first + lane];
+            g[lane] = linear_g[group_first + lane];
+            b[lane] = linear_b[group_first + lane];
+        }
+        float x[COLOR_SPACE_LANE_COUNT], y[COLOR_SPACE_LANE_COUNT], z[COLOR_SPACE_LANE_COUNT];
+        if(space == ColorSpace_oklab)
+        {
+            for(int lane = 0; lane < COLOR_SPACE_LANE_COUNT; ++lane)
+            {
+                float l = cube_root(0.4122214708f*r[lane] + 0.5363325363f*g[lane] + 0.0514459929f*b[lane]);
+                float m = cube_root(0.2119034982f*r[lane] + 0.6806995451f*g[lane] + 0.1073969566f*b[lane]);
+                float s = cube_root(0.0883024619f*r[lane] + 0.2817188376f*g[lane] + 0.6299787005f*b[lane]);
+                x[lane] = 0.2104542553f*l + 0.7936177850f*m - 0.0040720468f*s;
+                y[lane] = 1.9779984951f*l - 2.4285922050f*m + 0.4505937099f*s;
+                z[lane] = 0.0259040371f*l + 0.7827717662f*m - 0.8086757660f*s;
+            }
+        }
+        else
+        {
+            for(int lane = 0; lane < COLOR_SPACE_LANE_COUNT; ++lane)
+            {
+                // NOTE: D65 white
+                float fx = cielab_f((0.4124564f*r[lane] + 0.3575761f*g[lane] + 0.1804375f*b[lane]) / 0.95047f);
+                float fy = cielab_f(0.2126729f*r[lane] + 0.7151522f*g[lane] + 0.0721750f*b[lane]);
+                float fz = cielab_f((0.0193339f*r[lane] + 0.1191920f*g[lane] + 0.9503041f*b[lane]) / 1.08883f);
+                x[lane] = 116.0f*fy - 16.0f;
+                y[lane] = 500.0f*(fx - fy);
+                z[lane] = 200.0f*(fy - fz);
+            }
+        }
+        for(int lane = 0; lane < lane_count; ++lane)
+        {
+            out_x[group_first + lane] = x[lane];
+            out_y[group_first + lane] = y[lane];
+            out_z[group_first + lane] = z[lane];
+        }
+    }
+}
+
+static void
+convert_color_space_to_linear(ColorSpace space, float x, float y, float z, float *out)
+{
+    if(space == ColorSpace_oklab)
+    {
+        float l = x + 0.3963377774f*y + 0.2158037573f*z;
+        float m = x - 0.1055613458f*y - 0.0638541728f*z;
+        float s = x - 0.0894841775f*y - 1.2914855480f*z;
+        l = l*l*l;
+        m = m*m*m;
+        s = s*s*s;
+        out[0] = 4.0767416621f*l - 3.3077115913f*m + 0.2309699292f*s;
+        out[1] = -1.2684380046f*l + 2.6097574011f*m - 0.3413193965f*s;
+        out[2] = -0.0041960863f*l - 0.7034186147f*m + 1.7076147010f*s;
+    }
+    else
+    {
+        float fy = (x + 16.0f) / 116.0f;
+        float fx = fy + y / 500.0f;
+        float fz = fy - z / 200.0f;
+        float X = 0.95047f*cielab_f_inverse(fx);
+        float Y = cielab_f_inverse(fy);
+        float Z = 1.08883f*cielab_f_inverse(fz);
+        out[0] = 3.2404542f*X - 1.5371385f*Y - 0.4985314f*Z;
+        out[1] = -0.9692660f*X + 1.8760108f*Y + 0.0415560f*Z;
+        out[2] = 0.0556434f*X - 0.2040259f*Y + 1.0572252f*Z;
+    }
+    // NOTE: means of in gamut colors can still land slightly outside after the round trip
+    for(int i = 0; i < 3; ++i)
+    {
+        if(out[i] < 0.0f) out[i] = 0.0f;
+    }
+}
+
+// NOTE: converts count pixels given as separate r, g, b byte rows into the space, the
+// linearisation goes through the table so only the cube roots are left per pixel
+static void
+convert_srgb_to_color_space(ColorSpace space, unsigned char *r, unsigned char *g, unsigned char *b, int stride, 
+                            int count, float *out_x, float *out_y, float *out_z)
+{
+    if(space == ColorSpace_srgb)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            out_x[i] = r[i*stride];
+            out_y[i] = g[i*stride];
+            out_z[i] = b[i*stride];
+        }
+    }
+    else
+    {
+        float linear_r[COLOR_SPACE_BLOCK_SIZE], linear_g[COLOR_SPACE_BLOCK_SIZE], linear_b[COLOR_SPACE_BLOCK_SIZE];
+        for(int block_first = 0; block_first < count; block_first += COLOR_SPACE_BLOCK_SIZE)
+        {
+            int block_count = count - block_first;
+            if(block_count > COLOR_SPACE_BLOCK_SIZE) block_count = COLOR_SPACE_BLOCK_SIZE;
+            for(int i = 0; i < block_count; ++i)
+            {
+                int offset = (block_first + i)*stride;
+                linear_r[i] = srgb_to_linear_table[r[offset]];
+                linear_g[i] = srgb_to_linear_table[g[offset]];
+                linear_b[i] = srgb_to_linear_table[b[offset]];
+            }
+            convert_linear_to_color_space(space, linear_r, linear_g, linear_b, block_count, 
+                                          out_x + block_first, out_y + block_first, out_z + block_first);
+        }
+    }
+}
+
+static void
+convert_color_space_to_srgb(ColorSpace space, float x, float y, float z, unsigned char *out_rgb)
+{
+    if(space == ColorSpace_srgb)
+    {
+        out_rgb[0] = unit_to_byte(x / 255.0f);
+        out_rgb[1] = unit_to_byte(y / 255.0f);
+        out_rgb[2] = unit_to_byte(z / 255.0f);
+    }
+    else
+    {
+        float linear[3];
+        convert_color_space_to_linear(space, x, y, z, linear);
+        out_rgb[0] = unit_to_byte(linear_to_srgb(linear[0]));
+        out_rgb[1] = unit_to_byte(linear_to_srgb(linear[1]));
+        out_rgb[2] = unit_to_byte(linear_to_srgb(linear[2]));
+    }
+}
+
+// NOTE: count r, g, b float triplets, sRGB encoded in 0 ~ max_value or linear light when max_value
+// is 0. srgb keeps the values as they are.
+static void
+convert_wide_to_color_space(ColorSpace space, float *rgb, float max_value, int count, 
+                            float *out_x, float *out_y, float *out_z)
+{
+    if(space == ColorSpace_srgb)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            out_x[i] = rgb[i*3 + 0];
+            out_y[i] = rgb[i*3 + 1];
+            out_z[i] = rgb[i*3 + 2];
+        }
+    }
+    else
+    {
+        float linear_r[COLOR_SPACE_BLOCK_SIZE], linear_g[COLOR_SPACE_BLOCK_SIZE], linear_b[COLOR_SPACE_BLOCK_SIZE];
+        for(int block_first = 0; block_first < count; block_first += COLOR_SPACE_BLOCK_SIZE)
+        {
+            int block_count = count - block_first;
+            if(block_count > COLOR_SPACE_BLOCK_SIZE) block_count = COLOR_SPACE_BLOCK_SIZE;
+            for(int i = 0; i < block_count; ++i)
+            {
+                float *pixel = rgb + (block_first + i)*3;
+                linear_r[i] = max_value > 0 ? srgb_to_linear(pixel[0] / max_value) : pixel[0];
+                linear_g[i] = max_value > 0 ? srgb_to_linear(pixel[1] / max_value) : pixel[1];
+                linear_b[i] = max_value > 0 ? srgb_to_linear(pixel[2] / max_value) : pixel[2];
+            }
+            convert_linear_to_color_space(space, linear_r, linear_g, linear_b, block_count, 
+                                          out_x + block_first, out_y + block_first, out_z + block_first);
+        }
+    }
+}
+
+static void
+convert_color_space_to_wide(ColorSpace space, float x, float y, float z, float max_value, float *out_rgb)
+{
+    if(space == ColorSpace_srgb)
+    {
+        out_rgb[0] = x;
+        out_rgb[1] = y;
+        out_rgb[2] = z;
+    }
+    else
+    {
+        float linear[3];
+        convert_color_space_to_linear(space, x, y, z, linear);
+        for(int channel = 0; channel < 3; ++channel)
+        {
+            float value = linear[channel];
+            if(max_value > 0)
+            {
+                if(value > 1.0f) value = 1.0f;
+                value = linear_to_srgb(value) * max_value;
+            }
+            out_rgb[channel] = value;
+        }
+    }
+}
@@ -11,6 +11,29 @@ string_len(char *string)
     return result;
 }
 
+static int
+string_equal(char *a, char *b)
+{
+    while(*a && *a == *b)
+    {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+// NOTE: returns the rest of the string when it starts with prefix, otherwise 0
+static char *
+string_skip_prefix(char *string, char *prefix)
+{
+    while(*prefix && *string == *prefix)
+    {
+        ++string;
+        ++prefix;
+    }
+    return *prefix ? 0 : string;
+}
+
 static size_t
 align_to(size_t value, size_t alignment)
 {
@@ -28,3 +51,15 @@ clear_memory(void *ptr, size_t size)
         *byte_ptr++ = 0;
     }
 }
+
+static void 
+copy_memory(void *dest, void *source, size_t size)
+{
+    char *dest_ptr = (char *)dest;
+    char *source_ptr = (char *)source;
+    char *dest_sentinel = (char *)dest + size;
+    while(dest_ptr != dest_sentinel)
+    {
+        *dest_ptr++ = *source_ptr++;
+    }
+}
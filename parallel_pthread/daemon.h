@@ -0,0 +1,98 @@
+#define KMEANS_DAEMON_MAGIC 0x44534d4b // "KMSD"
+#define KMEANS_DAEMON_MAX_ARGS_SIZE (64 << 10)
+#define KMEANS_DAEMON_MAX_INLINE_SIZE (1 << 30)
+#define KMEANS_DAEMON_MESSAGE_SIZE 256
+
+#if defined(__unix__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef enum KmeansDaemonCommand
+{
+    KmeansDaemonCommand_run,
+    KmeansDaemonCommand_shutdown,
+} KmeansDaemonCommand;
+
+// NOTE: a request is this header, args_size bytes of NUL terminated arguments laid out like a
+// command line ending in input_path output_path, then inline_size bytes of an encoded image
+// that replaces the input when the input path is "-". Both ends run on the same machine, so
+// the structs go over the socket as they are.
+typedef struct KmeansDaemonRequest
+{
+    unsigned int magic;
+    int command;
+    int arg_count;
+    int args_size;
+    long long inline_size;
+} KmeansDaemonRequest;
+
+typedef struct KmeansDaemonResponse
+{
+    unsigned int magic;
+    int status; // KmeansJobStatus, 0 is success
+    int width, height;
+    int used_iteration;
+    int coarse_iteration;
+    int best_restart;
+    int use_features;
+    int cache_hit;
+    unsigned long long sse;
+    double feature_sse;
+    double queue_seconds;  // waiting behind earlier jobs
+    double decode_seconds;
+    double cluster_seconds;
+    double encode_seconds;
+    char message[KMEANS_DAEMON_MESSAGE_SIZE];
+} KmeansDaemonResponse;
+
+#if defined(__unix__)
+static int
+read_socket_exact(int fd, void *data, size_t size)
+{
+    char *at = (char *)data;
+    while(size)
+    {
+        ssize_t read_size = recv(fd, at, size, 0);
+        if(read_size <= 0) return 0;
+        at += read_size;
+        size -= (size_t)read_size;
+    }
+    return 1;
+}
+
+// NOTE: MSG_NOSIGNAL so that a peer hanging up turns into an error instead of SIGPIPE
+static int
+write_socket_exact(int fd, void *data, size_t size)
+{
+    char *at = (char *)data;
+    while(size)
+    {
+        ssize_t written_size = send(fd, at, size, MSG_NOSIGNAL);
+        if(written_size <= 0) return 0;
+        at += written_size;
+        size -= (size_t)written_size;
+    }
+    return 1;
+}
+
+static int
+fill_socket_address(struct sockaddr_un *address, char *path)
+{
+    int result = 0;
+    clear_memory(address, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if(string_len(path) < sizeof(address->sun_path))
+    {
+        copy_memory(address->sun_path, path, string_len(path) + 1);
+        result = 1;
+    }
+    return result;
+}
+#endif
@@ -2,12 +2,58 @@
 #include "common.h"
 #include "thread.h"
 #include "profile.h"
+#include "trace.h"
+#include "perf_counter.h"
+#include "numa.h"
+#include "colorspace.h"
+#include "arena.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 #include <stdio.h>
+#include "cache.h"
+#include "daemon.h"
 #include <malloc.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+
+#define KMEANS_TILE_PIXEL_COUNT 4096
+#define KMEANS_RESTART_PRUNE_ITERATION 4
+#define BISECT_MAX_ITERATION 16
+// NOTE: margins are compared against drifts summed over many iterations, keep a bit of slack
+// so that float rounding never skips a pixel that would have migrated
+#define KMEANS_MARGIN_EPSILON (1.0f / 64.0f)
+#define FEATURE_MAX_DIMENSION 8
+#define FEATURE_LANE_COUNT 8
+#define KMEANS_LANE_COUNT 8
+// NOTE: above the largest specialised count the distances are computed in blocks, see
+// classify_large_tile
+#define KMEANS_LARGE_CLUSTER_COUNT 64
+#define KMEANS_LARGE_PIXEL_BLOCK 256
+#define KMEANS_LARGE_CLUSTER_BLOCK 128
+// NOTE: the Morton code of a color is 24 bits, sorted 8 bits per pass
+#define MORTON_RADIX_BITS 8
+#define MORTON_RADIX_BUCKET_COUNT (1 << MORTON_RADIX_BITS)
+#define MORTON_RADIX_PASS_COUNT 3
+#define PYRAMID_MAX_LEVEL_COUNT 16
+#define PYRAMID_DEFAULT_FINE_ITERATION 2
+#define PALETTE_LUT_CELL_BITS 5
+#define PALETTE_LUT_CELL_COUNT (1 << (3*PALETTE_LUT_CELL_BITS))
+// NOTE: finer than the palette table, a memo cell has no candidate list so it has to be small
+// enough to fall inside one cluster's region most of the time
+#define KMEANS_MEMO_CELL_BITS 6
+#define KMEANS_MEMO_CELL_COUNT (1 << (3*KMEANS_MEMO_CELL_BITS))
+#define KMEANS_MEMO_AMBIGUOUS 0xffff
+#define PALETTE_LUT_AMBIGUOUS 0x80000000u
+#define PALETTE_MAX_COLOR_COUNT 65536
+#define DITHER_BLOCK_PIXEL_COUNT 64
+#define DITHER_PROGRESS_STRIDE (128 / sizeof(int))
+#define DITHER_NEIGHBOUR_SAMPLE_COUNT 1024
+#define DITHER_SPIN_COUNT 1024
+// NOTE: bump whenever a change alters the output of an option set, it invalidates the cache
+#define KMEANS_ENGINE_VERSION 2
 
 typedef struct Color4
 {
@@ -17,40 +63,439 @@ typedef struct Color4
 typedef struct Image
 {
     int width, height;
+    int is_16_bit;
+    int is_hdr;
     FILE *handle;
 } Image;
 
-typedef struct KmeansFilterWork
+// NOTE: pixels of 16 bit and HDR images as r, g, b floats, which hold every 16 bit value exactly.
+// Values are sRGB encoded in 0 ~ max_value, or linear light when max_value is 0 (HDR).
+typedef struct WideBitmap
+{
+    float *rgb;
+    float max_value;
+} WideBitmap;
+
+typedef struct KmeansSums
+{
+    int migration_count;
+    unsigned long long *cluster_sums_r;
+    unsigned long long *cluster_sums_g;
+    unsigned long long *cluster_sums_b;
+    unsigned long long *cluster_sums_sq; // NOTE: r*r + g*g + b*b, gives the SSE without another pass
+    int *cluster_pixel_counts;
+} KmeansSums;
+
+// NOTE: the tiles of one thread's slice, claimed front to back by the owner first and
+// stolen by the other threads once their own range runs dry
+typedef struct KmeansTileRange
+{
+    volatile int next_tile;
+    int first_tile;
+    int end_tile;
+    int node_index;
+    char padding[128 - 4*sizeof(int)];
+} KmeansTileRange;
+
+// NOTE: active_pixel_count pixels of the tile, listed in the tile's slice of active_pixels, are
+// re-classified every iteration. The others are only looked at again once the global drift
+// reaches expand_drift, the smallest margin left among them.
+typedef struct KmeansActiveTile
 {
+    int active_pixel_count;
+    double expand_drift;
+} KmeansActiveTile;
+
+typedef struct KmeansNode
+{
+    volatile int remaining_tile_count;
+    int tile_count;
+    int range_count;
+    int *range_indices;
+    KmeansSums sums;
+} KmeansNode;
+
+typedef struct BisectTree BisectTree;
+
+// NOTE: a node of the bisecting tree owns pixel_order[first_pixel ~ first_pixel+pixel_count) and
+// the clusters first_cluster ~ first_cluster+cluster_count
+typedef struct BisectNode
+{
+    BisectTree *tree;
+    int first_pixel;
     int pixel_count;
+    int first_cluster;
     int cluster_count;
+    unsigned long long sse; // NOTE: leaves only
+} BisectNode;
+
+struct BisectTree
+{
+    WorkQueue *queue;
     Color4 *pixels;
+    int *pixel_order;
+    unsigned char *pixel_sides;
     Color4 *cluster_colors;
+    int *cluster_indices;
+    BisectNode *nodes;
+    volatile int node_count;
+};
+
+// NOTE: one float array per channel, each padded by FEATURE_LANE_COUNT so that the lane loops
+// can read a whole block past the last pixel. The first 3 channels are the color, with
+// spatial_scale > 0 the pixel's x and y times spatial_scale follow.
+typedef struct FeatureSet
+{
+    int pixel_count;
+    int dimension;
+    int width;
+    float spatial_scale;
+    float *channels[FEATURE_MAX_DIMENSION];
+} FeatureSet;
+
+typedef struct KmeansOptions
+{
+    int cluster_count;
+    int max_iteration;
+    float migration_threshold;
+    float sse_tolerance;
+    float max_shift;
+    int full_update_period;
+    int use_active_set;
+    int restart_count;
+    int use_bisecting;
+    int bisect_refine_iteration;
+    ColorSpace color_space;
+    float spatial_weight;
+    float sample_fraction;
+    Color4 *initial_cluster_colors;
+    int use_memo_grid;
+    int use_color_sort;
+    int report_perf_counters;
+} KmeansOptions;
+
+typedef struct KmeansResult
+{
+    int used_iteration;
+    int best_restart;
+    unsigned long long sse;
+    double feature_sse;
+    int coarse_iteration;
+} KmeansResult;
+
+typedef struct KmeansFilter
+{
+    char *working_memory;
+    int running;
+    int candidate;
+    int pruned;
+    int used_iteration;
+    int total_migration_count;
+    int max_shift_squared;
+    unsigned long long sse;
+    unsigned long long previous_sse;
     
+    int pixel_count;
+    int cluster_count;
+    int thread_count;
+    int node_count;
+    int tile_count;
+    int tile_per_thread;
+    int iteration;
+    int full_update;
+    Color4 *pixels;
+    Color4 *cluster_colors;
     int *cluster_indices;
-    int out_migration_count;
+    Color4 *output;
+    
+    KmeansTileRange *tile_ranges;
+    KmeansNode *nodes;
+    KmeansSums *tile_sums;
+    KmeansSums total_sums;
+    Color4 *previous_cluster_colors;
+    
+    // NOTE: active set, only used when active_tiles is set. A pixel of cluster c can't have
+    // migrated while cluster_drifts[c] < pixel_expire_drifts[i], see update_active_set_drifts
+    KmeansActiveTile *active_tiles;
+    unsigned short *active_pixels;
+    float *pixel_expire_drifts;
+    double *cluster_drifts;
+    double global_drift;
+    double drift_band;
     
-    unsigned long long *out_cluster_sums_r;
-    unsigned long long *out_cluster_sums_g;
-    unsigned long long *out_cluster_sums_b;
-    int *out_cluster_pixel_counts;
+    // NOTE: memo grid, only used when memo_cells is set, see get_memo_cluster_index
+    volatile unsigned int *memo_cells;
+    unsigned int memo_generation;
+    
+    // NOTE: float features, only used when features is set. The centroids are laid out as
+    // [d*cluster_count + c] and each tile owns tile_feature_stride doubles: the per cluster
+    // channel sums, the per cluster counts, the SSE and the migration count.
+    FeatureSet *features;
+    ColorSpace color_space;
+    WideBitmap *wide_pixels;
+    WideBitmap *wide_output;
+    float *wide_cluster_colors;
+    float *feature_centroids;
+    double *tile_feature_sums;
+    size_t tile_feature_stride;
+    double feature_sse;
+    double previous_feature_sse;
+    double feature_max_shift_squared;
+} KmeansFilter;
+
+typedef void KmeansTileCallback(KmeansFilter *filter, int tile_index);
+
+// NOTE: a work runs over the tiles of every running filter, so restarts fill the thread pool
+// together instead of one after another
+typedef struct KmeansFilterWork
+{
+    KmeansFilter *filters;
+    int filter_count;
+    int thread_index;
+    int out_stolen_tile_count;
+    PerfCounters out_perf_counters;
+    KmeansTileCallback *callback;
+    char *trace_name;
 } KmeansFilterWork;
 
-typedef struct FillImageWork
+typedef struct FirstTouchWork
 {
     int pixel_count;
-    int *cluster_indices;
-    Color4 *cluster_colors;
-    
+    int thread_count;
+    size_t element_size;
+    char *array;
+} FirstTouchWork;
+
+typedef struct OwnedWork
+{
+    WorkQueueEntryCallback *callback;
+    char *first_work;
+    size_t work_stride;
+} OwnedWork;
+
+// NOTE: everything that decides the output besides the pixels. The thread count, affinity,
+// --incremental, --active-set and --memo-grid never change the output so they aren't part of it,
+// that way their runs share entries. All fields are 4 bytes, so no padding.
+typedef struct KmeansCacheKey
+{
+    int version;
+    int width, height;
+    int keep_alpha;
+    int cluster_count;
+    int max_iteration;
+    float migration_threshold;
+    float sse_tolerance;
+    float max_shift;
+    int restart_count;
+    int use_bisecting;
+    int bisect_refine_iteration;
+    int color_space;
+    float spatial_weight;
+    float sample_fraction;
+    int pyramid_level_count;
+    int pyramid_iterations[PYRAMID_MAX_LEVEL_COUNT];
+    int use_color_sort;
+} KmeansCacheKey;
+
+typedef enum DitherMode
+{
+    DitherMode_none,
+    DitherMode_floyd_steinberg,
+    DitherMode_atkinson,
+    DitherMode_bayer,
+} DitherMode;
+
+typedef enum KmeansJobStatus
+{
+    KmeansJobStatus_ok,
+    KmeansJobStatus_bad_output_path,
+    KmeansJobStatus_read_failed,
+    KmeansJobStatus_write_failed,
+    KmeansJobStatus_out_of_memory,
+    KmeansJobStatus_palette_read_failed,
+    KmeansJobStatus_bad_request,
+} KmeansJobStatus;
+
+// NOTE: one run of the program as parsed from its arguments, the daemon parses the arguments
+// of every request into one of these as well
+typedef struct KmeansJob
+{
+    int verbose;
+    int thread_count;
+    int cluster_count;
+    int max_iteration;
+    float migration_threshold;
+    float sse_tolerance;
+    float max_shift;
+    int full_update_period;
+    int use_active_set;
+    int use_memo_grid;
+    int use_color_sort;
+    int restart_count;
+    int use_bisecting;
+    int bisect_refine_iteration;
+    ColorSpace color_space;
+    float spatial_weight;
+    int use_alpha;
+    float sample_fraction;
+    int pyramid_level_count;
+    int pyramid_iterations[PYRAMID_MAX_LEVEL_COUNT];
+    int pyramid_iteration_count;
+    DitherMode dither_mode;
+    KmeansCache cache;
+    AffinityOption affinity_option;
+    HugePageMode huge_page_mode;
+    char *trace_path;
+    int perf_counters;
+    char *daemon_path;
+    char *palette_in_path;
+    char *palette_out_path;
+    char *input_path;
+    char *output_path;
+    void *input_data; // NOTE: an encoded image that replaces input_path when not 0
+    size_t input_data_size;
+} KmeansJob;
+
+typedef struct KmeansJobStats
+{
+    KmeansJobStatus status;
+    int width, height;
+    int use_features;
+    int cache_hit;
+    KmeansResult result;
+    unsigned long long decode_time;
+    unsigned long long cluster_time;
+    unsigned long long encode_time;
+} KmeansJobStats;
+
+typedef struct KmeansDaemonJob
+{
+    struct KmeansDaemon *daemon;
+    struct KmeansDaemonJob *next;
+    int fd;
+    KmeansDaemonRequest request;
+    KmeansDaemonResponse response;
+    char *arg_text;
+    char **args;
+    void *inline_data;
+    unsigned long long queued_time;
+    Semaphore done;
+} KmeansDaemonJob;
+
+typedef struct KmeansDaemon
+{
+    int listen_fd;
+    int served_count;
+    TicketMutex job_mutex;
+    Semaphore job_semaphore;
+    Semaphore shutdown_semaphore;
+    KmeansDaemonJob *first_job;
+    KmeansDaemonJob *last_job;
+} KmeansDaemon;
+
+// NOTE: a cell covers a (256 >> PALETTE_LUT_CELL_BITS)^3 box of colors. Its entry is the label of
+// the only palette color that can be nearest anywhere in the box, or PALETTE_LUT_AMBIGUOUS and
+// the offset of its candidates: a count followed by that many labels in palette order.
+typedef struct PaletteLut
+{
+    Color4 *colors;
+    int color_count;
+    unsigned int *cell_entries;
+    int *cell_candidate_counts;
+    int *candidates;
+    int candidate_size;
+} PaletteLut;
+
+typedef struct PaletteLutWork
+{
+    PaletteLut *lut;
+    int first_cell, cell_count;
+    int fill_candidates;
+} PaletteLutWork;
+
+typedef struct PaletteApplyWork
+{
+    PaletteLut *lut;
+    Color4 *pixels;
+    Color4 *output;
+    int first_pixel, pixel_count;
+    int keep_alpha;
+    unsigned long long sse;
+} PaletteApplyWork;
+
+typedef struct DitherTap
+{
+    int x, y;
+    int weight;
+} DitherTap;
+
+// NOTE: error diffusion runs the rows as a wavefront. A row may only take a pixel once the row
+// above has finished the pixel above and to the right of it, the last one that diffuses into it
+// with either kernel. Rows are claimed in order, so a row only ever waits on rows that are
+// already running. The errors of the rows below live in a ring of error_row_count rows.
+typedef struct DitherState
+{
+    PaletteLut *lut;
+    Color4 *pixels;
+    Color4 *output;
+    int width, height;
+    int keep_alpha;
+    DitherMode mode;
+    DitherTap *taps;
+    int tap_count;
+    int weight_shift;
+    int bayer_spread;
+    volatile int next_row;
+    volatile int *row_progress; // pixels done per row, DITHER_PROGRESS_STRIDE apart
+    int *row_errors;
+    int error_row_count;
+    int error_row_stride;
+} DitherState;
+
+typedef struct DitherWork
+{
+    DitherState *state;
+} DitherWork;
+
+typedef struct DownsampleWork
+{
+    Color4 *source;
+    int source_width, source_height;
+    Color4 *dest;
+    int dest_width, dest_height;
+    int first_row, row_count;
+} DownsampleWork;
+
+// NOTE: one slice of one pass of the radix sort. bucket_offsets is the slice's histogram
+// first and then where the slice's first pixel of every bucket goes. key_pixels is only set
+// on the first pass, which computes the keys, and out_pixels only on the last one, which
+// gathers the sorted pixels.
+typedef struct RadixSortWork
+{
+    Color4 *key_pixels;
+    Color4 *pixels;
     Color4 *out_pixels;
-} FillImageWork;
+    unsigned int *keys, *out_keys;
+    int *indices, *out_indices;
+    int first, count;
+    int shift;
+    int bucket_offsets[MORTON_RADIX_BUCKET_COUNT];
+} RadixSortWork;
+
+// NOTE: one slice of the sorted output, written back to where its pixels came from
+typedef struct UnsortWork
+{
+    Color4 *sorted_output;
+    Color4 *output;
+    int *pixel_order;
+    int first, count;
+} UnsortWork;
 
 static int 
-load_image_info(Image *image, char *path)
+load_image_info_from_file(Image *image, FILE *file_handle)
 {
     int result = 0;
     clear_memory(image, sizeof(*image));
-    FILE *file_handle = fopen(path, "rb");
     if(file_handle)
     {
         int width, height, channel_count;
@@ -59,6 +504,8 @@ load_image_info(Image *image, char *path)
             result = 1;
             image->width = width;
             image->height = height;
+            image->is_16_bit = stbi_is_16_bit_from_file(file_handle);
+            image->is_hdr = stbi_is_hdr_from_file(file_handle);
             image->handle = file_handle;
         }
         else
@@ -69,6 +516,25 @@ load_image_info(Image *image, char *path)
     return result;
 }
 
+static int
+load_image_info(Image *image, char *path)
+{
+    return load_image_info_from_file(image, fopen(path, "rb"));
+}
+
+// NOTE: wraps the buffer in a FILE so that decoding is the same as for a path, the buffer
+// has to outlive the image
+static int
+load_image_info_from_memory(Image *image, void *data, size_t size)
+{
+#if defined(__unix__)
+    return load_image_info_from_file(image, fmemopen(data, size, "rb"));
+#else
+    clear_memory(image, sizeof(*image));
+    return 0;
+#endif
+}
+
 static void
 free_image_info(Image *image)
 {
@@ -79,11 +545,14 @@ free_image_info(Image *image)
     }
 }
 
+// NOTE: alpha is 0 unless keep_alpha is set
 static void 
-load_image_data(Color4 *output, Image *image)
+load_image_data(Color4 *output, Image *image, int keep_alpha)
 {
     int image_width, image_height, channel_count;
-    unsigned char *input_pixels = stbi_load_from_file(image->handle, &image_width, &image_height, &channel_count, 3);
+    int component_count = keep_alpha ? 4 : 3;
+    unsigned char *input_pixels = stbi_load_from_file(image->handle, &image_width, &image_height, &channel_count, 
+                                                      component_count);
     if(input_pixels)
     {
         Color4 *output_pixel = output;
@@ -91,11 +560,11 @@ load_image_data(Color4 *output, Image *image)
         {
             for(int x = 0; x < image->width; ++x)
             {
-                unsigned char *channels = input_pixels + (image_height - 1 - y)*image_width*3 + x*3;
+                unsigned char *channels = input_pixels + ((image_height - 1 - y)*image_width + x)*component_count;
                 output_pixel->r = channels[0];
                 output_pixel->g = channels[1];
                 output_pixel->b = channels[2];
-                output_pixel->a = 0;
+                output_pixel->a = keep_alpha ? channels[3] : 0;
                 ++output_pixel;
             }
         }
@@ -107,11 +576,13 @@ load_image_data(Color4 *output, Image *image)
     }
 }
 
+// NOTE: the bitmap's alpha is written when keep_alpha is set, otherwise the image is opaque
 static int 
-write_image(char *path, Color4 *bitmap, int width, int height)
+write_image(char *path, Color4 *bitmap, int width, int height, int keep_alpha, MemoryArena *arena)
 {
     int result = 0;
-    int *data = (int *)malloc(height * width * sizeof(int));
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    int *data = push_array(arena, height * width, int);
     if(data)
     {
         for(int y = 0; y < height; ++y)
@@ -122,333 +593,4219 @@ write_image(char *path, Color4 *bitmap, int width, int height)
                 int r = channel->r;
                 int g = channel->g;
                 int b = channel->b;
-                int a = 255;
+                int a = keep_alpha ? channel->a : 255;
                 data[(height - 1 - y) * width + x] = (a << 24) | (b << 16) | (g << 8) | (r << 0);
             }
         }
         result = stbi_write_png(path, width, height, 4, data, width * sizeof(int));
-        free(data);
     }
+    end_temporary_memory(temporary);
     return result;
 }
 
+// NOTE: keeps the full precision of 16 bit images, 8 bit images come through here too when
+// they are written as HDR
 static void 
-do_kmeans_filter_work(void *param)
+load_wide_image_data(WideBitmap *output, Image *image)
 {
-    KmeansFilterWork *work = (KmeansFilterWork *)param;
-    work->out_migration_count = 0;
-    clear_memory(work->out_cluster_sums_r, work->cluster_count * sizeof(unsigned long long));
-    clear_memory(work->out_cluster_sums_g, work->cluster_count * sizeof(unsigned long long));
-    clear_memory(work->out_cluster_sums_b, work->cluster_count * sizeof(unsigned long long));
-    clear_memory(work->out_cluster_pixel_counts, work->cluster_count * sizeof(int));
+    int image_width, image_height, channel_count;
+    float *hdr_pixels = 0;
+    unsigned short *wide_pixels = 0;
+    unsigned char *byte_pixels = 0;
+    if(image->is_hdr)
+    {
+        hdr_pixels = stbi_loadf_from_file(image->handle, &image_width, &image_height, &channel_count, 3);
+        output->max_value = 0;
+    }
+    else if(image->is_16_bit)
+    {
+        wide_pixels = stbi_load_from_file_16(image->handle, &image_width, &image_height, &channel_count, 3);
+        output->max_value = 65535.0f;
+    }
+    else
+    {
+        byte_pixels = stbi_load_from_file(image->handle, &image_width, &image_height, &channel_count, 3);
+        output->max_value = 255.0f;
+    }
     
-    for(int pixel_index = 0; pixel_index < work->pixel_count; ++pixel_index)
+    if(hdr_pixels || wide_pixels || byte_pixels)
     {
-        int min_test_index = 0;
-        float first_r_diff = work->pixels[pixel_index].r - work->cluster_colors[0].r;
-        float first_g_diff = work->pixels[pixel_index].g - work->cluster_colors[0].g;
-        float first_b_diff = work->pixels[pixel_index].b - work->cluster_colors[0].b;
-        float min_diff = first_r_diff*first_r_diff + first_g_diff*first_g_diff + first_b_diff*first_b_diff;
-        
-        for(int test_index = 1; test_index < work->cluster_count; ++test_index)
+        float *output_channel = output->rgb;
+        for(int y = 0; y < image->height; ++y)
         {
-            float r_diff = work->pixels[pixel_index].r - work->cluster_colors[test_index].r;
-            float g_diff = work->pixels[pixel_index].g - work->cluster_colors[test_index].g;
-            float b_diff = work->pixels[pixel_index].b - work->cluster_colors[test_index].b;
-            float diff = r_diff*r_diff + g_diff*g_diff + b_diff*b_diff;
-            if(diff < min_diff)
+            for(int x = 0; x < image->width; ++x)
             {
-                min_test_index = test_index;
-                min_diff = diff;
+                int source_index = ((image_height - 1 - y)*image_width + x)*3;
+                for(int channel = 0; channel < 3; ++channel)
+                {
+                    if(hdr_pixels) *output_channel++ = hdr_pixels[source_index + channel];
+                    else if(wide_pixels) *output_channel++ = wide_pixels[source_index + channel];
+                    else *output_channel++ = byte_pixels[source_index + channel];
+                }
             }
         }
-        
-        if(work->cluster_indices[pixel_index] != min_test_index)
-        {
-            ++work->out_migration_count;
-            work->cluster_indices[pixel_index] = min_test_index;
-        }
-        ++work->out_cluster_pixel_counts[min_test_index];
-        work->out_cluster_sums_r[min_test_index] += work->pixels[pixel_index].r;
-        work->out_cluster_sums_g[min_test_index] += work->pixels[pixel_index].g;
-        work->out_cluster_sums_b[min_test_index] += work->pixels[pixel_index].b;
+        if(hdr_pixels) stbi_image_free(hdr_pixels);
+        if(wide_pixels) stbi_image_free(wide_pixels);
+        if(byte_pixels) stbi_image_free(byte_pixels);
+    }
+    else
+    {
+        clear_memory(output->rgb, image->width * image->height * 3 * sizeof(float));
     }
 }
 
-static void 
-do_fill_image_work(void *param)
+static unsigned int
+update_png_crc(unsigned int crc, unsigned char *data, int size)
 {
-    FillImageWork *work = (FillImageWork *)param;
-    for(int i = 0; i < work->pixel_count; ++i)
+    for(int i = 0; i < size; ++i)
     {
-        work->out_pixels[i] = work->cluster_colors[work->cluster_indices[i]];
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
     }
+    return crc;
 }
 
-static void 
-allocate_random_clusters(Color4 *pixels, int pixel_count, Color4 *cluster_colors, int cluster_count)
+static void
+put_big_endian_u32(unsigned char *at, unsigned int value)
 {
-    for(int i = 0; i < cluster_count; ++i)
-    {
-        cluster_colors[i] = pixels[0];
-    }
-    
-    int unique_color_count = 0;
-    for(int i = 0; i < pixel_count; ++i)
+    at[0] = (unsigned char)(value >> 24);
+    at[1] = (unsigned char)(value >> 16);
+    at[2] = (unsigned char)(value >> 8);
+    at[3] = (unsigned char)(value >> 0);
+}
+
+static int
+write_png_chunk(FILE *file, char *type, unsigned char *data, int size)
+{
+    unsigned char header[8];
+    unsigned char footer[4];
+    put_big_endian_u32(header, size);
+    copy_memory(header + 4, type, 4);
+    unsigned int crc = update_png_crc(0xffffffffu, header + 4, 4);
+    crc = update_png_crc(crc, data, size);
+    put_big_endian_u32(footer, crc ^ 0xffffffffu);
+    int result = (fwrite(header, 1, 8, file) == 8);
+    if(size) result = result && (fwrite(data, 1, size, file) == (size_t)size);
+    result = result && (fwrite(footer, 1, 4, file) == 4);
+    return result;
+}
+
+// NOTE: stb_image_write only writes 8 bit PNGs, this writes 16 bit RGB with the 'up' filter on
+// every row and stb's deflate
+static int
+write_png_16(char *path, unsigned short *rgb, int width, int height, MemoryArena *arena)
+{
+    int result = 0;
+    int row_size = 1 + width*6;
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    unsigned char *filtered = push_array(arena, (size_t)row_size * height, unsigned char);
+    if(filtered)
     {
-        int is_unique = 1;
-        for(int j = 0; j < unique_color_count; ++j)
+        for(int y = 0; y < height; ++y)
         {
-            if(pixels[i].r == cluster_colors[j].r && 
-               pixels[i].g == cluster_colors[j].g && 
-               pixels[i].b == cluster_colors[j].b)
+            unsigned char *row = filtered + (size_t)y*row_size;
+            row[0] = 2;
+            for(int i = 0; i < width*3; ++i)
             {
-                is_unique = 0;
-                break;
+                unsigned short value = rgb[(size_t)y*width*3 + i];
+                unsigned short above = y ? rgb[(size_t)(y - 1)*width*3 + i] : 0;
+                row[1 + i*2 + 0] = (unsigned char)((value >> 8) - (above >> 8));
+                row[1 + i*2 + 1] = (unsigned char)((value & 0xff) - (above & 0xff));
             }
         }
         
-        if(is_unique)
+        int compressed_size;
+        unsigned char *compressed = stbi_zlib_compress(filtered, row_size*height, &compressed_size, 
+                                                       stbi_write_png_compression_level);
+        FILE *file = compressed ? fopen(path, "wb") : 0;
+        if(file)
         {
-            cluster_colors[unique_color_count++] = pixels[i];
+            static unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            unsigned char header[13];
+            put_big_endian_u32(header + 0, width);
+            put_big_endian_u32(header + 4, height);
+            header[8] = 16; // bit depth
+            header[9] = 2;  // RGB
+            header[10] = 0;
+            header[11] = 0;
+            header[12] = 0;
+            result = (fwrite(signature, 1, 8, file) == 8) && 
+                     write_png_chunk(file, "IHDR", header, 13) && 
+                     write_png_chunk(file, "IDAT", compressed, compressed_size) && 
+                     write_png_chunk(file, "IEND", 0, 0);
+            result = (fclose(file) == 0) && result;
         }
-        
-        if(unique_color_count == cluster_count) break;
+        if(compressed) free(compressed);
     }
+    end_temporary_memory(temporary);
+    return result;
 }
 
-static void 
-filter_bitmap_with_kmean(Color4 *output, Color4 *pixels, int width, int height, 
-                         int cluster_count, int max_iteration, float migration_threshold, 
-                         WorkQueue *queue, int thread_count, 
-                         int *out_iteration)
+// NOTE: .hdr files take linear light, everything else is written as a 16 bit sRGB PNG
+static int 
+write_wide_image(char *path, WideBitmap *bitmap, int width, int height, int as_hdr, MemoryArena *arena)
 {
+    int result = 0;
     int pixel_count = width * height;
-    int pixel_per_thread = (pixel_count + thread_count - 1) / thread_count;
-    if(cluster_count <= pixel_count)
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    float *hdr_data = as_hdr ? push_array(arena, pixel_count * 3, float) : 0;
+    unsigned short *png_data = as_hdr ? 0 : push_array(arena, pixel_count * 3, unsigned short);
+    if(hdr_data || png_data)
     {
-        size_t working_size_per_thread = align_to(sizeof(KmeansFilterWork) + sizeof(FillImageWork) + 
-                                                  cluster_count*sizeof(unsigned long long)*3 + cluster_count*sizeof(int), 
-                                                  128);
-        char *working_memory = (char *)malloc(thread_count * working_size_per_thread + 128);
-        int *cluster_indices = (int *)malloc(pixel_count * sizeof(int));
-        Color4 *cluster_colors = (Color4 *)malloc(cluster_count * sizeof(Color4));
-        if(working_memory && cluster_indices && cluster_colors)
+        for(int y = 0; y < height; ++y)
         {
-            clear_memory(working_memory, thread_count * working_size_per_thread + 128);
-            clear_memory(cluster_indices, pixel_count * sizeof(int));
-            allocate_random_clusters(pixels, pixel_count, cluster_colors, cluster_count);
-            
-            char *initial_ptr_to_allocate = (char *)align_to((size_t)working_memory, 128);
-            char *ptr_to_allocate = initial_ptr_to_allocate;
-            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
-            {
-                size_t pixel_remaining = pixel_count - thread_index*pixel_per_thread;
-                KmeansFilterWork *kmeans_work = (KmeansFilterWork *)ptr_to_allocate;
-                FillImageWork *fill_work = (FillImageWork *)(ptr_to_allocate + sizeof(*kmeans_work));
-                kmeans_work->pixel_count = (pixel_remaining < pixel_per_thread) ? pixel_remaining : pixel_per_thread;
-                kmeans_work->cluster_count = cluster_count;
-                kmeans_work->pixels = pixels + thread_index * pixel_per_thread;
-                kmeans_work->cluster_indices = cluster_indices + thread_index * pixel_per_thread;
-                kmeans_work->cluster_colors = cluster_colors;
-                kmeans_work->out_migration_count = 0;
-                kmeans_work->out_cluster_sums_r = (unsigned long long *)(ptr_to_allocate + sizeof(*kmeans_work) + sizeof(*fill_work));
-                kmeans_work->out_cluster_sums_g = (unsigned long long *)(ptr_to_allocate + sizeof(*kmeans_work) + sizeof(*fill_work) + 1*cluster_count*sizeof(unsigned long long));
-                kmeans_work->out_cluster_sums_b = (unsigned long long *)(ptr_to_allocate + sizeof(*kmeans_work) + sizeof(*fill_work) + 2*cluster_count*sizeof(unsigned long long));
-                kmeans_work->out_cluster_pixel_counts = (int *)(ptr_to_allocate + sizeof(*kmeans_work) + sizeof(*fill_work) + 3*cluster_count*sizeof(unsigned long long));
-                ptr_to_allocate += working_size_per_thread;
-            }
-            
-            int max_migration = migration_threshold * pixel_count;
-            int iteration = 0;
-            while(iteration++ < max_iteration)
+            for(int x = 0; x < width; ++x)
             {
-                for(int thread_index = 0; thread_index < thread_count; ++thread_index)
-                {
-                    KmeansFilterWork *work = (KmeansFilterWork *)(initial_ptr_to_allocate + thread_index*working_size_per_thread);
-                    queue_work(queue, do_kmeans_filter_work, work);
-                }
-                complete_all_works(queue);
-                
-                for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+                float *source = bitmap->rgb + (y*width + x)*3;
+                int dest_index = ((height - 1 - y)*width + x)*3;
+                for(int channel = 0; channel < 3; ++channel)
                 {
-                    int count = 0;
-                    float r_sum = 0.0f;
-                    float g_sum = 0.0f;
-                    float b_sum = 0.0f;
-                    for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+                    float value = source[channel];
+                    if(as_hdr)
                     {
-                        KmeansFilterWork *work = (KmeansFilterWork *)(initial_ptr_to_allocate + thread_index*working_size_per_thread);
-                        r_sum += work->out_cluster_sums_r[cluster_index];
-                        g_sum += work->out_cluster_sums_g[cluster_index];
-                        b_sum += work->out_cluster_sums_b[cluster_index];
-                        count += work->out_cluster_pixel_counts[cluster_index];
+                        if(bitmap->max_value > 0) value = srgb_to_linear(value / bitmap->max_value);
+                        hdr_data[dest_index + channel] = value;
                     }
-                    
-                    if(count > 0)
+                    else
                     {
-                        cluster_colors[cluster_index].r = r_sum / count;
-                        cluster_colors[cluster_index].g = g_sum / count;
-                        cluster_colors[cluster_index].b = b_sum / count;
+                        if(bitmap->max_value > 0) value = value / bitmap->max_value;
+                        else value = linear_to_srgb(value < 1.0f ? value : 1.0f);
+                        value = value*65535.0f + 0.5f;
+                        if(value < 0.0f) value = 0.0f;
+                        if(value > 65535.0f) value = 65535.0f;
+                        png_data[dest_index + channel] = (unsigned short)value;
                     }
                 }
-                
-                int total_migration_count = 0;
-                for(int thread_index = 0; thread_index < thread_count; ++thread_index)
-                {
-                    KmeansFilterWork *work = (KmeansFilterWork *)(initial_ptr_to_allocate + thread_index*working_size_per_thread);
-                    total_migration_count += work->out_migration_count;
-                }
-                if(total_migration_count < max_migration) break;
-            }
-            
-            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
-            {
-                size_t pixel_remaining = pixel_count - pixel_per_thread * thread_index;
-                FillImageWork *work = (FillImageWork *)(initial_ptr_to_allocate + thread_index*working_size_per_thread + sizeof(KmeansFilterWork));
-                work->pixel_count = (pixel_remaining < pixel_per_thread) ? pixel_remaining : pixel_per_thread;
-                work->cluster_colors = cluster_colors;
-                work->cluster_indices = cluster_indices + thread_index * pixel_per_thread;
-                work->out_pixels = output + thread_index * pixel_per_thread;
-                queue_work(queue, do_fill_image_work, work);
             }
-            complete_all_works(queue);
-            *out_iteration = iteration;
         }
-        
-        if(working_memory) free(working_memory);
-        if(cluster_indices) free(cluster_indices);
-        if(cluster_colors) free(cluster_colors);
+        if(as_hdr) result = stbi_write_hdr(path, width, height, 3, hdr_data);
+        else result = write_png_16(path, png_data, width, height, arena);
     }
-    else
+    end_temporary_memory(temporary);
+    return result;
+}
+
+static int
+has_path_extension(char *path, char *extension)
+{
+    size_t path_len = string_len(path);
+    size_t extension_len = string_len(extension);
+    int result = (path_len >= extension_len);
+    for(size_t i = 0; result && i < extension_len; ++i)
     {
-        for(int i = 0; i < pixel_count; ++i)
-        {
-            output[i] = pixels[i];
-        }
+        char c = path[path_len - extension_len + i];
+        if(c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+        result = (c == extension[i]);
     }
+    return result;
 }
 
-int 
-main(int arg_count, char **args)
+// NOTE: packs the pixels that aren't fully transparent to the front of out_pixels, so that
+// classify and the sums never see the transparent ones. Returns the number of packed pixels.
+static int
+compact_opaque_pixels(Color4 *pixels, int pixel_count, Color4 *out_pixels, int *out_pixel_indices)
 {
-    int thread_count = get_thread_count();
-    int parsing_arg_index = 1;
-    int show_usage = 0;
-    int verbose = 1;
-    int cluster_count = 4;
-    int max_iteration = 200;
-    float migration_threshold = 0.01f;
-    for(; parsing_arg_index < arg_count; ++parsing_arg_index)
+    int result = 0;
+    for(int i = 0; i < pixel_count; ++i)
     {
-        char *option = args[parsing_arg_index];
-        if(option[0] != '-') break;
-        
-        if(option[1] == 'n' && option[2] == '=')
-        {
-            cluster_count = atoi(option + 3);
-        }
-        else if(option[1] == 'm' && option[2] == '=')
+        if(pixels[i].a)
         {
-            max_iteration = atoi(option + 3);
+            out_pixels[result] = pixels[i];
+            out_pixel_indices[result] = i;
+            ++result;
         }
-        else if(option[1] == 't' && option[2] == '=')
-        {
-            thread_count = atoi(option + 3);
-        }
-        else if(option[1] == 'r' && option[2] == '=')
+    }
+    return result;
+}
+
+// NOTE: transparent pixels keep their input, the others take the color of their cluster and
+// their own alpha back
+static void
+expand_opaque_pixels(Color4 *output, Color4 *pixels, int pixel_count, Color4 *opaque_output, 
+                     int *opaque_pixel_indices, int opaque_count)
+{
+    for(int i = 0; i < pixel_count; ++i)
+    {
+        output[i] = pixels[i];
+    }
+    for(int i = 0; i < opaque_count; ++i)
+    {
+        Color4 *pixel = output + opaque_pixel_indices[i];
+        pixel->r = opaque_output[i].r;
+        pixel->g = opaque_output[i].g;
+        pixel->b = opaque_output[i].b;
+    }
+}
+
+// NOTE: each set of sums gets its own cache lines so tiles finished by different threads
+// never share a line
+static char *
+assign_kmeans_sums(KmeansSums *sums, char *memory, int cluster_count)
+{
+    sums->cluster_sums_r = (unsigned long long *)(memory + 0*cluster_count*sizeof(unsigned long long));
+    sums->cluster_sums_g = (unsigned long long *)(memory + 1*cluster_count*sizeof(unsigned long long));
+    sums->cluster_sums_b = (unsigned long long *)(memory + 2*cluster_count*sizeof(unsigned long long));
+    sums->cluster_sums_sq = (unsigned long long *)(memory + 3*cluster_count*sizeof(unsigned long long));
+    sums->cluster_pixel_counts = (int *)(memory + 4*cluster_count*sizeof(unsigned long long));
+    return memory + align_to(cluster_count*sizeof(unsigned long long)*4 + cluster_count*sizeof(int), 128);
+}
+
+static void
+clear_kmeans_sums(KmeansSums *sums, int cluster_count)
+{
+    sums->migration_count = 0;
+    clear_memory(sums->cluster_sums_r, cluster_count * sizeof(unsigned long long));
+    clear_memory(sums->cluster_sums_g, cluster_count * sizeof(unsigned long long));
+    clear_memory(sums->cluster_sums_b, cluster_count * sizeof(unsigned long long));
+    clear_memory(sums->cluster_sums_sq, cluster_count * sizeof(unsigned long long));
+    clear_memory(sums->cluster_pixel_counts, cluster_count * sizeof(int));
+}
+
+static void
+add_kmeans_sums(KmeansSums *dest, KmeansSums *source, int cluster_count)
+{
+    dest->migration_count += source->migration_count;
+    for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+    {
+        dest->cluster_sums_r[cluster_index] += source->cluster_sums_r[cluster_index];
+        dest->cluster_sums_g[cluster_index] += source->cluster_sums_g[cluster_index];
+        dest->cluster_sums_b[cluster_index] += source->cluster_sums_b[cluster_index];
+        dest->cluster_sums_sq[cluster_index] += source->cluster_sums_sq[cluster_index];
+        dest->cluster_pixel_counts[cluster_index] += source->cluster_pixel_counts[cluster_index];
+    }
+}
+
+// NOTE: pairwise merge in a fixed order into sums[0]. Integer sums are exact, so together with
+// the fixed tile order this gives bit identical centroids for any thread count and schedule
+static void
+merge_kmeans_sums_tree(KmeansSums **sums, int count, int cluster_count)
+{
+    for(int stride = 1; stride < count; stride *= 2)
+    {
+        for(int i = 0; i + stride < count; i += 2*stride)
         {
-            migration_threshold = atof(option + 3);
+            add_kmeans_sums(sums[i], sums[i + stride], cluster_count);
         }
-        else if(option[1] == 'q' && option[2] == 0)
+    }
+}
+
+static int
+get_color_length_squared(Color4 color)
+{
+    return color.r*color.r + color.g*color.g + color.b*color.b;
+}
+
+// NOTE: sum over the clusters of |x - c|^2 = sum |x|^2 - 2 c.sum x + n |c|^2, exact in integers
+// so it matches the per pixel sum of the other backends. Unsigned wrap around cancels out since
+// the total can't be negative.
+static unsigned long long
+get_kmeans_sse(KmeansSums *sums, Color4 *cluster_colors, int cluster_count)
+{
+    unsigned long long result = 0;
+    for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+    {
+        Color4 color = cluster_colors[cluster_index];
+        unsigned long long dot = color.r*sums->cluster_sums_r[cluster_index] + 
+                                 color.g*sums->cluster_sums_g[cluster_index] + 
+                                 color.b*sums->cluster_sums_b[cluster_index];
+        result += sums->cluster_sums_sq[cluster_index] - 2*dot + 
+                  (unsigned long long)sums->cluster_pixel_counts[cluster_index]*get_color_length_squared(color);
+    }
+    return result;
+}
+
+// NOTE: every backend rounds the mean down and keeps the old centroid of an empty cluster,
+// keep them in sync so the outputs stay comparable
+static void
+update_cluster_colors(Color4 *cluster_colors, KmeansSums *sums, int cluster_count)
+{
+    for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+    {
+        unsigned long long count = sums->cluster_pixel_counts[cluster_index];
+        if(count > 0)
         {
-            verbose = 0;
+            cluster_colors[cluster_index].r = (unsigned char)(sums->cluster_sums_r[cluster_index] / count);
+            cluster_colors[cluster_index].g = (unsigned char)(sums->cluster_sums_g[cluster_index] / count);
+            cluster_colors[cluster_index].b = (unsigned char)(sums->cluster_sums_b[cluster_index] / count);
         }
-        else if(option[1] == 'h' && option[2] == 0)
+    }
+}
+
+// NOTE: tiles are summed in tile order of the node's ranges, which are listed in thread order,
+// so the result doesn't depend on which thread happened to process which tile. Delta tiles
+// without a migration are all zero and are skipped.
+static void
+reduce_kmeans_node(KmeansFilter *filter, KmeansNode *node)
+{
+    clear_kmeans_sums(&node->sums, filter->cluster_count);
+    for(int i = 0; i < node->range_count; ++i)
+    {
+        KmeansTileRange *range = filter->tile_ranges + node->range_indices[i];
+        for(int tile_index = range->first_tile; tile_index < range->end_tile; ++tile_index)
         {
-            show_usage = 1;
+            KmeansSums *tile_sums = filter->tile_sums + tile_index;
+            if(filter->full_update || tile_sums->migration_count)
+            {
+                add_kmeans_sums(&node->sums, tile_sums, filter->cluster_count);
+            }
         }
-        else
+    }
+}
+
+static void
+get_tile_pixel_range(KmeansFilter *filter, int tile_index, int *out_first, int *out_count)
+{
+    int first = tile_index * KMEANS_TILE_PIXEL_COUNT;
+    int count = filter->pixel_count - first;
+    if(count > KMEANS_TILE_PIXEL_COUNT) count = KMEANS_TILE_PIXEL_COUNT;
+    *out_first = first;
+    *out_count = count;
+}
+
+// NOTE: whoever finishes the last tile of a node sums the tiles of the node, so the global
+// merge only reads one set of sums per node
+static void
+finish_tile(KmeansFilter *filter, int tile_index)
+{
+    KmeansNode *node = filter->nodes + filter->tile_ranges[tile_index / filter->tile_per_thread].node_index;
+    if(atomic_add(&node->remaining_tile_count, -1) == 1)
+    {
+        unsigned long long node_begin_time = get_trace_time();
+        reduce_kmeans_node(filter, node);
+        record_trace_event("node reduce", filter->iteration, node_begin_time);
+    }
+}
+
+// NOTE: a grid of cell_bits per channel over the RGB cube, cells are indexed r, g, b from the
+// most significant bits down
+static int
+get_color_grid_cell(Color4 color, int cell_bits)
+{
+    int shift = 8 - cell_bits;
+    return ((color.r >> shift) << (2*cell_bits)) | ((color.g >> shift) << cell_bits) | (color.b >> shift);
+}
+
+static void
+get_color_grid_cell_box(int cell, int cell_bits, int *out_low, int *out_high)
+{
+    for(int channel = 0; channel < 3; ++channel)
+    {
+        int shift = (2 - channel) * cell_bits;
+        out_low[channel] = ((cell >> shift) & ((1 << cell_bits) - 1)) << (8 - cell_bits);
+        out_high[channel] = out_low[channel] + (1 << (8 - cell_bits)) - 1;
+    }
+}
+
+// NOTE: squared distance from the color to the farthest corner of the box
+static int
+get_color_box_max_distance(Color4 color, int *low, int *high)
+{
+    int values[3] = {color.r, color.g, color.b};
+    int result = 0;
+    for(int channel = 0; channel < 3; ++channel)
+    {
+        int low_diff = values[channel] - low[channel];
+        int high_diff = values[channel] - high[channel];
+        int low_square = low_diff*low_diff;
+        int high_square = high_diff*high_diff;
+        result += (low_square > high_square) ? low_square : high_square;
+    }
+    return result;
+}
+
+// NOTE: squared distance from the color to the closest point of the box
+static int
+get_color_box_min_distance(Color4 color, int *low, int *high)
+{
+    int values[3] = {color.r, color.g, color.b};
+    int result = 0;
+    for(int channel = 0; channel < 3; ++channel)
+    {
+        int diff = 0;
+        if(values[channel] < low[channel]) diff = low[channel] - values[channel];
+        else if(values[channel] > high[channel]) diff = values[channel] - high[channel];
+        result += diff*diff;
+    }
+    return result;
+}
+
+// NOTE: the cluster that is strictly nearest everywhere in the cell, or KMEANS_MEMO_AMBIGUOUS when
+// another cluster could tie or win somewhere in it. Stops at the second candidate.
+static int
+find_memo_cell_cluster(Color4 *cluster_colors, int cluster_count, int cell)
+{
+    int low[3], high[3];
+    get_color_grid_cell_box(cell, KMEANS_MEMO_CELL_BITS, low, high);
+    int best_index = 0;
+    int best_max_distance = INT_MAX;
+    for(int i = 0; i < cluster_count; ++i)
+    {
+        int max_distance = get_color_box_max_distance(cluster_colors[i], low, high);
+        if(max_distance < best_max_distance)
+        {
+            best_index = i;
+            best_max_distance = max_distance;
+        }
+    }
+
+    int result = best_index;
+    for(int i = 0; i < cluster_count; ++i)
+    {
+        if(i != best_index && get_color_box_min_distance(cluster_colors[i], low, high) <= best_max_distance)
+        {
+            result = KMEANS_MEMO_AMBIGUOUS;
+            break;
+        }
+    }
+    return result;
+}
+
+// NOTE: the grid is filled lazily, the first thread of an iteration that lands in a stale cell
+// computes it. An entry is one aligned 32 bit word of (generation << 16 | cluster), and every
+// thread computes the same value for a generation, so racing writers store identical words and
+// readers never need a lock.
+static int
+get_memo_cluster_index(KmeansFilter *filter, Color4 pixel)
+{
+    int cell = get_color_grid_cell(pixel, KMEANS_MEMO_CELL_BITS);
+    unsigned int entry = filter->memo_cells[cell];
+    if((entry >> 16) != filter->memo_generation)
+    {
+        int cluster_index = find_memo_cell_cluster(filter->cluster_colors, filter->cluster_count, cell);
+        entry = (filter->memo_generation << 16) | (unsigned int)cluster_index;
+        filter->memo_cells[cell] = entry;
+    }
+    return (int)(entry & 0xffff);
+}
+
+static inline void
+assign_tile_pixel(KmeansSums *sums, Color4 pixel, int *cluster_index, int min_test_index, int full_update)
+{
+    int old_index = *cluster_index;
+    if(old_index != min_test_index)
+    {
+        ++sums->migration_count;
+        *cluster_index = min_test_index;
+        if(!full_update)
+        {
+            // NOTE: unsigned sums wrap around, so subtracting here and adding the deltas
+            // to the total later still gives the exact sum
+            --sums->cluster_pixel_counts[old_index];
+            sums->cluster_sums_r[old_index] -= pixel.r;
+            sums->cluster_sums_g[old_index] -= pixel.g;
+            sums->cluster_sums_b[old_index] -= pixel.b;
+            sums->cluster_sums_sq[old_index] -= get_color_length_squared(pixel);
+        }
+    }
+    if(full_update || old_index != min_test_index)
+    {
+        ++sums->cluster_pixel_counts[min_test_index];
+        sums->cluster_sums_r[min_test_index] += pixel.r;
+        sums->cluster_sums_g[min_test_index] += pixel.g;
+        sums->cluster_sums_b[min_test_index] += pixel.b;
+        sums->cluster_sums_sq[min_test_index] += get_color_length_squared(pixel);
+    }
+}
+
+// NOTE: KMEANS_LANE_COUNT pixels are classified side by side, the cluster loop runs over the
+// lanes with the centroid broadcast to all of them and the minimum is a select instead of a
+// branch. The distances are integers, exact like the float ones, and a strict compare keeps the
+// lowest index on ties, so the labels match a plain scan. The lanes past the end of the last
+// block repeat its last pixel and are dropped.
+static inline void
+classify_tile_with_count(KmeansFilter *filter, int tile_index, int cluster_count)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    Color4 *pixels = filter->pixels + first_pixel;
+    int *cluster_indices = filter->cluster_indices + first_pixel;
+    Color4 *cluster_colors = filter->cluster_colors;
+    int full_update = filter->full_update;
+    KmeansSums *sums = filter->tile_sums + tile_index;
+    clear_kmeans_sums(sums, cluster_count);
+    
+    for(int block_first = 0; block_first < pixel_count; block_first += KMEANS_LANE_COUNT)
+    {
+        int lane_count = pixel_count - block_first;
+        if(lane_count > KMEANS_LANE_COUNT) lane_count = KMEANS_LANE_COUNT;
+        Color4 *block_pixels = pixels + block_first;
+        
+        int min_indices[KMEANS_LANE_COUNT];
+        int scan_count = lane_count;
+        if(filter->memo_cells)
+        {
+            scan_count = 0;
+            for(int lane = 0; lane < lane_count; ++lane)
+            {
+                min_indices[lane] = get_memo_cluster_index(filter, block_pixels[lane]);
+                if(min_indices[lane] == KMEANS_MEMO_AMBIGUOUS) ++scan_count;
+            }
+        }
+        
+        if(scan_count)
+        {
+            int lane_r[KMEANS_LANE_COUNT], lane_g[KMEANS_LANE_COUNT], lane_b[KMEANS_LANE_COUNT];
+            int min_diffs[KMEANS_LANE_COUNT], scan_indices[KMEANS_LANE_COUNT];
+            for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+            {
+                Color4 pixel = block_pixels[(lane < lane_count) ? lane : lane_count - 1];
+                lane_r[lane] = pixel.r;
+                lane_g[lane] = pixel.g;
+                lane_b[lane] = pixel.b;
+                min_diffs[lane] = INT_MAX;
+                scan_indices[lane] = 0;
+            }
+            for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+            {
+                int r = cluster_colors[cluster_index].r;
+                int g = cluster_colors[cluster_index].g;
+                int b = cluster_colors[cluster_index].b;
+                for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+                {
+                    int r_diff = lane_r[lane] - r;
+                    int g_diff = lane_g[lane] - g;
+                    int b_diff = lane_b[lane] - b;
+                    int diff = r_diff*r_diff + g_diff*g_diff + b_diff*b_diff;
+                    int take = diff < min_diffs[lane];
+                    min_diffs[lane] = take ? diff : min_diffs[lane];
+                    scan_indices[lane] = take ? cluster_index : scan_indices[lane];
+                }
+            }
+            for(int lane = 0; lane < lane_count; ++lane)
+            {
+                if(!filter->memo_cells || min_indices[lane] == KMEANS_MEMO_AMBIGUOUS) min_indices[lane] = scan_indices[lane];
+            }
+        }
+        
+        for(int lane = 0; lane < lane_count; ++lane)
+        {
+            int pixel_index = block_first + lane;
+            assign_tile_pixel(sums, pixels[pixel_index], cluster_indices + pixel_index, min_indices[lane], full_update);
+        }
+    }
+    
+    finish_tile(filter, tile_index);
+}
+
+// NOTE: a constant cluster count lets the compiler unroll the cluster loop and keep the
+// centroids in registers across the tile, the other counts go through the generic one
+#define DEFINE_CLASSIFY_TILE(count) \
+static void \
+classify_tile_##count(KmeansFilter *filter, int tile_index) \
+{ \
+    classify_tile_with_count(filter, tile_index, count); \
+}
+
+DEFINE_CLASSIFY_TILE(2)
+DEFINE_CLASSIFY_TILE(4)
+DEFINE_CLASSIFY_TILE(8)
+DEFINE_CLASSIFY_TILE(16)
+DEFINE_CLASSIFY_TILE(32)
+DEFINE_CLASSIFY_TILE(64)
+
+static void
+classify_tile(KmeansFilter *filter, int tile_index)
+{
+    classify_tile_with_count(filter, tile_index, filter->cluster_count);
+}
+
+// NOTE: for large cluster counts the nearest cluster is the one with the smallest
+// |c|^2 - 2 p.c, the |p|^2 term is the same for every cluster. Every product and sum is an
+// integer below 2^24, so the float math is exact (SSE2 has no 32 bit integer multiply) and the
+// score is compared as an integer. The clusters are still tested in order with a strict
+// compare, so this gives the same labels as the distance. Like a matrix multiply the tile is cut into blocks of
+// KMEANS_LARGE_PIXEL_BLOCK pixels and KMEANS_LARGE_CLUSTER_BLOCK clusters that stay in the L1
+// cache together, and the inner kernel runs one group of lanes against a whole cluster block
+// with its running minimum in registers.
+static void
+classify_large_tile(KmeansFilter *filter, int tile_index)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    Color4 *pixels = filter->pixels + first_pixel;
+    int *cluster_indices = filter->cluster_indices + first_pixel;
+    Color4 *cluster_colors = filter->cluster_colors;
+    int cluster_count = filter->cluster_count;
+    int full_update = filter->full_update;
+    KmeansSums *sums = filter->tile_sums + tile_index;
+    clear_kmeans_sums(sums, cluster_count);
+    
+    float pixel_r[KMEANS_LARGE_PIXEL_BLOCK], pixel_g[KMEANS_LARGE_PIXEL_BLOCK], pixel_b[KMEANS_LARGE_PIXEL_BLOCK];
+    int min_scores[KMEANS_LARGE_PIXEL_BLOCK], min_indices[KMEANS_LARGE_PIXEL_BLOCK];
+    float cluster_r[KMEANS_LARGE_CLUSTER_BLOCK], cluster_g[KMEANS_LARGE_CLUSTER_BLOCK], cluster_b[KMEANS_LARGE_CLUSTER_BLOCK];
+    float cluster_norms[KMEANS_LARGE_CLUSTER_BLOCK];
+    for(int block_first = 0; block_first < pixel_count; block_first += KMEANS_LARGE_PIXEL_BLOCK)
+    {
+        int block_pixel_count = pixel_count - block_first;
+        if(block_pixel_count > KMEANS_LARGE_PIXEL_BLOCK) block_pixel_count = KMEANS_LARGE_PIXEL_BLOCK;
+        int padded_count = (int)align_to(block_pixel_count, KMEANS_LANE_COUNT);
+        for(int index = 0; index < padded_count; ++index)
+        {
+            Color4 pixel = pixels[block_first + ((index < block_pixel_count) ? index : block_pixel_count - 1)];
+            pixel_r[index] = pixel.r;
+            pixel_g[index] = pixel.g;
+            pixel_b[index] = pixel.b;
+            min_scores[index] = INT_MAX;
+            min_indices[index] = 0;
+        }
+        
+        for(int cluster_first = 0; cluster_first < cluster_count; cluster_first += KMEANS_LARGE_CLUSTER_BLOCK)
+        {
+            int block_cluster_count = cluster_count - cluster_first;
+            if(block_cluster_count > KMEANS_LARGE_CLUSTER_BLOCK) block_cluster_count = KMEANS_LARGE_CLUSTER_BLOCK;
+            for(int index = 0; index < block_cluster_count; ++index)
+            {
+                Color4 color = cluster_colors[cluster_first + index];
+                cluster_r[index] = -2.0f*color.r;
+                cluster_g[index] = -2.0f*color.g;
+                cluster_b[index] = -2.0f*color.b;
+                cluster_norms[index] = (float)get_color_length_squared(color);
+            }
+            
+            for(int group_first = 0; group_first < padded_count; group_first += KMEANS_LANE_COUNT)
+            {
+                float *group_r = pixel_r + group_first;
+                float *group_g = pixel_g + group_first;
+                float *group_b = pixel_b + group_first;
+                int scores[KMEANS_LANE_COUNT], indices[KMEANS_LANE_COUNT];
+                for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+                {
+                    scores[lane] = min_scores[group_first + lane];
+                    indices[lane] = min_indices[group_first + lane];
+                }
+                for(int index = 0; index < block_cluster_count; ++index)
+                {
+                    float r = cluster_r[index];
+                    float g = cluster_g[index];
+                    float b = cluster_b[index];
+                    float norm = cluster_norms[index];
+                    int cluster_index = cluster_first + index;
+                    for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+                    {
+                        int score = (int)(norm + group_r[lane]*r + group_g[lane]*g + group_b[lane]*b);
+                        int take = score < scores[lane];
+                        scores[lane] = take ? score : scores[lane];
+                        indices[lane] = take ? cluster_index : indices[lane];
+                    }
+                }
+                for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+                {
+                    min_scores[group_first + lane] = scores[lane];
+                    min_indices[group_first + lane] = indices[lane];
+                }
+            }
+        }
+        
+        for(int index = 0; index < block_pixel_count; ++index)
+        {
+            int pixel_index = block_first + index;
+            assign_tile_pixel(sums, pixels[pixel_index], cluster_indices + pixel_index, min_indices[index], full_update);
+        }
+    }
+    
+    finish_tile(filter, tile_index);
+}
+
+// NOTE: the memo grid already skips most of the scan, so it keeps the lane kernel at any count
+static KmeansTileCallback *
+get_classify_tile_callback(KmeansFilter *filter)
+{
+    KmeansTileCallback *result = classify_tile;
+    if(filter->cluster_count > KMEANS_LARGE_CLUSTER_COUNT && !filter->memo_cells) result = classify_large_tile;
+    switch(filter->cluster_count)
+    {
+        case 2: result = classify_tile_2; break;
+        case 4: result = classify_tile_4; break;
+        case 8: result = classify_tile_8; break;
+        case 16: result = classify_tile_16; break;
+        case 32: result = classify_tile_32; break;
+        case 64: result = classify_tile_64; break;
+        default: break;
+    }
+    return result;
+}
+
+static void
+add_pixel_to_kmeans_sums(KmeansSums *sums, Color4 pixel, int cluster_index, int sign)
+{
+    sums->cluster_pixel_counts[cluster_index] += sign;
+    sums->cluster_sums_r[cluster_index] += (unsigned long long)(sign*pixel.r);
+    sums->cluster_sums_g[cluster_index] += (unsigned long long)(sign*pixel.g);
+    sums->cluster_sums_b[cluster_index] += (unsigned long long)(sign*pixel.b);
+    sums->cluster_sums_sq[cluster_index] += (unsigned long long)(sign*get_color_length_squared(pixel));
+}
+
+// NOTE: nearest and second nearest cluster of count pixels picked through pixel_indices, in the
+// blocked |c|^2 - 2 p.c form of classify_large_tile. The second minimum is min(second,
+// max(score, min)), so it stays a select as well. The distances come back exact with |p|^2
+// added back, the nearest is the lowest index on ties and a tie with it makes the second
+// distance equal to the first, like the plain scan.
+static void
+find_two_nearest_clusters(Color4 *pixels, unsigned short *pixel_indices, int count, Color4 *cluster_colors,
+                          int cluster_count, int *out_min_indices, int *out_min_diffs, int *out_second_min_diffs)
+{
+    float pixel_r[KMEANS_LARGE_PIXEL_BLOCK], pixel_g[KMEANS_LARGE_PIXEL_BLOCK], pixel_b[KMEANS_LARGE_PIXEL_BLOCK];
+    int min_scores[KMEANS_LARGE_PIXEL_BLOCK], second_min_scores[KMEANS_LARGE_PIXEL_BLOCK];
+    float cluster_r[KMEANS_LARGE_CLUSTER_BLOCK], cluster_g[KMEANS_LARGE_CLUSTER_BLOCK], cluster_b[KMEANS_LARGE_CLUSTER_BLOCK];
+    float cluster_norms[KMEANS_LARGE_CLUSTER_BLOCK];
+    int padded_count = (int)align_to(count, KMEANS_LANE_COUNT);
+    for(int index = 0; index < padded_count; ++index)
+    {
+        Color4 pixel = pixels[pixel_indices[(index < count) ? index : count - 1]];
+        pixel_r[index] = pixel.r;
+        pixel_g[index] = pixel.g;
+        pixel_b[index] = pixel.b;
+        min_scores[index] = INT_MAX;
+        second_min_scores[index] = INT_MAX;
+        out_min_indices[index] = 0;
+    }
+    
+    for(int cluster_first = 0; cluster_first < cluster_count; cluster_first += KMEANS_LARGE_CLUSTER_BLOCK)
+    {
+        int block_cluster_count = cluster_count - cluster_first;
+        if(block_cluster_count > KMEANS_LARGE_CLUSTER_BLOCK) block_cluster_count = KMEANS_LARGE_CLUSTER_BLOCK;
+        for(int index = 0; index < block_cluster_count; ++index)
+        {
+            Color4 color = cluster_colors[cluster_first + index];
+            cluster_r[index] = -2.0f*color.r;
+            cluster_g[index] = -2.0f*color.g;
+            cluster_b[index] = -2.0f*color.b;
+            cluster_norms[index] = (float)get_color_length_squared(color);
+        }
+        
+        for(int group_first = 0; group_first < padded_count; group_first += KMEANS_LANE_COUNT)
+        {
+            float *group_r = pixel_r + group_first;
+            float *group_g = pixel_g + group_first;
+            float *group_b = pixel_b + group_first;
+            int scores[KMEANS_LANE_COUNT], second_scores[KMEANS_LANE_COUNT], indices[KMEANS_LANE_COUNT];
+            for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+            {
+                scores[lane] = min_scores[group_first + lane];
+                second_scores[lane] = second_min_scores[group_first + lane];
+                indices[lane] = out_min_indices[group_first + lane];
+            }
+            for(int index = 0; index < block_cluster_count; ++index)
+            {
+                float r = cluster_r[index];
+                float g = cluster_g[index];
+                float b = cluster_b[index];
+                float norm = cluster_norms[index];
+                int cluster_index = cluster_first + index;
+                for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+                {
+                    int score = (int)(norm + group_r[lane]*r + group_g[lane]*g + group_b[lane]*b);
+                    int take = score < scores[lane];
+                    int runner_up = take ? scores[lane] : score;
+                    second_scores[lane] = (runner_up < second_scores[lane]) ? runner_up : second_scores[lane];
+                    scores[lane] = take ? score : scores[lane];
+                    indices[lane] = take ? cluster_index : indices[lane];
+                }
+            }
+            for(int lane = 0; lane < KMEANS_LANE_COUNT; ++lane)
+            {
+                min_scores[group_first + lane] = scores[lane];
+                second_min_scores[group_first + lane] = second_scores[lane];
+                out_min_indices[group_first + lane] = indices[lane];
+            }
+        }
+    }
+    
+    for(int index = 0; index < count; ++index)
+    {
+        int length_squared = (int)(pixel_r[index]*pixel_r[index] + pixel_g[index]*pixel_g[index] + pixel_b[index]*pixel_b[index]);
+        out_min_diffs[index] = min_scores[index] + length_squared;
+        out_second_min_diffs[index] = (second_min_scores[index] == INT_MAX) ? INT_MAX : second_min_scores[index] + length_squared;
+    }
+}
+
+// NOTE: same result as classify_tile, but only the tile's active pixels are classified. When
+// the drift reaches the tile's expand_drift, or when every pixel has to be summed anyway, the
+// whole tile is rescanned to rebuild the list. Pixels whose margin stays within drift_band, the
+// drift of the last iteration, are kept in the list since they'll likely fail again.
+static void
+classify_active_tile(KmeansFilter *filter, int tile_index)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    Color4 *pixels = filter->pixels + first_pixel;
+    int *cluster_indices = filter->cluster_indices + first_pixel;
+    unsigned short *active_pixels = filter->active_pixels + first_pixel;
+    float *expire_drifts = filter->pixel_expire_drifts + first_pixel;
+    double *cluster_drifts = filter->cluster_drifts;
+    Color4 *cluster_colors = filter->cluster_colors;
+    int cluster_count = filter->cluster_count;
+    int full_update = filter->full_update;
+    double global_drift = filter->global_drift;
+    double drift_band = filter->drift_band;
+    KmeansActiveTile *tile = filter->active_tiles + tile_index;
+    KmeansSums *sums = filter->tile_sums + tile_index;
+    clear_kmeans_sums(sums, cluster_count);
+    
+    if(full_update || global_drift >= tile->expand_drift)
+    {
+        double min_slack = DBL_MAX;
+        tile->active_pixel_count = 0;
+        for(int pixel_index = 0; pixel_index < pixel_count; ++pixel_index)
+        {
+            int cluster_index = cluster_indices[pixel_index];
+            double slack = expire_drifts[pixel_index] - cluster_drifts[cluster_index];
+            if(slack <= drift_band)
+            {
+                active_pixels[tile->active_pixel_count++] = (unsigned short)pixel_index;
+            }
+            else
+            {
+                if(slack < min_slack) min_slack = slack;
+                if(full_update) add_pixel_to_kmeans_sums(sums, pixels[pixel_index], cluster_index, 1);
+            }
+        }
+        tile->expand_drift = global_drift + min_slack;
+    }
+    
+    int kept_pixel_count = 0;
+    for(int block_first = 0; block_first < tile->active_pixel_count; block_first += KMEANS_LARGE_PIXEL_BLOCK)
+    {
+        int block_pixel_count = tile->active_pixel_count - block_first;
+        if(block_pixel_count > KMEANS_LARGE_PIXEL_BLOCK) block_pixel_count = KMEANS_LARGE_PIXEL_BLOCK;
+        unsigned short block_pixel_indices[KMEANS_LARGE_PIXEL_BLOCK];
+        int min_indices[KMEANS_LARGE_PIXEL_BLOCK], min_diffs[KMEANS_LARGE_PIXEL_BLOCK], second_min_diffs[KMEANS_LARGE_PIXEL_BLOCK];
+        copy_memory(block_pixel_indices, active_pixels + block_first, block_pixel_count*sizeof(unsigned short));
+        find_two_nearest_clusters(pixels, block_pixel_indices, block_pixel_count, cluster_colors, cluster_count,
+                                  min_indices, min_diffs, second_min_diffs);
+        
+        for(int index = 0; index < block_pixel_count; ++index)
+        {
+            int pixel_index = block_pixel_indices[index];
+            Color4 pixel = pixels[pixel_index];
+            int min_test_index = min_indices[index];
+            int old_index = cluster_indices[pixel_index];
+            if(old_index != min_test_index)
+            {
+                ++sums->migration_count;
+                cluster_indices[pixel_index] = min_test_index;
+                if(!full_update) add_pixel_to_kmeans_sums(sums, pixel, old_index, -1);
+            }
+            if(full_update || old_index != min_test_index)
+            {
+                add_pixel_to_kmeans_sums(sums, pixel, min_test_index, 1);
+            }
+            
+            // NOTE: with a single cluster nothing can ever migrate
+            float margin = FLT_MAX;
+            if(cluster_count > 1) margin = sqrtf((float)second_min_diffs[index]) - sqrtf((float)min_diffs[index]) - KMEANS_MARGIN_EPSILON;
+            expire_drifts[pixel_index] = (float)(cluster_drifts[min_test_index] + margin);
+            if(margin <= drift_band)
+            {
+                active_pixels[kept_pixel_count++] = (unsigned short)pixel_index;
+            }
+            else if(global_drift + margin < tile->expand_drift)
+            {
+                tile->expand_drift = global_drift + margin;
+            }
+        }
+    }
+    tile->active_pixel_count = kept_pixel_count;
+    
+    finish_tile(filter, tile_index);
+}
+
+// NOTE: the nearest centroid of a pixel moves at most shift[c] closer and every other centroid at
+// most max_shift closer, so a pixel with margin (second nearest - nearest distance) can't migrate
+// before the sum of shift[c] + max_shift over the iterations exceeds its margin. cluster_drifts[c]
+// accumulates exactly that, global_drift accumulates the upper bound 2*max_shift for whole tiles.
+static int
+get_color_distance_squared(Color4 a, Color4 b)
+{
+    int r_diff = a.r - b.r;
+    int g_diff = a.g - b.g;
+    int b_diff = a.b - b.b;
+    return r_diff*r_diff + g_diff*g_diff + b_diff*b_diff;
+}
+
+static float
+get_color_distance(Color4 a, Color4 b)
+{
+    return sqrtf((float)get_color_distance_squared(a, b));
+}
+
+static void
+update_active_set_drifts(KmeansFilter *filter)
+{
+    float max_shift = 0.0f;
+    for(int cluster_index = 0; cluster_index < filter->cluster_count; ++cluster_index)
+    {
+        float shift = get_color_distance(filter->previous_cluster_colors[cluster_index], filter->cluster_colors[cluster_index]);
+        if(shift > max_shift) max_shift = shift;
+    }
+    for(int cluster_index = 0; cluster_index < filter->cluster_count; ++cluster_index)
+    {
+        float shift = get_color_distance(filter->previous_cluster_colors[cluster_index], filter->cluster_colors[cluster_index]);
+        filter->cluster_drifts[cluster_index] += shift + max_shift;
+    }
+    filter->global_drift += 2.0*max_shift;
+    filter->drift_band = 2.0*max_shift;
+}
+
+static void
+fill_tile(KmeansFilter *filter, int tile_index)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    for(int i = first_pixel; i < first_pixel + pixel_count; ++i)
+    {
+        filter->output[i] = filter->cluster_colors[filter->cluster_indices[i]];
+    }
+}
+
+// NOTE: drain the thread's own range first, then steal from the ranges on the same node and
+// only then from the other nodes. Returns the number of stolen tiles.
+static int
+claim_tiles(KmeansFilter *filter, int thread_index, KmeansTileCallback *callback)
+{
+    int result = 0;
+    int home_node = filter->tile_ranges[thread_index].node_index;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(int offset = 0; offset < filter->thread_count; ++offset)
+        {
+            int range_index = (thread_index + offset) % filter->thread_count;
+            KmeansTileRange *range = filter->tile_ranges + range_index;
+            if((range->node_index == home_node) != (pass == 0)) continue;
+            
+            while(range->next_tile < range->end_tile)
+            {
+                int tile_index = atomic_add(&range->next_tile, 1);
+                if(tile_index >= range->end_tile) break;
+                callback(filter, tile_index);
+                if(range_index != thread_index) ++result;
+            }
+        }
+    }
+    return result;
+}
+
+static void 
+do_kmeans_filter_work(void *param)
+{
+    KmeansFilterWork *work = (KmeansFilterWork *)param;
+    unsigned long long begin_time = get_trace_time();
+    PerfCounters begin_counters;
+    read_perf_counters(&begin_counters);
+    
+    int iteration = 0;
+    work->out_stolen_tile_count = 0;
+    for(int filter_index = 0; filter_index < work->filter_count; ++filter_index)
+    {
+        KmeansFilter *filter = work->filters + filter_index;
+        if(filter->running)
+        {
+            KmeansTileCallback *callback = filter->active_tiles ? classify_active_tile : get_classify_tile_callback(filter);
+            work->out_stolen_tile_count += claim_tiles(filter, work->thread_index, callback);
+            iteration = filter->iteration;
+        }
+    }
+    
+    PerfCounters end_counters;
+    read_perf_counters(&end_counters);
+    clear_memory(&work->out_perf_counters, sizeof(work->out_perf_counters));
+    accumulate_perf_counters(&work->out_perf_counters, &begin_counters, &end_counters);
+    record_trace_event("classify", iteration, begin_time);
+}
+
+static void 
+do_fill_image_work(void *param)
+{
+    KmeansFilterWork *work = (KmeansFilterWork *)param;
+    unsigned long long begin_time = get_trace_time();
+    for(int filter_index = 0; filter_index < work->filter_count; ++filter_index)
+    {
+        claim_tiles(work->filters + filter_index, work->thread_index, fill_tile);
+    }
+    record_trace_event("fill", 0, begin_time);
+}
+
+static void 
+allocate_random_clusters(Color4 *pixels, int pixel_count, Color4 *cluster_colors, int cluster_count)
+{
+    for(int i = 0; i < cluster_count; ++i)
+    {
+        cluster_colors[i] = pixels[0];
+    }
+    
+    int unique_color_count = 0;
+    for(int i = 0; i < pixel_count; ++i)
+    {
+        int is_unique = 1;
+        for(int j = 0; j < unique_color_count; ++j)
+        {
+            if(pixels[i].r == cluster_colors[j].r && 
+               pixels[i].g == cluster_colors[j].g && 
+               pixels[i].b == cluster_colors[j].b)
+            {
+                is_unique = 0;
+                break;
+            }
+        }
+        
+        if(is_unique)
+        {
+            cluster_colors[unique_color_count++] = pixels[i];
+        }
+        
+        if(unique_color_count == cluster_count) break;
+    }
+}
+
+// NOTE: seeds of the extra restarts, random distinct pixel colors from an xorshift generator seeded
+// with the restart index so that runs are repeatable. Falls back to repeating the colors found
+// when the image has too few of them.
+static void
+allocate_seeded_clusters(Color4 *pixels, int pixel_count, Color4 *cluster_colors, int cluster_count, unsigned int seed)
+{
+    unsigned int state = seed*2654435761u | 1;
+    int unique_color_count = 0;
+    for(int attempt = 0; attempt < 16*cluster_count && unique_color_count < cluster_count; ++attempt)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        Color4 color = pixels[state % (unsigned int)pixel_count];
+        int is_unique = 1;
+        for(int j = 0; j < unique_color_count; ++j)
+        {
+            if(color.r == cluster_colors[j].r && 
+               color.g == cluster_colors[j].g && 
+               color.b == cluster_colors[j].b)
+            {
+                is_unique = 0;
+                break;
+            }
+        }
+        if(is_unique)
+        {
+            cluster_colors[unique_color_count++] = color;
+        }
+    }
+    for(int i = unique_color_count; i < cluster_count; ++i)
+    {
+        cluster_colors[i] = cluster_colors[i % unique_color_count];
+    }
+}
+
+static Color4
+get_bisect_node_mean(BisectTree *tree, BisectNode *node)
+{
+    unsigned long long sum_r = 0, sum_g = 0, sum_b = 0;
+    int *pixel_order = tree->pixel_order + node->first_pixel;
+    for(int i = 0; i < node->pixel_count; ++i)
+    {
+        Color4 pixel = tree->pixels[pixel_order[i]];
+        sum_r += pixel.r;
+        sum_g += pixel.g;
+        sum_b += pixel.b;
+    }
+    Color4 result = {0};
+    if(node->pixel_count > 0)
+    {
+        result.r = (unsigned char)(sum_r / node->pixel_count);
+        result.g = (unsigned char)(sum_g / node->pixel_count);
+        result.b = (unsigned char)(sum_b / node->pixel_count);
+    }
+    return result;
+}
+
+static Color4
+get_bisect_farthest_pixel(BisectTree *tree, BisectNode *node, Color4 from)
+{
+    Color4 result = from;
+    int max_distance = -1;
+    int *pixel_order = tree->pixel_order + node->first_pixel;
+    for(int i = 0; i < node->pixel_count; ++i)
+    {
+        Color4 pixel = tree->pixels[pixel_order[i]];
+        int distance = get_color_distance_squared(pixel, from);
+        if(distance > max_distance)
+        {
+            max_distance = distance;
+            result = pixel;
+        }
+    }
+    return result;
+}
+
+// NOTE: all the node's clusters get the mean color, they only differ when the node couldn't be
+// split because its pixels share one color
+static void
+make_bisect_leaf(BisectTree *tree, BisectNode *node)
+{
+    Color4 mean = get_bisect_node_mean(tree, node);
+    for(int i = 0; i < node->cluster_count; ++i)
+    {
+        tree->cluster_colors[node->first_cluster + i] = mean;
+    }
+    
+    node->sse = 0;
+    int *pixel_order = tree->pixel_order + node->first_pixel;
+    for(int i = 0; i < node->pixel_count; ++i)
+    {
+        int pixel_index = pixel_order[i];
+        tree->cluster_indices[pixel_index] = node->first_cluster;
+        node->sse += get_color_distance_squared(tree->pixels[pixel_index], mean);
+    }
+}
+
+// NOTE: 2-means on the node's pixels seeded with the pixel farthest from the mean and the pixel
+// farthest from that one, then the pixel range is partitioned in place so that each child owns
+// a contiguous range again. The clusters are dealt to the children by their SSE. Returns 0 when
+// the pixels can't be split.
+static int
+bisect_node(BisectTree *tree, BisectNode *node, BisectNode **out_children)
+{
+    int result = 0;
+    int *pixel_order = tree->pixel_order + node->first_pixel;
+    unsigned char *pixel_sides = tree->pixel_sides + node->first_pixel;
+    int pixel_count = node->pixel_count;
+    
+    Color4 colors[2];
+    colors[0] = get_bisect_farthest_pixel(tree, node, get_bisect_node_mean(tree, node));
+    colors[1] = get_bisect_farthest_pixel(tree, node, colors[0]);
+    if(get_color_distance_squared(colors[0], colors[1]) > 0)
+    {
+        unsigned long long sums_r[2], sums_g[2], sums_b[2], sums_sq[2];
+        int counts[2];
+        for(int iteration = 0; iteration < BISECT_MAX_ITERATION; ++iteration)
+        {
+            int migration_count = 0;
+            for(int side = 0; side < 2; ++side)
+            {
+                sums_r[side] = sums_g[side] = sums_b[side] = sums_sq[side] = 0;
+                counts[side] = 0;
+            }
+            for(int i = 0; i < pixel_count; ++i)
+            {
+                Color4 pixel = tree->pixels[pixel_order[i]];
+                int side = get_color_distance_squared(pixel, colors[1]) < get_color_distance_squared(pixel, colors[0]);
+                if(iteration == 0 || pixel_sides[i] != side)
+                {
+                    ++migration_count;
+                    pixel_sides[i] = (unsigned char)side;
+                }
+                sums_r[side] += pixel.r;
+                sums_g[side] += pixel.g;
+                sums_b[side] += pixel.b;
+                sums_sq[side] += get_color_length_squared(pixel);
+                ++counts[side];
+            }
+            for(int side = 0; side < 2; ++side)
+            {
+                if(counts[side] > 0)
+                {
+                    colors[side].r = (unsigned char)(sums_r[side] / counts[side]);
+                    colors[side].g = (unsigned char)(sums_g[side] / counts[side]);
+                    colors[side].b = (unsigned char)(sums_b[side] / counts[side]);
+                }
+            }
+            if(migration_count == 0) break;
+        }
+        
+        if(counts[0] > 0 && counts[1] > 0)
+        {
+            result = 1;
+            int left = 0, right = pixel_count - 1;
+            while(left <= right)
+            {
+                if(pixel_sides[left] == 0)
+                {
+                    ++left;
+                }
+                else
+                {
+                    int swap_order = pixel_order[left];
+                    pixel_order[left] = pixel_order[right];
+                    pixel_order[right] = swap_order;
+                    unsigned char swap_side = pixel_sides[left];
+                    pixel_sides[left] = pixel_sides[right];
+                    pixel_sides[right] = swap_side;
+                    --right;
+                }
+            }
+            
+            double sses[2];
+            for(int side = 0; side < 2; ++side)
+            {
+                Color4 color = colors[side];
+                unsigned long long dot = color.r*sums_r[side] + color.g*sums_g[side] + color.b*sums_b[side];
+                sses[side] = (double)(sums_sq[side] - 2*dot + (unsigned long long)counts[side]*get_color_length_squared(color));
+            }
+            int left_cluster_count = node->cluster_count / 2;
+            if(sses[0] + sses[1] > 0)
+            {
+                left_cluster_count = (int)(node->cluster_count * sses[0] / (sses[0] + sses[1]) + 0.5);
+            }
+            if(left_cluster_count < 1) left_cluster_count = 1;
+            if(left_cluster_count > node->cluster_count - 1) left_cluster_count = node->cluster_count - 1;
+            if(left_cluster_count > counts[0]) left_cluster_count = counts[0];
+            if(node->cluster_count - left_cluster_count > counts[1]) left_cluster_count = node->cluster_count - counts[1];
+            
+            int child_index = atomic_add(&tree->node_count, 2);
+            BisectNode *children = tree->nodes + child_index;
+            for(int side = 0; side < 2; ++side)
+            {
+                BisectNode *child = children + side;
+                child->tree = tree;
+                child->first_pixel = node->first_pixel + (side ? counts[0] : 0);
+                child->pixel_count = counts[side];
+                child->first_cluster = node->first_cluster + (side ? left_cluster_count : 0);
+                child->cluster_count = side ? node->cluster_count - left_cluster_count : left_cluster_count;
+                child->sse = 0;
+                out_children[side] = child;
+            }
+        }
+    }
+    return result;
+}
+
+// NOTE: the left child is split by the same work and the right child becomes a new work, or is
+// split inline when the queue is full, so subtrees spread over the pool as the tree widens
+static void
+do_bisect_work(void *param)
+{
+    BisectNode *node = (BisectNode *)param;
+    BisectTree *tree = node->tree;
+    unsigned long long begin_time = get_trace_time();
+    while(node)
+    {
+        BisectNode *children[2];
+        BisectNode *next_node = 0;
+        if(node->cluster_count > 1 && bisect_node(tree, node, children))
+        {
+            if(!try_queue_work(tree->queue, do_bisect_work, children[1]))
+            {
+                do_bisect_work(children[1]);
+            }
+            next_node = children[0];
+        }
+        else
+        {
+            make_bisect_leaf(tree, node);
+        }
+        node = next_node;
+    }
+    record_trace_event("bisect", 0, begin_time);
+}
+
+// NOTE: writes cluster_count clusters and the cluster index of every pixel, returns 0 when out
+// of memory. The result only depends on the pixels, not on which thread split which node.
+static int
+build_bisect_clusters(Color4 *pixels, int pixel_count, Color4 *cluster_colors, int *cluster_indices, 
+                      int cluster_count, MemoryArena *arena, WorkQueue *queue, unsigned long long *out_sse)
+{
+    int result = 0;
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    BisectTree tree;
+    clear_memory(&tree, sizeof(tree));
+    tree.queue = queue;
+    tree.pixels = pixels;
+    tree.cluster_colors = cluster_colors;
+    tree.cluster_indices = cluster_indices;
+    tree.pixel_order = push_array(arena, pixel_count, int);
+    tree.pixel_sides = push_array(arena, pixel_count, unsigned char);
+    tree.nodes = push_array(arena, 2 * cluster_count, BisectNode);
+    if(tree.pixel_order && tree.pixel_sides && tree.nodes)
+    {
+        result = 1;
+        for(int i = 0; i < pixel_count; ++i)
+        {
+            tree.pixel_order[i] = i;
+        }
+        BisectNode *root = tree.nodes;
+        clear_memory(root, sizeof(*root));
+        root->tree = &tree;
+        root->pixel_count = pixel_count;
+        root->cluster_count = cluster_count;
+        tree.node_count = 1;
+        
+        queue_work(queue, do_bisect_work, root);
+        complete_all_works(queue);
+        
+        *out_sse = 0;
+        for(int node_index = 0; node_index < tree.node_count; ++node_index)
+        {
+            *out_sse += tree.nodes[node_index].sse;
+        }
+    }
+    end_temporary_memory(temporary);
+    return result;
+}
+
+// NOTE: slices are whole tiles, so the tiles a thread owns are exactly the pixels it first touched
+static void
+get_thread_pixel_range(int pixel_count, int thread_count, int thread_index, int *out_first, int *out_count)
+{
+    int tile_count = (pixel_count + KMEANS_TILE_PIXEL_COUNT - 1) / KMEANS_TILE_PIXEL_COUNT;
+    int pixel_per_thread = ((tile_count + thread_count - 1) / thread_count) * KMEANS_TILE_PIXEL_COUNT;
+    int first = thread_index * pixel_per_thread;
+    if(first > pixel_count) first = pixel_count;
+    int count = pixel_count - first;
+    if(count > pixel_per_thread) count = pixel_per_thread;
+    *out_first = first;
+    *out_count = count;
+}
+
+static void
+do_first_touch_work(void *param)
+{
+    FirstTouchWork *work = (FirstTouchWork *)param;
+    int first, count;
+    get_thread_pixel_range(work->pixel_count, work->thread_count, get_worker_thread_index(), &first, &count);
+    clear_memory(work->array + first*work->element_size, count*work->element_size);
+}
+
+// NOTE: with pinned threads, pages of a fresh allocation land on the node of the thread that
+// touches them first, so let every thread clear the slice it owns before anyone else writes it
+static void
+first_touch_pixel_slices(WorkQueue *queue, int thread_count, void *array, size_t element_size, int pixel_count)
+{
+    FirstTouchWork work;
+    work.pixel_count = pixel_count;
+    work.thread_count = thread_count;
+    work.element_size = element_size;
+    work.array = (char *)array;
+    if(queue->affinity)
+    {
+        run_on_every_thread(queue, thread_count, do_first_touch_work, &work);
+    }
+    else
+    {
+        clear_memory(array, pixel_count * element_size);
+    }
+}
+
+static void
+do_owned_work(void *param)
+{
+    OwnedWork *work = (OwnedWork *)param;
+    work->callback(work->first_work + get_worker_thread_index()*work->work_stride);
+}
+
+// NOTE: queue one work per thread, when the threads are pinned the work of thread i always
+// runs on thread i so that it keeps streaming the slice it first touched
+static void
+run_thread_works(WorkQueue *queue, int thread_count, WorkQueueEntryCallback *callback, char *first_work, size_t work_stride)
+{
+    if(queue->affinity)
+    {
+        OwnedWork work;
+        work.callback = callback;
+        work.first_work = first_work;
+        work.work_stride = work_stride;
+        run_on_every_thread(queue, thread_count, do_owned_work, &work);
+    }
+    else
+    {
+        for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+        {
+            queue_work(queue, callback, first_work + thread_index*work_stride);
+        }
+        complete_all_works(queue);
+    }
+}
+
+// NOTE: lays out the state of one independent kmeans run. All runs share the read only pixels
+// but each has its own labels, clusters, tiles and sums. Everything is pushed on the arena, so
+// the caller releases it with its temporary memory.
+static int
+init_kmeans_filter(KmeansFilter *filter, Color4 *pixels, Color4 *output, int pixel_count, 
+                   KmeansOptions *options, MemoryArena *arena, WorkQueue *queue, int thread_count)
+{
+    int result = 0;
+    int cluster_count = options->cluster_count;
+    int use_active_set = options->use_active_set;
+    int use_memo_grid = options->use_memo_grid && cluster_count < KMEANS_MEMO_AMBIGUOUS;
+    ThreadAffinity *affinity = queue->affinity;
+    int node_count = affinity ? affinity->node_count : 1;
+    int tile_count = (pixel_count + KMEANS_TILE_PIXEL_COUNT - 1) / KMEANS_TILE_PIXEL_COUNT;
+    size_t sums_size = align_to(cluster_count*sizeof(unsigned long long)*4 + cluster_count*sizeof(int), 128);
+    size_t working_memory_size = thread_count*sizeof(KmeansTileRange) + 
+                                 align_to(node_count*sizeof(KmeansNode), 128) + 
+                                 align_to(tile_count*sizeof(KmeansSums), 128) + 
+                                 align_to(thread_count*sizeof(int), 128) + 
+                                 align_to(cluster_count*sizeof(Color4), 128) + 
+                                 (node_count + tile_count + 1)*sums_size + 128;
+    if(use_active_set)
+    {
+        working_memory_size += align_to(tile_count*sizeof(KmeansActiveTile), 128) + 
+                               align_to(cluster_count*sizeof(double), 128);
+    }
+    if(use_memo_grid)
+    {
+        working_memory_size += KMEANS_MEMO_CELL_COUNT*sizeof(unsigned int);
+    }
+    
+    clear_memory(filter, sizeof(*filter));
+    filter->working_memory = (char *)push_size(arena, working_memory_size);
+    filter->cluster_indices = push_array(arena, pixel_count, int);
+    filter->cluster_colors = push_array(arena, cluster_count, Color4);
+    if(use_active_set)
+    {
+        filter->active_pixels = push_array(arena, pixel_count, unsigned short);
+        filter->pixel_expire_drifts = push_array(arena, pixel_count, float);
+    }
+    if(filter->working_memory && filter->cluster_indices && filter->cluster_colors && 
+       (!use_active_set || (filter->active_pixels && filter->pixel_expire_drifts)))
+    {
+        result = 1;
+        clear_memory(filter->working_memory, working_memory_size);
+        first_touch_pixel_slices(queue, thread_count, filter->cluster_indices, sizeof(int), pixel_count);
+        
+        filter->pixel_count = pixel_count;
+        filter->cluster_count = cluster_count;
+        filter->thread_count = thread_count;
+        filter->node_count = node_count;
+        filter->tile_count = tile_count;
+        filter->tile_per_thread = (tile_count + thread_count - 1) / thread_count;
+        filter->pixels = pixels;
+        filter->output = output;
+        filter->running = 1;
+        
+        char *ptr_to_allocate = (char *)align_to((size_t)filter->working_memory, 128);
+        filter->tile_ranges = (KmeansTileRange *)ptr_to_allocate;
+        ptr_to_allocate += thread_count * sizeof(KmeansTileRange);
+        filter->nodes = (KmeansNode *)ptr_to_allocate;
+        ptr_to_allocate += align_to(node_count * sizeof(KmeansNode), 128);
+        filter->tile_sums = (KmeansSums *)ptr_to_allocate;
+        ptr_to_allocate += align_to(tile_count * sizeof(KmeansSums), 128);
+        int *node_range_indices = (int *)ptr_to_allocate;
+        ptr_to_allocate += align_to(thread_count * sizeof(int), 128);
+        
+        for(int node_index = 0; node_index < node_count; ++node_index)
+        {
+            KmeansNode *node = filter->nodes + node_index;
+            node->range_indices = node_range_indices;
+            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+            {
+                int thread_node = affinity ? affinity->thread_nodes[thread_index] : 0;
+                if(thread_node == node_index)
+                {
+                    node->range_indices[node->range_count++] = thread_index;
+                }
+            }
+            node_range_indices += node->range_count;
+            ptr_to_allocate = assign_kmeans_sums(&node->sums, ptr_to_allocate, cluster_count);
+        }
+        for(int tile_index = 0; tile_index < tile_count; ++tile_index)
+        {
+            ptr_to_allocate = assign_kmeans_sums(filter->tile_sums + tile_index, ptr_to_allocate, cluster_count);
+        }
+        ptr_to_allocate = assign_kmeans_sums(&filter->total_sums, ptr_to_allocate, cluster_count);
+        filter->previous_cluster_colors = (Color4 *)ptr_to_allocate;
+        ptr_to_allocate += align_to(cluster_count * sizeof(Color4), 128);
+        if(use_active_set)
+        {
+            // NOTE: zeroed expire drifts put every pixel in the active set of the first iteration
+            first_touch_pixel_slices(queue, thread_count, filter->active_pixels, sizeof(unsigned short), pixel_count);
+            first_touch_pixel_slices(queue, thread_count, filter->pixel_expire_drifts, sizeof(float), pixel_count);
+            filter->active_tiles = (KmeansActiveTile *)ptr_to_allocate;
+            ptr_to_allocate += align_to(tile_count * sizeof(KmeansActiveTile), 128);
+            filter->cluster_drifts = (double *)ptr_to_allocate;
+            ptr_to_allocate += align_to(cluster_count * sizeof(double), 128);
+        }
+        if(use_memo_grid)
+        {
+            // NOTE: zeroed cells are generation 0, which no iteration uses
+            filter->memo_cells = (unsigned int *)ptr_to_allocate;
+            ptr_to_allocate += KMEANS_MEMO_CELL_COUNT * sizeof(unsigned int);
+        }
+        
+        for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+        {
+            KmeansTileRange *range = filter->tile_ranges + thread_index;
+            range->first_tile = thread_index * filter->tile_per_thread;
+            if(range->first_tile > tile_count) range->first_tile = tile_count;
+            range->end_tile = range->first_tile + filter->tile_per_thread;
+            if(range->end_tile > tile_count) range->end_tile = tile_count;
+            range->node_index = affinity ? affinity->thread_nodes[thread_index] : 0;
+            filter->nodes[range->node_index].tile_count += range->end_tile - range->first_tile;
+        }
+    }
+    return result;
+}
+
+static void
+reset_kmeans_tile_ranges(KmeansFilter *filter)
+{
+    for(int thread_index = 0; thread_index < filter->thread_count; ++thread_index)
+    {
+        filter->tile_ranges[thread_index].next_tile = filter->tile_ranges[thread_index].first_tile;
+    }
+}
+
+static void
+begin_kmeans_iteration(KmeansFilter *filter, int iteration, int full_update_period)
+{
+    filter->iteration = iteration;
+    filter->full_update = (full_update_period <= 0 || (iteration - 1) % full_update_period == 0);
+    reset_kmeans_tile_ranges(filter);
+    if(filter->memo_cells)
+    {
+        // NOTE: the clusters moved, a new generation makes every cell stale at once
+        filter->memo_generation = (filter->memo_generation + 1) & 0xffff;
+        if(filter->memo_generation == 0)
+        {
+            clear_memory((void *)filter->memo_cells, KMEANS_MEMO_CELL_COUNT * sizeof(unsigned int));
+            filter->memo_generation = 1;
+        }
+    }
+    for(int node_index = 0; node_index < filter->node_count; ++node_index)
+    {
+        filter->nodes[node_index].remaining_tile_count = filter->nodes[node_index].tile_count;
+    }
+}
+
+// NOTE: merges the node sums of the classify pass and moves the clusters, returns the number of
+// migrated pixels
+static int
+end_kmeans_iteration(KmeansFilter *filter)
+{
+    int cluster_count = filter->cluster_count;
+    KmeansSums *node_sums[MAX_NUMA_NODE_COUNT];
+    for(int node_index = 0; node_index < filter->node_count; ++node_index)
+    {
+        node_sums[node_index] = &filter->nodes[node_index].sums;
+    }
+    merge_kmeans_sums_tree(node_sums, filter->node_count, cluster_count);
+    if(filter->full_update)
+    {
+        clear_kmeans_sums(&filter->total_sums, cluster_count);
+    }
+    add_kmeans_sums(&filter->total_sums, node_sums[0], cluster_count);
+    
+    // NOTE: the SSE of this classification is measured against the clusters it used
+    filter->previous_sse = filter->sse;
+    filter->sse = get_kmeans_sse(&filter->total_sums, filter->cluster_colors, cluster_count);
+    copy_memory(filter->previous_cluster_colors, filter->cluster_colors, cluster_count * sizeof(Color4));
+    update_cluster_colors(filter->cluster_colors, &filter->total_sums, cluster_count);
+    filter->max_shift_squared = 0;
+    for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+    {
+        int shift_squared = get_color_distance_squared(filter->previous_cluster_colors[cluster_index], 
+                                                       filter->cluster_colors[cluster_index]);
+        if(shift_squared > filter->max_shift_squared) filter->max_shift_squared = shift_squared;
+    }
+    if(filter->active_tiles) update_active_set_drifts(filter);
+    return node_sums[0]->migration_count;
+}
+
+// NOTE: any of the rules stops the run. The rules match the other backends so that they stop
+// on the same iteration.
+static int
+has_kmeans_converged(KmeansFilter *filter, KmeansOptions *options)
+{
+    double sse = filter->features ? filter->feature_sse : (double)filter->sse;
+    double previous_sse = filter->features ? filter->previous_feature_sse : (double)filter->previous_sse;
+    double max_shift_squared = filter->features ? filter->feature_max_shift_squared : (double)filter->max_shift_squared;
+    int result = (filter->total_migration_count < options->migration_threshold * filter->pixel_count);
+    if(options->sse_tolerance > 0 && filter->iteration > 1 && previous_sse > 0)
+    {
+        double improvement = (previous_sse - sse) / previous_sse;
+        if(improvement < options->sse_tolerance) result = 1;
+    }
+    if(options->max_shift >= 0 && max_shift_squared <= options->max_shift*options->max_shift)
+    {
+        result = 1;
+    }
+    return result;
+}
+
+// NOTE: successive halving, the better half of the candidates by SSE survives, ties go to
+// the lower restart index. Returns the number of candidates left.
+static int
+prune_kmeans_restarts(KmeansFilter *filters, int filter_count)
+{
+    int candidate_count = 0;
+    for(int filter_index = 0; filter_index < filter_count; ++filter_index)
+    {
+        if(filters[filter_index].candidate) ++candidate_count;
+    }
+    int keep_count = (candidate_count + 1) / 2;
+    for(int filter_index = 0; filter_index < filter_count; ++filter_index)
+    {
+        KmeansFilter *filter = filters + filter_index;
+        if(filter->candidate)
+        {
+            int rank = 0;
+            for(int other_index = 0; other_index < filter_count; ++other_index)
+            {
+                KmeansFilter *other = filters + other_index;
+                if(other->candidate && 
+                   (other->sse < filter->sse || (other->sse == filter->sse && other_index < filter_index)))
+                {
+                    ++rank;
+                }
+            }
+            if(rank >= keep_count)
+            {
+                filter->pruned = 1;
+                filter->running = 0;
+            }
+        }
+    }
+    for(int filter_index = 0; filter_index < filter_count; ++filter_index)
+    {
+        if(filters[filter_index].pruned) filters[filter_index].candidate = 0;
+    }
+    return keep_count;
+}
+
+// NOTE: with full_update_period > 0 only the first iteration and every full_update_period-th
+// after it sum all pixels, the others only sum the (old, new) deltas of the migrated pixels
+// into the running totals. 0 sums all pixels every iteration. use_active_set only re-classifies
+// the pixels close enough to a decision boundary, the result is the same either way.
+// With restart_count > 1 the restarts iterate side by side on the same thread pool, every
+// KMEANS_RESTART_PRUNE_ITERATION * 2^i iterations the worse half by SSE is dropped and the
+// remaining restart with the lowest SSE writes the output. use_bisecting seeds with the bisecting
+// tree instead and only runs bisect_refine_iteration flat iterations after it.
+// initial_cluster_colors, when set, seeds the first run instead. The clusters the output was
+// filled with are copied to out_cluster_colors when it is set.
+static void 
+filter_bitmap_with_kmean(Color4 *output, Color4 *pixels, int width, int height, KmeansOptions *options, 
+                         MemoryArena *arena, WorkQueue *queue, int thread_count, KmeansResult *out_result, 
+                         Color4 *out_cluster_colors)
+{
+    int pixel_count = width * height;
+    int cluster_count = options->cluster_count;
+    int restart_count = options->restart_count > 1 ? options->restart_count : 1;
+    if(options->use_bisecting) restart_count = 1;
+    clear_memory(out_result, sizeof(*out_result));
+    if(cluster_count <= pixel_count)
+    {
+        TemporaryMemory temporary = begin_temporary_memory(arena);
+        size_t work_stride = align_to(sizeof(KmeansFilterWork), 128);
+        char *works = (char *)push_size(arena, thread_count*work_stride + 128);
+        KmeansFilter *filters = push_array(arena, restart_count, KmeansFilter);
+        int initialized_count = 0;
+        if(works && filters)
+        {
+            while(initialized_count < restart_count && 
+                  init_kmeans_filter(filters + initialized_count, pixels, output, pixel_count, options, 
+                                     arena, queue, thread_count))
+            {
+                ++initialized_count;
+            }
+        }
+        
+        if(initialized_count == restart_count)
+        {
+            int max_iteration = options->max_iteration;
+            unsigned long long seed_begin_time = get_trace_time();
+            for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+            {
+                KmeansFilter *filter = filters + restart_index;
+                filter->candidate = 1;
+                if(restart_index == 0 && options->initial_cluster_colors)
+                {
+                    copy_memory(filter->cluster_colors, options->initial_cluster_colors, cluster_count * sizeof(Color4));
+                }
+                else if(options->use_bisecting && 
+                   build_bisect_clusters(pixels, pixel_count, filter->cluster_colors, filter->cluster_indices, 
+                                         cluster_count, arena, queue, &filter->sse))
+                {
+                    max_iteration = options->bisect_refine_iteration;
+                }
+                else if(restart_index == 0)
+                {
+                    allocate_random_clusters(pixels, pixel_count, filter->cluster_colors, cluster_count);
+                }
+                else
+                {
+                    allocate_seeded_clusters(pixels, pixel_count, filter->cluster_colors, cluster_count, restart_index);
+                }
+            }
+            record_trace_event("seed", 0, seed_begin_time);
+            
+            char *initial_work_ptr = (char *)align_to((size_t)works, 128);
+            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+            {
+                KmeansFilterWork *work = (KmeansFilterWork *)(initial_work_ptr + thread_index*work_stride);
+                clear_memory(work, sizeof(*work));
+                work->filters = filters;
+                work->filter_count = restart_count;
+                work->thread_index = thread_index;
+            }
+            
+            int running_count = restart_count;
+            int candidate_count = restart_count;
+            int next_prune_iteration = KMEANS_RESTART_PRUNE_ITERATION;
+            int iteration = 0;
+            while(running_count > 0 && iteration++ < max_iteration)
+            {
+                unsigned long long iteration_begin_time = get_trace_time();
+                for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+                {
+                    if(filters[restart_index].running)
+                    {
+                        begin_kmeans_iteration(filters + restart_index, iteration, options->full_update_period);
+                    }
+                }
+                run_thread_works(queue, thread_count, do_kmeans_filter_work, initial_work_ptr, work_stride);
+                
+                PerfCounters update_begin_counters;
+                read_perf_counters(&update_begin_counters);
+                unsigned long long reduce_begin_time = get_trace_time();
+                int classified_count = running_count;
+                for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+                {
+                    KmeansFilter *filter = filters + restart_index;
+                    if(filter->running) filter->total_migration_count = end_kmeans_iteration(filter);
+                }
+                record_trace_event("reduce", iteration, reduce_begin_time);
+                
+                unsigned long long convergence_begin_time = get_trace_time();
+                for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+                {
+                    KmeansFilter *filter = filters + restart_index;
+                    if(filter->running && has_kmeans_converged(filter, options))
+                    {
+                        filter->running = 0;
+                        filter->used_iteration = iteration;
+                        --running_count;
+                    }
+                }
+                record_trace_event("convergence", iteration, convergence_begin_time);
+                
+                if(candidate_count > 1 && iteration == next_prune_iteration)
+                {
+                    unsigned long long prune_begin_time = get_trace_time();
+                    candidate_count = prune_kmeans_restarts(filters, restart_count);
+                    running_count = 0;
+                    for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+                    {
+                        if(filters[restart_index].running) ++running_count;
+                    }
+                    next_prune_iteration *= 2;
+                    record_trace_event("prune", iteration, prune_begin_time);
+                }
+                record_trace_event("iteration", iteration, iteration_begin_time);
+                
+                if(options->report_perf_counters && global_perf_counter_mask)
+                {
+                    PerfCounters update_end_counters;
+                    read_perf_counters(&update_end_counters);
+                    PerfCounters update_counters = {0};
+                    accumulate_perf_counters(&update_counters, &update_begin_counters, &update_end_counters);
+                    
+                    PerfCounters classify_counters = {0};
+                    for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+                    {
+                        KmeansFilterWork *work = (KmeansFilterWork *)(initial_work_ptr + thread_index*work_stride);
+                        PerfCounters zero = {0};
+                        accumulate_perf_counters(&classify_counters, &zero, &work->out_perf_counters);
+                    }
+                    print_perf_counter_iteration(iteration, &classify_counters, &update_counters, 
+                                                 classified_count * pixel_count);
+                }
+            }
+            
+            if(iteration > max_iteration) iteration = max_iteration;
+            for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+            {
+                KmeansFilter *filter = filters + restart_index;
+                if(filter->running)
+                {
+                    filter->running = 0;
+                    filter->used_iteration = iteration;
+                }
+            }
+            
+            int best_restart = 0;
+            while(!filters[best_restart].candidate) ++best_restart;
+            for(int restart_index = 0; restart_index < restart_count; ++restart_index)
+            {
+                if(filters[restart_index].candidate && filters[restart_index].sse < filters[best_restart].sse)
+                {
+                    best_restart = restart_index;
+                }
+            }
+            
+            KmeansFilter *best_filter = filters + best_restart;
+            reset_kmeans_tile_ranges(best_filter);
+            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+            {
+                KmeansFilterWork *work = (KmeansFilterWork *)(initial_work_ptr + thread_index*work_stride);
+                work->filters = best_filter;
+                work->filter_count = 1;
+            }
+            run_thread_works(queue, thread_count, do_fill_image_work, initial_work_ptr, work_stride);
+            out_result->used_iteration = best_filter->used_iteration;
+            out_result->best_restart = best_restart;
+            out_result->sse = best_filter->sse;
+            if(out_cluster_colors)
+            {
+                copy_memory(out_cluster_colors, best_filter->cluster_colors, cluster_count * sizeof(Color4));
+            }
+        }
+        end_temporary_memory(temporary);
+    }
+    else
+    {
+        for(int i = 0; i < pixel_count; ++i)
+        {
+            output[i] = pixels[i];
+        }
+    }
+}
+
+// NOTE: 2x2 box filter, the last row and column are repeated for odd sizes
+static void
+do_downsample_work(void *param)
+{
+    DownsampleWork *work = (DownsampleWork *)param;
+    for(int y = work->first_row; y < work->first_row + work->row_count; ++y)
+    {
+        int y0 = y*2;
+        int y1 = (y0 + 1 < work->source_height) ? y0 + 1 : y0;
+        for(int x = 0; x < work->dest_width; ++x)
+        {
+            int x0 = x*2;
+            int x1 = (x0 + 1 < work->source_width) ? x0 + 1 : x0;
+            Color4 a = work->source[y0*work->source_width + x0];
+            Color4 b = work->source[y0*work->source_width + x1];
+            Color4 c = work->source[y1*work->source_width + x0];
+            Color4 d = work->source[y1*work->source_width + x1];
+            Color4 *dest = work->dest + y*work->dest_width + x;
+            dest->r = (unsigned char)((a.r + b.r + c.r + d.r + 2) / 4);
+            dest->g = (unsigned char)((a.g + b.g + c.g + d.g + 2) / 4);
+            dest->b = (unsigned char)((a.b + b.b + c.b + d.b + 2) / 4);
+            dest->a = (unsigned char)((a.a + b.a + c.a + d.a + 2) / 4);
+        }
+    }
+}
+
+static void
+downsample_bitmap(Color4 *dest, Color4 *source, int source_width, int source_height, 
+                  WorkQueue *queue, int thread_count)
+{
+    DownsampleWork works[MAX_NUMA_CPU_COUNT];
+    int dest_width = (source_width + 1) / 2;
+    int dest_height = (source_height + 1) / 2;
+    int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+    int rows_per_work = (dest_height + work_count - 1) / work_count;
+    for(int work_index = 0; work_index < work_count; ++work_index)
+    {
+        DownsampleWork *work = works + work_index;
+        work->source = source;
+        work->source_width = source_width;
+        work->source_height = source_height;
+        work->dest = dest;
+        work->dest_width = dest_width;
+        work->dest_height = dest_height;
+        work->first_row = work_index * rows_per_work;
+        if(work->first_row > dest_height) work->first_row = dest_height;
+        work->row_count = dest_height - work->first_row;
+        if(work->row_count > rows_per_work) work->row_count = rows_per_work;
+    }
+    run_thread_works(queue, work_count, do_downsample_work, (char *)works, sizeof(DownsampleWork));
+}
+
+// NOTE: converges on the coarsest of level_count box filtered levels, then every finer level
+// starts from the clusters of the one below it, capped at level_iterations[level] iterations
+// (coarsest first). Restarts and bisecting only apply to the coarsest level. Levels stop
+// halving before they get smaller than the cluster count.
+static void 
+filter_bitmap_with_pyramid_kmean(Color4 *output, Color4 *pixels, int width, int height, KmeansOptions *options, 
+                                 int level_count, int *level_iterations, 
+                                 MemoryArena *arena, WorkQueue *queue, int thread_count, KmeansResult *out_result)
+{
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    Color4 *level_pixels[PYRAMID_MAX_LEVEL_COUNT];
+    int level_widths[PYRAMID_MAX_LEVEL_COUNT];
+    int level_heights[PYRAMID_MAX_LEVEL_COUNT];
+    int cluster_count = options->cluster_count;
+    if(level_count > PYRAMID_MAX_LEVEL_COUNT) level_count = PYRAMID_MAX_LEVEL_COUNT;
+    
+    // NOTE: level 0 is the full image here, level_iterations counts from the other end
+    unsigned long long pyramid_begin_time = get_trace_time();
+    level_pixels[0] = pixels;
+    level_widths[0] = width;
+    level_heights[0] = height;
+    int built_count = 1;
+    while(built_count < level_count)
+    {
+        int source_width = level_widths[built_count - 1];
+        int source_height = level_heights[built_count - 1];
+        int dest_width = (source_width + 1) / 2;
+        int dest_height = (source_height + 1) / 2;
+        if((dest_width == source_width && dest_height == source_height) || dest_width*dest_height < cluster_count) break;
+        
+        Color4 *dest = push_array(arena, dest_width * dest_height, Color4);
+        if(!dest) break;
+        downsample_bitmap(dest, level_pixels[built_count - 1], source_width, source_height, queue, thread_count);
+        level_pixels[built_count] = dest;
+        level_widths[built_count] = dest_width;
+        level_heights[built_count] = dest_height;
+        ++built_count;
+    }
+    record_trace_event("pyramid", 0, pyramid_begin_time);
+    
+    Color4 *level_output = (built_count > 1) ? push_array(arena, level_widths[1] * level_heights[1], Color4) : 0;
+    Color4 *cluster_colors = push_array(arena, cluster_count, Color4);
+    if(level_output && cluster_colors)
+    {
+        int coarse_iteration = 0;
+        for(int level = built_count - 1; level >= 0; --level)
+        {
+            KmeansOptions level_options = *options;
+            int cap_index = built_count - 1 - level;
+            level_options.max_iteration = level_iterations[cap_index];
+            if(level != built_count - 1)
+            {
+                level_options.restart_count = 1;
+                level_options.use_bisecting = 0;
+                level_options.initial_cluster_colors = cluster_colors;
+            }
+            KmeansResult level_result;
+            filter_bitmap_with_kmean(level ? level_output : output, level_pixels[level], 
+                                     level_widths[level], level_heights[level], &level_options, 
+                                     arena, queue, thread_count, &level_result, cluster_colors);
+            if(level)
+            {
+                coarse_iteration += level_result.used_iteration;
+            }
+            else
+            {
+                *out_result = level_result;
+                out_result->coarse_iteration = coarse_iteration;
+            }
+        }
+    }
+    else
+    {
+        filter_bitmap_with_kmean(output, pixels, width, height, options, arena, queue, thread_count, out_result, 0);
+    }
+    end_temporary_memory(temporary);
+}
+
+// NOTE: every tile gives the same share of its pixels, taken at a fixed stride from a random
+// offset per tile so that the samples don't line up in columns. Returns the number of samples.
+static int
+sample_pixels_by_tile(Color4 *pixels, int pixel_count, int stride, Color4 *out_samples)
+{
+    int result = 0;
+    unsigned int state = 0x9e3779b9u;
+    for(int first_pixel = 0; first_pixel < pixel_count; first_pixel += KMEANS_TILE_PIXEL_COUNT)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int end_pixel = first_pixel + KMEANS_TILE_PIXEL_COUNT;
+        if(end_pixel > pixel_count) end_pixel = pixel_count;
+        for(int i = first_pixel + (int)(state % stride); i < end_pixel; i += stride)
+        {
+            out_samples[result++] = pixels[i];
+        }
+    }
+    return result;
+}
+
+// NOTE: runs the iterations on sample_fraction of the pixels, then classifies every pixel once
+// against the clusters found on the samples and fills the output from that pass. Falls back to
+// the full image when the samples can't hold the clusters.
+static void 
+filter_bitmap_with_sampled_kmean(Color4 *output, Color4 *pixels, int width, int height, KmeansOptions *options, 
+                                 MemoryArena *arena, WorkQueue *queue, int thread_count, KmeansResult *out_result)
+{
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    int pixel_count = width * height;
+    int cluster_count = options->cluster_count;
+    int stride = (int)(1.0f / options->sample_fraction + 0.5f);
+    if(stride < 1) stride = 1;
+    // NOTE: every tile starts at its own random offset, so each can take up to one sample more than
+    // its share and only the per tile maximum bounds the total
+    int tile_count = (pixel_count + KMEANS_TILE_PIXEL_COUNT - 1) / KMEANS_TILE_PIXEL_COUNT;
+    int max_sample_count = tile_count * ((KMEANS_TILE_PIXEL_COUNT + stride - 1) / stride);
+    Color4 *samples = push_array(arena, max_sample_count, Color4);
+    Color4 *sample_output = push_array(arena, max_sample_count, Color4);
+    Color4 *cluster_colors = push_array(arena, cluster_count, Color4);
+    int sample_count = 0;
+    if(samples && sample_output && cluster_colors)
+    {
+        unsigned long long sample_begin_time = get_trace_time();
+        sample_count = sample_pixels_by_tile(pixels, pixel_count, stride, samples);
+        record_trace_event("sample", 0, sample_begin_time);
+    }
+    
+    if(sample_count >= cluster_count && cluster_count <= pixel_count)
+    {
+        KmeansOptions sample_options = *options;
+        sample_options.sample_fraction = 0;
+        KmeansResult sample_result;
+        filter_bitmap_with_kmean(sample_output, samples, sample_count, 1, &sample_options, 
+                                 arena, queue, thread_count, &sample_result, cluster_colors);
+        
+        KmeansOptions final_options = *options;
+        final_options.max_iteration = 1;
+        final_options.full_update_period = 0;
+        final_options.use_active_set = 0;
+        final_options.restart_count = 1;
+        final_options.use_bisecting = 0;
+        final_options.sample_fraction = 0;
+        final_options.initial_cluster_colors = cluster_colors;
+        final_options.report_perf_counters = 0;
+        filter_bitmap_with_kmean(output, pixels, width, height, &final_options, arena, queue, thread_count, out_result, 0);
+        out_result->used_iteration = sample_result.used_iteration;
+        out_result->best_restart = sample_result.best_restart;
+    }
+    else
+    {
+        filter_bitmap_with_kmean(output, pixels, width, height, options, arena, queue, thread_count, out_result, 0);
+    }
+    end_temporary_memory(temporary);
+}
+// NOTE: moves bit i of an 8 bit value to bit 3*i
+static unsigned int
+spread_morton_bits(unsigned int value)
+{
+    value = (value | (value << 8)) & 0x0000f00f;
+    value = (value | (value << 4)) & 0x000c30c3;
+    value = (value | (value << 2)) & 0x00249249;
+    return value;
+}
+
+// NOTE: interleaves the bits of the channels from the top, r above g above b, so colors that
+// are close share a long prefix and end up close in the sorted order
+static unsigned int
+get_morton_code(Color4 color)
+{
+    return (spread_morton_bits(color.r) << 2) | (spread_morton_bits(color.g) << 1) | spread_morton_bits(color.b);
+}
+
+static void
+do_radix_histogram_work(void *param)
+{
+    RadixSortWork *work = (RadixSortWork *)param;
+    clear_memory(work->bucket_offsets, sizeof(work->bucket_offsets));
+    for(int i = work->first; i < work->first + work->count; ++i)
+    {
+        if(work->key_pixels)
+        {
+            work->keys[i] = get_morton_code(work->key_pixels[i]);
+            work->indices[i] = i;
+        }
+        ++work->bucket_offsets[(work->keys[i] >> work->shift) & (MORTON_RADIX_BUCKET_COUNT - 1)];
+    }
+}
+
+// NOTE: every slice writes its pixels in order after the ones of the slices before it, so the
+// pass is stable
+static void
+do_radix_scatter_work(void *param)
+{
+    RadixSortWork *work = (RadixSortWork *)param;
+    for(int i = work->first; i < work->first + work->count; ++i)
+    {
+        unsigned int key = work->keys[i];
+        int dest = work->bucket_offsets[(key >> work->shift) & (MORTON_RADIX_BUCKET_COUNT - 1)]++;
+        work->out_keys[dest] = key;
+        work->out_indices[dest] = work->indices[i];
+        if(work->out_pixels) work->out_pixels[dest] = work->pixels[work->indices[i]];
+    }
+}
+
+// NOTE: least significant digit first radix sort of the Morton codes, every pass counts the
+// digits of a slice per thread and then scatters the slices in parallel. out_order[i] is the
+// index of the pixel that lands at i. The passes alternate between two buffers and the pass
+// count is odd, so out_order is the second buffer and the last pass writes straight into it.
+static int
+sort_pixels_by_morton_code(Color4 *pixels, int pixel_count, Color4 *out_pixels, int *out_order,
+                           MemoryArena *arena, WorkQueue *queue, int thread_count)
+{
+    int result = 0;
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+    size_t work_stride = align_to(sizeof(RadixSortWork), 128);
+    char *works = (char *)push_size(arena, work_count*work_stride);
+    unsigned int *keys[2];
+    int *indices[2];
+    keys[0] = push_array(arena, pixel_count, unsigned int);
+    keys[1] = push_array(arena, pixel_count, unsigned int);
+    indices[0] = push_array(arena, pixel_count, int);
+    indices[1] = out_order;
+    if(works && keys[0] && keys[1] && indices[0])
+    {
+        unsigned long long sort_begin_time = get_trace_time();
+        int pixels_per_work = (pixel_count + work_count - 1) / work_count;
+        for(int pass = 0; pass < MORTON_RADIX_PASS_COUNT; ++pass)
+        {
+            int source = pass & 1;
+            for(int work_index = 0; work_index < work_count; ++work_index)
+            {
+                RadixSortWork *work = (RadixSortWork *)(works + work_index*work_stride);
+                work->key_pixels = pass ? 0 : pixels;
+                work->pixels = pixels;
+                work->out_pixels = (pass == MORTON_RADIX_PASS_COUNT - 1) ? out_pixels : 0;
+                work->keys = keys[source];
+                work->out_keys = keys[!source];
+                work->indices = indices[source];
+                work->out_indices = indices[!source];
+                work->first = work_index * pixels_per_work;
+                if(work->first > pixel_count) work->first = pixel_count;
+                work->count = pixel_count - work->first;
+                if(work->count > pixels_per_work) work->count = pixels_per_work;
+                work->shift = pass*MORTON_RADIX_BITS;
+            }
+            run_thread_works(queue, work_count, do_radix_histogram_work, works, work_stride);
+            
+            int offset = 0;
+            for(int bucket = 0; bucket < MORTON_RADIX_BUCKET_COUNT; ++bucket)
+            {
+                for(int work_index = 0; work_index < work_count; ++work_index)
+                {
+                    RadixSortWork *work = (RadixSortWork *)(works + work_index*work_stride);
+                    int count = work->bucket_offsets[bucket];
+                    work->bucket_offsets[bucket] = offset;
+                    offset += count;
+                }
+            }
+            
+            run_thread_works(queue, work_count, do_radix_scatter_work, works, work_stride);
+        }
+        record_trace_event("sort", 0, sort_begin_time);
+        result = 1;
+    }
+    end_temporary_memory(temporary);
+    return result;
+}
+
+// NOTE: the reads are sequential and the writes scattered, every slice writes a disjoint set of
+// pixels since pixel_order is a permutation
+static void
+do_unsort_work(void *param)
+{
+    UnsortWork *work = (UnsortWork *)param;
+    for(int i = work->first; i < work->first + work->count; ++i)
+    {
+        work->output[work->pixel_order[i]] = work->sorted_output[i];
+    }
+}
+
+// NOTE: iterates on the pixels sorted by the Morton code of their color, so pixels next to
+// each other have similar colors. The nearest cluster then mostly repeats from one pixel to
+// the next and the sums of a tile only touch a few clusters. The output goes back to the
+// original order once at the end. The first run is still seeded from the unsorted pixels, so
+// it gives the same clusters as without the sort, the other restarts and bisecting seed from
+// the sorted order.
+static void
+filter_bitmap_with_sorted_kmean(Color4 *output, Color4 *pixels, int width, int height, KmeansOptions *options,
+                                MemoryArena *arena, WorkQueue *queue, int thread_count, KmeansResult *out_result)
+{
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    int pixel_count = width * height;
+    int cluster_count = options->cluster_count;
+    Color4 *sorted_pixels = push_array(arena, pixel_count, Color4);
+    Color4 *sorted_output = push_array(arena, pixel_count, Color4);
+    int *pixel_order = push_array(arena, pixel_count, int);
+    Color4 *cluster_colors = push_array(arena, cluster_count, Color4);
+    int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+    size_t work_stride = align_to(sizeof(UnsortWork), 128);
+    char *works = (char *)push_size(arena, work_count*work_stride);
+    if(sorted_pixels && sorted_output && pixel_order && cluster_colors && works &&
+       sort_pixels_by_morton_code(pixels, pixel_count, sorted_pixels, pixel_order, arena, queue, thread_count))
+    {
+        KmeansOptions sorted_options = *options;
+        if(!options->initial_cluster_colors && !options->use_bisecting && cluster_count <= pixel_count)
+        {
+            allocate_random_clusters(pixels, pixel_count, cluster_colors, cluster_count);
+            sorted_options.initial_cluster_colors = cluster_colors;
+        }
+        filter_bitmap_with_kmean(sorted_output, sorted_pixels, pixel_count, 1, &sorted_options,
+                                 arena, queue, thread_count, out_result, 0);
+        
+        unsigned long long unsort_begin_time = get_trace_time();
+        int pixels_per_work = (pixel_count + work_count - 1) / work_count;
+        for(int work_index = 0; work_index < work_count; ++work_index)
+        {
+            UnsortWork *work = (UnsortWork *)(works + work_index*work_stride);
+            work->sorted_output = sorted_output;
+            work->output = output;
+            work->pixel_order = pixel_order;
+            work->first = work_index * pixels_per_work;
+            if(work->first > pixel_count) work->first = pixel_count;
+            work->count = pixel_count - work->first;
+            if(work->count > pixels_per_work) work->count = pixels_per_work;
+        }
+        run_thread_works(queue, work_count, do_unsort_work, works, work_stride);
+        record_trace_event("unsort", 0, unsort_begin_time);
+    }
+    else
+    {
+        filter_bitmap_with_kmean(output, pixels, width, height, options, arena, queue, thread_count, out_result, 0);
+    }
+    end_temporary_memory(temporary);
+}
+
+
+// NOTE: GIMP palette text, the header lines are optional on input so a plain list of
+// "r g b" lines loads too
+static int
+load_palette(char *path, Color4 *out_colors, int max_color_count)
+{
+    int result = -1;
+    FILE *file = fopen(path, "rb");
+    if(file)
+    {
+        result = 0;
+        char line[256];
+        while(fgets(line, sizeof(line), file))
+        {
+            int r, g, b;
+            if(sscanf(line, " %d %d %d", &r, &g, &b) == 3 && result < max_color_count &&
+               r >= 0 && r <= 255 && g >= 0 && g <= 255 && b >= 0 && b <= 255)
+            {
+                out_colors[result].r = (unsigned char)r;
+                out_colors[result].g = (unsigned char)g;
+                out_colors[result].b = (unsigned char)b;
+                out_colors[result].a = 255;
+                ++result;
+            }
+        }
+        fclose(file);
+    }
+    return result;
+}
+
+static int
+write_palette(char *path, Color4 *colors, int color_count)
+{
+    int result = 0;
+    FILE *file = fopen(path, "wb");
+    if(file)
+    {
+        fprintf(file, "GIMP Palette\nName: kmeans\nColumns: 0\n#\n");
+        for(int i = 0; i < color_count; ++i)
+        {
+            fprintf(file, "%3d %3d %3d\tcluster %d\n", colors[i].r, colors[i].g, colors[i].b, i);
+        }
+        result = (fclose(file) == 0);
+    }
+    return result;
+}
+
+// NOTE: the distinct colors of the output in rgb order, these are the clusters of whichever
+// engine ran (minus the empty ones). Transparent pixels that passed through don't count.
+static int
+collect_output_palette(Color4 *output, Color4 *pixels, int pixel_count, int keep_alpha,
+                       Color4 *out_colors, int max_color_count, MemoryArena *arena)
+{
+    int result = 0;
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    unsigned int *seen = push_array(arena, (1 << 24) / 32, unsigned int);
+    if(seen)
+    {
+        clear_memory(seen, (1 << 24) / 8);
+        for(int i = 0; i < pixel_count; ++i)
+        {
+            if(keep_alpha && pixels[i].a == 0) continue;
+            unsigned int rgb = (output[i].r << 16) | (output[i].g << 8) | output[i].b;
+            seen[rgb >> 5] |= 1u << (rgb & 31);
+        }
+        for(unsigned int rgb = 0; rgb < (1 << 24) && result < max_color_count; ++rgb)
+        {
+            if(seen[rgb >> 5] & (1u << (rgb & 31)))
+            {
+                out_colors[result].r = (unsigned char)(rgb >> 16);
+                out_colors[result].g = (unsigned char)(rgb >> 8);
+                out_colors[result].b = (unsigned char)rgb;
+                out_colors[result].a = 255;
+                ++result;
+            }
+        }
+    }
+    end_temporary_memory(temporary);
+    return result;
+}
+
+// NOTE: a color can only be nearest somewhere in the box when its closest approach to the box
+// is no further than the best guaranteed distance, the farthest corner of the best color. Ties
+// are kept so that the lowest label wins exactly like in classify_tile.
+static int
+find_palette_cell_candidates(PaletteLut *lut, int cell, int *out_labels)
+{
+    int low[3], high[3];
+    get_color_grid_cell_box(cell, PALETTE_LUT_CELL_BITS, low, high);
+    int best_max_distance = INT_MAX;
+    for(int i = 0; i < lut->color_count; ++i)
+    {
+        int max_distance = get_color_box_max_distance(lut->colors[i], low, high);
+        if(max_distance < best_max_distance) best_max_distance = max_distance;
+    }
+
+    int result = 0;
+    for(int i = 0; i < lut->color_count; ++i)
+    {
+        if(get_color_box_min_distance(lut->colors[i], low, high) <= best_max_distance)
+        {
+            if(out_labels) out_labels[result] = i;
+            ++result;
+        }
+    }
+    return result;
+}
+
+static void
+do_palette_lut_work(void *param)
+{
+    PaletteLutWork *work = (PaletteLutWork *)param;
+    PaletteLut *lut = work->lut;
+    unsigned long long begin_time = get_trace_time();
+    for(int cell = work->first_cell; cell < work->first_cell + work->cell_count; ++cell)
+    {
+        if(!work->fill_candidates)
+        {
+            lut->cell_candidate_counts[cell] = find_palette_cell_candidates(lut, cell, 0);
+        }
+        else if(lut->cell_candidate_counts[cell] > 1)
+        {
+            int *candidates = lut->candidates + (lut->cell_entries[cell] & ~PALETTE_LUT_AMBIGUOUS);
+            candidates[0] = find_palette_cell_candidates(lut, cell, candidates + 1);
+        }
+        else
+        {
+            int label;
+            find_palette_cell_candidates(lut, cell, &label);
+            lut->cell_entries[cell] = (unsigned int)label;
+        }
+    }
+    record_trace_event(work->fill_candidates ? "lut fill" : "lut count", 0, begin_time);
+}
+
+static void
+run_palette_lut_works(PaletteLut *lut, int fill_candidates, WorkQueue *queue, int thread_count)
+{
+    PaletteLutWork works[MAX_NUMA_CPU_COUNT];
+    int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+    int cells_per_work = (PALETTE_LUT_CELL_COUNT + work_count - 1) / work_count;
+    for(int work_index = 0; work_index < work_count; ++work_index)
+    {
+        PaletteLutWork *work = works + work_index;
+        work->lut = lut;
+        work->fill_candidates = fill_candidates;
+        work->first_cell = work_index * cells_per_work;
+        if(work->first_cell > PALETTE_LUT_CELL_COUNT) work->first_cell = PALETTE_LUT_CELL_COUNT;
+        work->cell_count = PALETTE_LUT_CELL_COUNT - work->first_cell;
+        if(work->cell_count > cells_per_work) work->cell_count = cells_per_work;
+    }
+    run_thread_works(queue, work_count, do_palette_lut_work, (char *)works, sizeof(PaletteLutWork));
+}
+
+// NOTE: two passes over the cells on the pool, the first counts the candidates so that the
+// ambiguous cells can be laid out back to back before the second one writes them. The tables
+// are pushed on the arena.
+static int
+build_palette_lut(PaletteLut *lut, Color4 *colors, int color_count, MemoryArena *arena, WorkQueue *queue, int thread_count)
+{
+    int result = 0;
+    clear_memory(lut, sizeof(*lut));
+    lut->colors = colors;
+    lut->color_count = color_count;
+    lut->cell_entries = push_array(arena, PALETTE_LUT_CELL_COUNT, unsigned int);
+    lut->cell_candidate_counts = push_array(arena, PALETTE_LUT_CELL_COUNT, int);
+    if(color_count > 0 && lut->cell_entries && lut->cell_candidate_counts)
+    {
+        run_palette_lut_works(lut, 0, queue, thread_count);
+        for(int cell = 0; cell < PALETTE_LUT_CELL_COUNT; ++cell)
+        {
+            if(lut->cell_candidate_counts[cell] > 1)
+            {
+                lut->cell_entries[cell] = PALETTE_LUT_AMBIGUOUS | (unsigned int)lut->candidate_size;
+                lut->candidate_size += 1 + lut->cell_candidate_counts[cell];
+            }
+        }
+        lut->candidates = push_array(arena, lut->candidate_size + 1, int);
+        if(lut->candidates)
+        {
+            run_palette_lut_works(lut, 1, queue, thread_count);
+            result = 1;
+        }
+    }
+    return result;
+}
+
+static int
+find_palette_label(PaletteLut *lut, Color4 pixel, int *out_distance)
+{
+    unsigned int entry = lut->cell_entries[get_color_grid_cell(pixel, PALETTE_LUT_CELL_BITS)];
+    int label = (int)entry;
+    int min_distance;
+    if(entry & PALETTE_LUT_AMBIGUOUS)
+    {
+        int *candidates = lut->candidates + (entry & ~PALETTE_LUT_AMBIGUOUS);
+        label = candidates[1];
+        min_distance = get_color_distance_squared(pixel, lut->colors[label]);
+        for(int i = 2; i <= candidates[0]; ++i)
+        {
+            int distance = get_color_distance_squared(pixel, lut->colors[candidates[i]]);
+            if(distance < min_distance)
+            {
+                label = candidates[i];
+                min_distance = distance;
+            }
+        }
+    }
+    else
+    {
+        min_distance = get_color_distance_squared(pixel, lut->colors[label]);
+    }
+    *out_distance = min_distance;
+    return label;
+}
+
+static void
+do_palette_apply_work(void *param)
+{
+    PaletteApplyWork *work = (PaletteApplyWork *)param;
+    PaletteLut *lut = work->lut;
+    unsigned long long begin_time = get_trace_time();
+    unsigned long long sse = 0;
+    for(int pixel_index = work->first_pixel; pixel_index < work->first_pixel + work->pixel_count; ++pixel_index)
+    {
+        Color4 pixel = work->pixels[pixel_index];
+        if(work->keep_alpha && pixel.a == 0)
+        {
+            work->output[pixel_index] = pixel;
+            continue;
+        }
+
+        int min_distance;
+        int label = find_palette_label(lut, pixel, &min_distance);
+        Color4 color = lut->colors[label];
+        color.a = pixel.a;
+        work->output[pixel_index] = color;
+        sse += (unsigned long long)min_distance;
+    }
+    work->sse = sse;
+    record_trace_event("lut apply", 0, begin_time);
+}
+
+// NOTE: classifies every pixel once against a fixed palette, no iterations. The lookup replaces
+// the O(K) scan with one table read for every pixel outside the few cells near a boundary.
+static int
+filter_bitmap_with_palette(Color4 *output, Color4 *pixels, int pixel_count, int keep_alpha,
+                           Color4 *colors, int color_count, MemoryArena *arena, WorkQueue *queue, int thread_count,
+                           KmeansResult *out_result)
+{
+    int result = 0;
+    clear_memory(out_result, sizeof(*out_result));
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    PaletteLut lut;
+    unsigned long long lut_begin_time = get_trace_time();
+    if(build_palette_lut(&lut, colors, color_count, arena, queue, thread_count))
+    {
+        record_trace_event("lut build", 0, lut_begin_time);
+        PaletteApplyWork works[MAX_NUMA_CPU_COUNT];
+        int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+        int pixels_per_work = (pixel_count + work_count - 1) / work_count;
+        for(int work_index = 0; work_index < work_count; ++work_index)
+        {
+            PaletteApplyWork *work = works + work_index;
+            work->lut = &lut;
+            work->pixels = pixels;
+            work->output = output;
+            work->keep_alpha = keep_alpha;
+            work->sse = 0;
+            work->first_pixel = work_index * pixels_per_work;
+            if(work->first_pixel > pixel_count) work->first_pixel = pixel_count;
+            work->pixel_count = pixel_count - work->first_pixel;
+            if(work->pixel_count > pixels_per_work) work->pixel_count = pixels_per_work;
+        }
+        run_thread_works(queue, work_count, do_palette_apply_work, (char *)works, sizeof(PaletteApplyWork));
+        for(int work_index = 0; work_index < work_count; ++work_index)
+        {
+            out_result->sse += works[work_index].sse;
+        }
+        result = 1;
+    }
+    end_temporary_memory(temporary);
+    return result;
+}
+
+// NOTE: weights are in 1/16 for Floyd-Steinberg and in 1/8 for Atkinson, which only passes on
+// 3/4 of the error and so keeps flat highlights and shadows clean
+static DitherTap floyd_steinberg_taps[] = {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}};
+static DitherTap atkinson_taps[] = {{1, 0, 1}, {2, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}, {0, 2, 1}};
+
+static unsigned char bayer_matrix[8][8] =
+{
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static int
+parse_dither_mode(DitherMode *mode, char *text)
+{
+    int result = 1;
+    if(string_equal(text, "none")) *mode = DitherMode_none;
+    else if(string_equal(text, "floyd-steinberg") || string_equal(text, "fs")) *mode = DitherMode_floyd_steinberg;
+    else if(string_equal(text, "atkinson")) *mode = DitherMode_atkinson;
+    else if(string_equal(text, "bayer")) *mode = DitherMode_bayer;
+    else result = 0;
+    return result;
+}
+
+static char *
+get_dither_mode_name(DitherMode mode)
+{
+    char *result = "none";
+    if(mode == DitherMode_floyd_steinberg) result = "floyd-steinberg";
+    else if(mode == DitherMode_atkinson) result = "atkinson";
+    else if(mode == DitherMode_bayer) result = "bayer";
+    return result;
+}
+
+static int
+clamp_to_byte(int value)
+{
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+// NOTE: the ordered dither amplitude, the mean distance from a palette color to its nearest
+// other color, so that the threshold pattern spans about one step of the palette
+static int
+get_bayer_spread(Color4 *colors, int color_count)
+{
+    int sample_count = (color_count < DITHER_NEIGHBOUR_SAMPLE_COUNT) ? color_count : DITHER_NEIGHBOUR_SAMPLE_COUNT;
+    double distance_sum = 0.0;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        int min_distance = INT_MAX;
+        for(int j = 0; j < color_count; ++j)
+        {
+            int distance = get_color_distance_squared(colors[i], colors[j]);
+            if(j != i && distance < min_distance) min_distance = distance;
+        }
+        if(min_distance != INT_MAX) distance_sum += sqrt((double)min_distance);
+    }
+    return (color_count > 1) ? (int)(distance_sum / sample_count + 0.5) : 0;
+}
+
+static Color4
+dither_pixel(DitherState *state, Color4 pixel, int r, int g, int b)
+{
+    Color4 adjusted;
+    adjusted.r = (unsigned char)clamp_to_byte(r);
+    adjusted.g = (unsigned char)clamp_to_byte(g);
+    adjusted.b = (unsigned char)clamp_to_byte(b);
+    adjusted.a = pixel.a;
+    int distance;
+    Color4 result = state->lut->colors[find_palette_label(state->lut, adjusted, &distance)];
+    result.a = pixel.a;
+    return result;
+}
+
+static void
+dither_bayer_row(DitherState *state, int y)
+{
+    Color4 *pixels = state->pixels + (size_t)(state->height - 1 - y)*state->width;
+    Color4 *output = state->output + (size_t)(state->height - 1 - y)*state->width;
+    unsigned char *thresholds = bayer_matrix[y & 7];
+    for(int x = 0; x < state->width; ++x)
+    {
+        Color4 pixel = pixels[x];
+        if(state->keep_alpha && pixel.a == 0)
+        {
+            output[x] = pixel;
+            continue;
+        }
+        int offset = ((2*thresholds[x & 7] + 1 - 64) * state->bayer_spread) / 128;
+        output[x] = dither_pixel(state, pixel, pixel.r + offset, pixel.g + offset, pixel.b + offset);
+    }
+}
+
+// NOTE: errors to the right stay in carry, errors to the rows below go to the ring. Each error
+// slot is cleared as soon as it has been read, so the ring never needs a separate clear. Rows
+// are counted from the top of the image, the bitmaps are stored bottom up.
+static void
+dither_diffusion_row(DitherState *state, int y)
+{
+    int width = state->width;
+    Color4 *pixels = state->pixels + (size_t)(state->height - 1 - y)*width;
+    Color4 *output = state->output + (size_t)(state->height - 1 - y)*width;
+    int *error_rows[3];
+    for(int i = 0; i < 3; ++i)
+    {
+        error_rows[i] = state->row_errors + ((y + i) % state->error_row_count)*state->error_row_stride + 2*3;
+    }
+
+    int carry[3][3];
+    clear_memory(carry, sizeof(carry));
+    int half = 1 << (state->weight_shift - 1);
+    for(int block_x = 0; block_x < width; block_x += DITHER_BLOCK_PIXEL_COUNT)
+    {
+        int block_end = block_x + DITHER_BLOCK_PIXEL_COUNT;
+        if(block_end > width) block_end = width;
+        if(y > 0)
+        {
+            int needed = (block_end + 1 < width) ? block_end + 1 : width;
+            for(int spin_count = 0; state->row_progress[(y - 1)*DITHER_PROGRESS_STRIDE] < needed; ++spin_count)
+            {
+                if(spin_count >= DITHER_SPIN_COUNT) yield_thread();
+            }
+            MEMORY_BARRIER;
+        }
+
+        for(int x = block_x; x < block_end; ++x)
+        {
+            int *error = error_rows[0] + 3*x;
+            int incoming[3];
+            for(int c = 0; c < 3; ++c)
+            {
+                incoming[c] = error[c] + carry[0][c];
+                error[c] = 0;
+                carry[0][c] = carry[1][c];
+                carry[1][c] = carry[2][c];
+                carry[2][c] = 0;
+            }
+
+            Color4 pixel = pixels[x];
+            if(state->keep_alpha && pixel.a == 0)
+            {
+                output[x] = pixel;
+                continue;
+            }
+            int r = pixel.r + ((incoming[0] + half) >> state->weight_shift);
+            int g = pixel.g + ((incoming[1] + half) >> state->weight_shift);
+            int b = pixel.b + ((incoming[2] + half) >> state->weight_shift);
+            Color4 color = dither_pixel(state, pixel, r, g, b);
+            output[x] = color;
+
+            int residual[3];
+            residual[0] = clamp_to_byte(r) - color.r;
+            residual[1] = clamp_to_byte(g) - color.g;
+            residual[2] = clamp_to_byte(b) - color.b;
+            for(int tap_index = 0; tap_index < state->tap_count; ++tap_index)
+            {
+                DitherTap *tap = state->taps + tap_index;
+                int *target = tap->y ? error_rows[tap->y] + 3*(x + tap->x) : carry[tap->x - 1];
+                for(int c = 0; c < 3; ++c) target[c] += residual[c] * tap->weight;
+            }
+        }
+
+        MEMORY_BARRIER;
+        state->row_progress[y*DITHER_PROGRESS_STRIDE] = block_end;
+    }
+}
+
+static void
+do_dither_work(void *param)
+{
+    DitherWork *work = (DitherWork *)param;
+    DitherState *state = work->state;
+    unsigned long long begin_time = get_trace_time();
+    for(;;)
+    {
+        int y = atomic_add(&state->next_row, 1);
+        if(y >= state->height) break;
+        if(state->mode == DitherMode_bayer) dither_bayer_row(state, y);
+        else dither_diffusion_row(state, y);
+    }
+    record_trace_event("dither", 0, begin_time);
+}
+
+// NOTE: redraws the output from the input pixels with the colors of a palette, the nearest color
+// search goes through the palette lookup table. Transparent pixels with keep_alpha pass through
+// and neither take nor pass on error.
+static int
+dither_bitmap_with_palette(Color4 *output, Color4 *pixels, int width, int height, int keep_alpha, DitherMode mode,
+                           Color4 *colors, int color_count, MemoryArena *arena, WorkQueue *queue, int thread_count)
+{
+    int result = 0;
+    TemporaryMemory temporary = begin_temporary_memory(arena);
+    PaletteLut lut;
+    unsigned long long lut_begin_time = get_trace_time();
+    if(build_palette_lut(&lut, colors, color_count, arena, queue, thread_count))
+    {
+        record_trace_event("lut build", 0, lut_begin_time);
+        DitherWork works[MAX_NUMA_CPU_COUNT];
+        int work_count = (thread_count < MAX_NUMA_CPU_COUNT) ? thread_count : MAX_NUMA_CPU_COUNT;
+
+        // NOTE: rows write errors up to two rows ahead. With at most work_count rows running, the
+        // furthest row written is work_count + 1 rows after the oldest running one, so a ring of
+        // work_count + 2 rows is never written before it has been read
+        DitherState state;
+        clear_memory(&state, sizeof(state));
+        state.lut = &lut;
+        state.pixels = pixels;
+        state.output = output;
+        state.width = width;
+        state.height = height;
+        state.keep_alpha = keep_alpha;
+        state.mode = mode;
+        state.taps = (mode == DitherMode_atkinson) ? atkinson_taps : floyd_steinberg_taps;
+        state.tap_count = (mode == DitherMode_atkinson) ? (int)(sizeof(atkinson_taps) / sizeof(DitherTap)) :
+                                                          (int)(sizeof(floyd_steinberg_taps) / sizeof(DitherTap));
+        state.weight_shift = (mode == DitherMode_atkinson) ? 3 : 4;
+        state.bayer_spread = (mode == DitherMode_bayer) ? get_bayer_spread(colors, color_count) : 0;
+        state.error_row_count = work_count + 2;
+        state.error_row_stride = (width + 4)*3;
+        size_t progress_size = align_to((size_t)height*DITHER_PROGRESS_STRIDE*sizeof(int), 128);
+        size_t error_size = (size_t)state.error_row_count*state.error_row_stride*sizeof(int);
+        char *memory = (mode == DitherMode_bayer) ? 0 : (char *)push_size(arena, progress_size + error_size);
+        if(memory || mode == DitherMode_bayer)
+        {
+            if(memory)
+            {
+                clear_memory(memory, progress_size + error_size);
+                state.row_progress = (volatile int *)memory;
+                state.row_errors = (int *)(memory + progress_size);
+            }
+            for(int work_index = 0; work_index < work_count; ++work_index)
+            {
+                works[work_index].state = &state;
+            }
+            run_thread_works(queue, work_count, do_dither_work, (char *)works, sizeof(DitherWork));
+            result = 1;
+        }
+    }
+    end_temporary_memory(temporary);
+    return result;
+}
+
+// NOTE: the float engine for features other than sRGB bytes. Same tiles and schedule as the
+// integer engine, but the tile sums are doubles and are merged on the calling thread in tile
+// order, which keeps the result independent of the thread count.
+static void
+convert_feature_tile(KmeansFilter *filter, int tile_index)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    FeatureSet *features = filter->features;
+    if(filter->wide_pixels)
+    {
+        WideBitmap *wide_pixels = filter->wide_pixels;
+        convert_wide_to_color_space(filter->color_space, wide_pixels->rgb + first_pixel*3, wide_pixels->max_value, 
+                                    pixel_count, 
+                                    features->channels[0] + first_pixel, 
+                                    features->channels[1] + first_pixel, 
+                                    features->channels[2] + first_pixel);
+    }
+    else
+    {
+        Color4 *pixels = filter->pixels + first_pixel;
+        convert_srgb_to_color_space(filter->color_space, &pixels->r, &pixels->g, &pixels->b, sizeof(Color4), pixel_count, 
+                                    features->channels[0] + first_pixel, 
+                                    features->channels[1] + first_pixel, 
+                                    features->channels[2] + first_pixel);
+    }
+    if(features->spatial_scale > 0)
+    {
+        for(int pixel_index = first_pixel; pixel_index < first_pixel + pixel_count; ++pixel_index)
+        {
+            features->channels[3][pixel_index] = (pixel_index % features->width) * features->spatial_scale;
+            features->channels[4][pixel_index] = (pixel_index / features->width) * features->spatial_scale;
+        }
+    }
+}
+
+static void
+fill_wide_tile(KmeansFilter *filter, int tile_index)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    for(int i = first_pixel; i < first_pixel + pixel_count; ++i)
+    {
+        float *cluster_color = filter->wide_cluster_colors + filter->cluster_indices[i]*3;
+        float *output = filter->wide_output->rgb + i*3;
+        output[0] = cluster_color[0];
+        output[1] = cluster_color[1];
+        output[2] = cluster_color[2];
+    }
+}
+
+// NOTE: the first cluster_count distinct colors in scan order, compared on the color channels of
+// the features so that it works for every input, the missing ones point at pixel 0
+static void
+find_unique_feature_pixels(FeatureSet *features, int *out_pixel_indices, int cluster_count)
+{
+    for(int i = 0; i < cluster_count; ++i)
+    {
+        out_pixel_indices[i] = 0;
+    }
+    
+    float *x = features->channels[0];
+    float *y = features->channels[1];
+    float *z = features->channels[2];
+    int unique_color_count = 0;
+    for(int i = 0; i < features->pixel_count; ++i)
+    {
+        int is_unique = 1;
+        for(int j = 0; j < unique_color_count; ++j)
+        {
+            int unique_index = out_pixel_indices[j];
+            if(x[i] == x[unique_index] && y[i] == y[unique_index] && z[i] == z[unique_index])
+            {
+                is_unique = 0;
+                break;
+            }
+        }
+        
+        if(is_unique)
+        {
+            out_pixel_indices[unique_color_count++] = i;
+        }
+        
+        if(unique_color_count == cluster_count) break;
+    }
+}
+
+static double *
+get_tile_feature_sums(KmeansFilter *filter, int tile_index)
+{
+    return filter->tile_feature_sums + tile_index*filter->tile_feature_stride;
+}
+
+// NOTE: FEATURE_LANE_COUNT pixels are classified side by side so that the inner loops run over
+// the lanes of one channel, the channels are padded so the last block can read a full block
+static inline void
+classify_feature_tile_with_dimension(KmeansFilter *filter, int tile_index, int dimension)
+{
+    int first_pixel, pixel_count;
+    get_tile_pixel_range(filter, tile_index, &first_pixel, &pixel_count);
+    FeatureSet *features = filter->features;
+    int cluster_count = filter->cluster_count;
+    float *centroids = filter->feature_centroids;
+    int *cluster_indices = filter->cluster_indices + first_pixel;
+    double *sums = get_tile_feature_sums(filter, tile_index);
+    double *counts = sums + dimension*cluster_count;
+    double *sse = counts + cluster_count;
+    double *migration_count = sse + 1;
+    clear_memory(sums, filter->tile_feature_stride * sizeof(double));
+    
+    for(int block_first = 0; block_first < pixel_count; block_first += FEATURE_LANE_COUNT)
+    {
+        float min_diffs[FEATURE_LANE_COUNT];
+        int min_indices[FEATURE_LANE_COUNT];
+        for(int lane = 0; lane < FEATURE_LANE_COUNT; ++lane)
+        {
+            min_diffs[lane] = FLT_MAX;
+            min_indices[lane] = 0;
+        }
+        for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+        {
+            float diffs[FEATURE_LANE_COUNT] = {0};
+            for(int d = 0; d < dimension; ++d)
+            {
+                float centroid = centroids[d*cluster_count + cluster_index];
+                float *channel = features->channels[d] + first_pixel + block_first;
+                for(int lane = 0; lane < FEATURE_LANE_COUNT; ++lane)
+                {
+                    float diff = channel[lane] - centroid;
+                    diffs[lane] += diff*diff;
+                }
+            }
+            for(int lane = 0; lane < FEATURE_LANE_COUNT; ++lane)
+            {
+                if(diffs[lane] < min_diffs[lane])
+                {
+                    min_diffs[lane] = diffs[lane];
+                    min_indices[lane] = cluster_index;
+                }
+            }
+        }
+        
+        int lane_count = pixel_count - block_first;
+        if(lane_count > FEATURE_LANE_COUNT) lane_count = FEATURE_LANE_COUNT;
+        for(int lane = 0; lane < lane_count; ++lane)
+        {
+            int pixel_index = block_first + lane;
+            int cluster_index = min_indices[lane];
+            if(cluster_indices[pixel_index] != cluster_index)
+            {
+                *migration_count += 1;
+                cluster_indices[pixel_index] = cluster_index;
+            }
+            for(int d = 0; d < dimension; ++d)
+            {
+                sums[d*cluster_count + cluster_index] += features->channels[d][first_pixel + pixel_index];
+            }
+            counts[cluster_index] += 1;
+            *sse += min_diffs[lane];
+        }
+    }
+}
+
+// NOTE: a constant dimension lets the compiler unroll the channel loop and keep the lanes of
+// every channel in registers, the other dimensions go through the generic one
+#define DEFINE_CLASSIFY_FEATURE_TILE(dimension) \
+static void \
+classify_feature_tile_##dimension(KmeansFilter *filter, int tile_index) \
+{ \
+    classify_feature_tile_with_dimension(filter, tile_index, dimension); \
+}
+
+DEFINE_CLASSIFY_FEATURE_TILE(3)
+DEFINE_CLASSIFY_FEATURE_TILE(4)
+DEFINE_CLASSIFY_FEATURE_TILE(5)
+DEFINE_CLASSIFY_FEATURE_TILE(8)
+
+static void
+classify_feature_tile(KmeansFilter *filter, int tile_index)
+{
+    classify_feature_tile_with_dimension(filter, tile_index, filter->features->dimension);
+}
+
+static KmeansTileCallback *
+get_classify_feature_callback(int dimension)
+{
+    KmeansTileCallback *result = classify_feature_tile;
+    switch(dimension)
+    {
+        case 3: result = classify_feature_tile_3; break;
+        case 4: result = classify_feature_tile_4; break;
+        case 5: result = classify_feature_tile_5; break;
+        case 8: result = classify_feature_tile_8; break;
+        default: break;
+    }
+    return result;
+}
+
+static void 
+do_tile_work(void *param)
+{
+    KmeansFilterWork *work = (KmeansFilterWork *)param;
+    unsigned long long begin_time = get_trace_time();
+    int iteration = 0;
+    for(int filter_index = 0; filter_index < work->filter_count; ++filter_index)
+    {
+        KmeansFilter *filter = work->filters + filter_index;
+        claim_tiles(filter, work->thread_index, work->callback);
+        iteration = filter->iteration;
+    }
+    record_trace_event(work->trace_name, iteration, begin_time);
+}
+
+static void
+run_tile_works(KmeansFilter *filter, KmeansTileCallback *callback, char *trace_name, 
+               WorkQueue *queue, int thread_count, char *first_work, size_t work_stride)
+{
+    reset_kmeans_tile_ranges(filter);
+    for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+    {
+        KmeansFilterWork *work = (KmeansFilterWork *)(first_work + thread_index*work_stride);
+        work->callback = callback;
+        work->trace_name = trace_name;
+    }
+    run_thread_works(queue, thread_count, do_tile_work, first_work, work_stride);
+}
+
+// NOTE: clusters float feature vectors, the color in options->color_space plus the position when
+// options->spatial_weight > 0, and writes the color part of the clusters converted back to sRGB.
+// A spatial weight of 1 makes crossing the whole image as far as crossing the whole color range.
+// Only -n, -m, -r, --sse-tolerance and --max-shift apply here. With wide_pixels set the input and
+// output are wide bitmaps instead of pixels and output.
+static void 
+filter_bitmap_with_feature_kmean(Color4 *output, Color4 *pixels, WideBitmap *wide_output, WideBitmap *wide_pixels, 
+                                 int width, int height, KmeansOptions *options, 
+                                 MemoryArena *arena, WorkQueue *queue, int thread_count, KmeansResult *out_result)
+{
+    int pixel_count = width * height;
+    int cluster_count = options->cluster_count;
+    ColorSpace color_space = options->color_space;
+    int dimension = (options->spatial_weight > 0) ? 5 : 3;
+    clear_memory(out_result, sizeof(*out_result));
+    if(cluster_count <= pixel_count)
+    {
+        TemporaryMemory temporary = begin_temporary_memory(arena);
+        KmeansOptions filter_options = *options;
+        filter_options.use_active_set = 0;
+        KmeansFilter filter;
+        FeatureSet features;
+        clear_memory(&features, sizeof(features));
+        size_t work_stride = align_to(sizeof(KmeansFilterWork), 128);
+        char *works = (char *)push_size(arena, thread_count*work_stride + 128);
+        size_t channel_stride = align_to(pixel_count + FEATURE_LANE_COUNT, 32);
+        float *channel_memory = push_array(arena, dimension * channel_stride, float);
+        int filter_initialized = init_kmeans_filter(&filter, pixels, output, pixel_count, &filter_options, 
+                                                    arena, queue, thread_count);
+        size_t tile_feature_stride = align_to((dimension + 1)*cluster_count + 2, 16);
+        double *tile_feature_sums = push_array(arena, (filter.tile_count + 1) * tile_feature_stride, double);
+        float *feature_centroids = push_array(arena, 2 * dimension * cluster_count, float);
+        int *seed_pixel_indices = push_array(arena, cluster_count, int);
+        float *wide_cluster_colors = push_array(arena, cluster_count * 3, float);
+        if(works && channel_memory && filter_initialized && tile_feature_sums && feature_centroids && 
+           seed_pixel_indices && wide_cluster_colors)
+        {
+            char *initial_work_ptr = (char *)align_to((size_t)works, 128);
+            for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+            {
+                KmeansFilterWork *work = (KmeansFilterWork *)(initial_work_ptr + thread_index*work_stride);
+                clear_memory(work, sizeof(*work));
+                work->filters = &filter;
+                work->filter_count = 1;
+                work->thread_index = thread_index;
+            }
+            
+            features.pixel_count = pixel_count;
+            features.dimension = dimension;
+            features.width = width;
+            if(dimension == 5)
+            {
+                int extent = (width > height) ? width : height;
+                features.spatial_scale = options->spatial_weight * get_color_space_range(color_space) / extent;
+            }
+            for(int d = 0; d < dimension; ++d)
+            {
+                features.channels[d] = channel_memory + d*channel_stride;
+                first_touch_pixel_slices(queue, thread_count, features.channels[d], sizeof(float), (int)channel_stride);
+            }
+            filter.features = &features;
+            filter.color_space = color_space;
+            filter.wide_pixels = wide_pixels;
+            filter.wide_output = wide_output;
+            filter.wide_cluster_colors = wide_cluster_colors;
+            filter.feature_centroids = feature_centroids;
+            filter.tile_feature_sums = tile_feature_sums;
+            filter.tile_feature_stride = tile_feature_stride;
+            float *previous_centroids = feature_centroids + dimension*cluster_count;
+            double *total_sums = get_tile_feature_sums(&filter, filter.tile_count);
+            
+            run_tile_works(&filter, convert_feature_tile, "convert", queue, thread_count, initial_work_ptr, work_stride);
+            
+            unsigned long long seed_begin_time = get_trace_time();
+            find_unique_feature_pixels(&features, seed_pixel_indices, cluster_count);
+            for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+            {
+                for(int d = 0; d < dimension; ++d)
+                {
+                    feature_centroids[d*cluster_count + cluster_index] = features.channels[d][seed_pixel_indices[cluster_index]];
+                }
+            }
+            record_trace_event("seed", 0, seed_begin_time);
+            
+            KmeansTileCallback *classify_callback = get_classify_feature_callback(dimension);
+            int iteration = 0;
+            while(iteration++ < options->max_iteration)
+            {
+                unsigned long long iteration_begin_time = get_trace_time();
+                filter.iteration = iteration;
+                run_tile_works(&filter, classify_callback, "classify", queue, thread_count, initial_work_ptr, work_stride);
+                
+                unsigned long long reduce_begin_time = get_trace_time();
+                clear_memory(total_sums, tile_feature_stride * sizeof(double));
+                for(int tile_index = 0; tile_index < filter.tile_count; ++tile_index)
+                {
+                    double *tile_sums = get_tile_feature_sums(&filter, tile_index);
+                    for(size_t i = 0; i < tile_feature_stride; ++i)
+                    {
+                        total_sums[i] += tile_sums[i];
+                    }
+                }
+                double *total_counts = total_sums + dimension*cluster_count;
+                copy_memory(previous_centroids, feature_centroids, dimension * cluster_count * sizeof(float));
+                for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+                {
+                    if(total_counts[cluster_index] > 0)
+                    {
+                        for(int d = 0; d < dimension; ++d)
+                        {
+                            feature_centroids[d*cluster_count + cluster_index] = 
+                                (float)(total_sums[d*cluster_count + cluster_index] / total_counts[cluster_index]);
+                        }
+                    }
+                }
+                filter.previous_feature_sse = filter.feature_sse;
+                filter.feature_sse = total_counts[cluster_count];
+                filter.total_migration_count = (int)total_counts[cluster_count + 1];
+                filter.feature_max_shift_squared = 0;
+                for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+                {
+                    double shift_squared = 0;
+                    for(int d = 0; d < dimension; ++d)
+                    {
+                        double diff = feature_centroids[d*cluster_count + cluster_index] - 
+                                      previous_centroids[d*cluster_count + cluster_index];
+                        shift_squared += diff*diff;
+                    }
+                    if(shift_squared > filter.feature_max_shift_squared) filter.feature_max_shift_squared = shift_squared;
+                }
+                record_trace_event("reduce", iteration, reduce_begin_time);
+                record_trace_event("iteration", iteration, iteration_begin_time);
+                if(has_kmeans_converged(&filter, options)) break;
+            }
+            if(iteration > options->max_iteration) iteration = options->max_iteration;
+            
+            for(int cluster_index = 0; cluster_index < cluster_count; ++cluster_index)
+            {
+                float x = feature_centroids[0*cluster_count + cluster_index];
+                float y = feature_centroids[1*cluster_count + cluster_index];
+                float z = feature_centroids[2*cluster_count + cluster_index];
+                if(wide_pixels)
+                {
+                    convert_color_space_to_wide(color_space, x, y, z, wide_pixels->max_value, 
+                                                wide_cluster_colors + cluster_index*3);
+                }
+                else
+                {
+                    unsigned char rgb[3];
+                    convert_color_space_to_srgb(color_space, x, y, z, rgb);
+                    filter.cluster_colors[cluster_index].r = rgb[0];
+                    filter.cluster_colors[cluster_index].g = rgb[1];
+                    filter.cluster_colors[cluster_index].b = rgb[2];
+                    filter.cluster_colors[cluster_index].a = 0;
+                }
+            }
+            KmeansTileCallback *fill_callback = wide_pixels ? fill_wide_tile : fill_tile;
+            run_tile_works(&filter, fill_callback, "fill", queue, thread_count, initial_work_ptr, work_stride);
+            out_result->used_iteration = iteration;
+            out_result->feature_sse = filter.feature_sse;
+        }
+        end_temporary_memory(temporary);
+    }
+    else if(wide_pixels)
+    {
+        copy_memory(wide_output->rgb, wide_pixels->rgb, pixel_count * 3 * sizeof(float));
+    }
+    else
+    {
+        for(int i = 0; i < pixel_count; ++i)
+        {
+            output[i] = pixels[i];
+        }
+    }
+}
+
+static unsigned long long
+get_kmeans_cache_key(KmeansOptions *options, int width, int height, int keep_alpha, 
+                     int pyramid_level_count, int *pyramid_iterations, Color4 *pixels)
+{
+    KmeansCacheKey key;
+    clear_memory(&key, sizeof(key));
+    key.version = KMEANS_ENGINE_VERSION;
+    key.width = width;
+    key.height = height;
+    key.keep_alpha = keep_alpha;
+    key.cluster_count = options->cluster_count;
+    key.max_iteration = options->max_iteration;
+    key.migration_threshold = options->migration_threshold;
+    key.sse_tolerance = options->sse_tolerance;
+    key.max_shift = options->max_shift;
+    key.restart_count = options->restart_count;
+    key.use_bisecting = options->use_bisecting;
+    key.bisect_refine_iteration = options->bisect_refine_iteration;
+    key.color_space = options->color_space;
+    key.spatial_weight = options->spatial_weight;
+    key.sample_fraction = options->sample_fraction;
+    key.use_color_sort = options->use_color_sort;
+    if(pyramid_level_count > 1)
+    {
+        key.pyramid_level_count = pyramid_level_count;
+        copy_memory(key.pyramid_iterations, pyramid_iterations, sizeof(key.pyramid_iterations));
+    }
+    unsigned long long seed = hash_bytes(&key, sizeof(key), 0);
+    return hash_bytes(pixels, (size_t)width * height * sizeof(Color4), seed);
+}
+
+// NOTE: turns the output into a palette and one label per pixel, pixels that pass through
+// unchanged under alpha get KMEANS_CACHE_LABEL_PASS_THROUGH. Returns 0 when the output has
+// more colors than a label can address.
+static int
+build_cache_entry(KmeansCacheEntry *entry, Color4 *output, Color4 *input, int pixel_count, int keep_alpha)
+{
+    int result = 1;
+    int table_size = 1 << 17;
+    int *table = (int *)malloc(table_size * sizeof(int));
+    entry->palette_rgb = (unsigned char *)malloc(KMEANS_CACHE_MAX_PALETTE_COUNT * 3);
+    entry->labels = (unsigned short *)malloc(pixel_count * sizeof(unsigned short));
+    entry->header.palette_count = 0;
+    if(table && entry->palette_rgb && entry->labels)
+    {
+        for(int i = 0; i < table_size; ++i) table[i] = -1;
+        for(int pixel_index = 0; result && pixel_index < pixel_count; ++pixel_index)
+        {
+            Color4 color = output[pixel_index];
+            if(keep_alpha && input[pixel_index].a == 0)
+            {
+                entry->labels[pixel_index] = KMEANS_CACHE_LABEL_PASS_THROUGH;
+                continue;
+            }
+            
+            unsigned int rgb = color.r | (color.g << 8) | (color.b << 16);
+            unsigned int slot = (rgb * 2654435761u) >> 15;
+            for(;;)
+            {
+                int palette_index = table[slot];
+                if(palette_index == -1)
+                {
+                    if(entry->header.palette_count == KMEANS_CACHE_MAX_PALETTE_COUNT)
+                    {
+                        result = 0;
+                        break;
+                    }
+                    palette_index = entry->header.palette_count++;
+                    table[slot] = palette_index;
+                    entry->palette_rgb[palette_index*3 + 0] = color.r;
+                    entry->palette_rgb[palette_index*3 + 1] = color.g;
+                    entry->palette_rgb[palette_index*3 + 2] = color.b;
+                }
+                unsigned char *palette_color = entry->palette_rgb + palette_index*3;
+                if(palette_color[0] == color.r && palette_color[1] == color.g && palette_color[2] == color.b)
+                {
+                    entry->labels[pixel_index] = (unsigned short)palette_index;
+                    break;
+                }
+                slot = (slot + 1) & (table_size - 1);
+            }
+        }
+    }
+    else
+    {
+        result = 0;
+    }
+    if(table) free(table);
+    return result;
+}
+
+static void
+apply_cache_entry(Color4 *output, Color4 *input, int pixel_count, KmeansCacheEntry *entry)
+{
+    for(int i = 0; i < pixel_count; ++i)
+    {
+        int label = entry->labels[i];
+        output[i] = input[i];
+        if(label != KMEANS_CACHE_LABEL_PASS_THROUGH && label < entry->header.palette_count)
+        {
+            output[i].r = entry->palette_rgb[label*3 + 0];
+            output[i].g = entry->palette_rgb[label*3 + 1];
+            output[i].b = entry->palette_rgb[label*3 + 2];
+        }
+    }
+}
+
+static void
+init_kmeans_job(KmeansJob *job)
+{
+    clear_memory(job, sizeof(*job));
+    job->thread_count = get_thread_count();
+    job->verbose = 1;
+    job->cluster_count = 4;
+    job->max_iteration = 200;
+    job->migration_threshold = 0.01f;
+    job->restart_count = 1;
+    job->max_shift = -1.0f;
+    job->color_space = ColorSpace_srgb;
+    job->cache.size_limit = 256ull << 20;
+}
+
+// NOTE: returns 1 when the arguments name an input and an output (or a daemon socket) and no
+// help was asked for, the paths point into args
+static int
+parse_kmeans_job(KmeansJob *job, int arg_count, char **args)
+{
+    int parsing_arg_index = 0;
+    int show_usage = 0;
+    for(; parsing_arg_index < arg_count; ++parsing_arg_index)
+    {
+        char *option = args[parsing_arg_index];
+        if(option[0] != '-' || option[1] == 0) break;
+
+        if(option[1] == 'n' && option[2] == '=')
+        {
+            job->cluster_count = atoi(option + 3);
+        }
+        else if(option[1] == 'm' && option[2] == '=')
+        {
+            job->max_iteration = atoi(option + 3);
+        }
+        else if(option[1] == 't' && option[2] == '=')
+        {
+            job->thread_count = atoi(option + 3);
+        }
+        else if(option[1] == 'r' && option[2] == '=')
+        {
+            job->migration_threshold = atof(option + 3);
+        }
+        else if(string_skip_prefix(option, "--trace="))
+        {
+            job->trace_path = string_skip_prefix(option, "--trace=");
+        }
+        else if(string_skip_prefix(option, "--incremental="))
+        {
+            job->full_update_period = atoi(string_skip_prefix(option, "--incremental="));
+        }
+        else if(string_equal(option, "--incremental"))
+        {
+            job->full_update_period = 10;
+        }
+        else if(string_skip_prefix(option, "--sse-tolerance="))
+        {
+            job->sse_tolerance = atof(string_skip_prefix(option, "--sse-tolerance="));
+        }
+        else if(string_skip_prefix(option, "--max-shift="))
+        {
+            job->max_shift = atof(string_skip_prefix(option, "--max-shift="));
+        }
+        else if(string_skip_prefix(option, "--restarts="))
+        {
+            job->restart_count = atoi(string_skip_prefix(option, "--restarts="));
+        }
+        else if(string_skip_prefix(option, "--bisecting="))
+        {
+            job->use_bisecting = 1;
+            job->bisect_refine_iteration = atoi(string_skip_prefix(option, "--bisecting="));
+        }
+        else if(string_equal(option, "--bisecting"))
+        {
+            job->use_bisecting = 1;
+        }
+        else if(string_skip_prefix(option, "--color-space="))
+        {
+            if(!parse_color_space(&job->color_space, string_skip_prefix(option, "--color-space=")))
+            {
+                printf("invalid color space '%s'\n", option);
+            }
+        }
+        else if(string_skip_prefix(option, "--spatial="))
+        {
+            job->spatial_weight = atof(string_skip_prefix(option, "--spatial="));
+        }
+        else if(string_skip_prefix(option, "--sample="))
+        {
+            job->sample_fraction = atof(string_skip_prefix(option, "--sample="));
+        }
+        else if(string_skip_prefix(option, "--pyramid="))
+        {
+            job->pyramid_level_count = atoi(string_skip_prefix(option, "--pyramid="));
+        }
+        else if(string_skip_prefix(option, "--pyramid-iterations="))
+        {
+            char *at = string_skip_prefix(option, "--pyramid-iterations=");
+            job->pyramid_iteration_count = 0;
+            while(*at && job->pyramid_iteration_count < PYRAMID_MAX_LEVEL_COUNT)
+            {
+                job->pyramid_iterations[job->pyramid_iteration_count++] = atoi(at);
+                while(*at && *at != ',') ++at;
+                if(*at == ',') ++at;
+            }
+        }
+        else if(string_skip_prefix(option, "--cache="))
+        {
+            job->cache.directory = string_skip_prefix(option, "--cache=");
+        }
+        else if(string_skip_prefix(option, "--cache-size="))
+        {
+            job->cache.size_limit = (unsigned long long)atoi(string_skip_prefix(option, "--cache-size=")) << 20;
+        }
+        else if(string_skip_prefix(option, "--palette-in="))
+        {
+            job->palette_in_path = string_skip_prefix(option, "--palette-in=");
+        }
+        else if(string_skip_prefix(option, "--palette-out="))
+        {
+            job->palette_out_path = string_skip_prefix(option, "--palette-out=");
+        }
+        else if(string_skip_prefix(option, "--dither="))
+        {
+            if(!parse_dither_mode(&job->dither_mode, string_skip_prefix(option, "--dither=")))
+            {
+                printf("invalid dither '%s'\n", option);
+            }
+        }
+        else if(string_skip_prefix(option, "--daemon="))
+        {
+            job->daemon_path = string_skip_prefix(option, "--daemon=");
+        }
+        else if(string_equal(option, "--alpha"))
+        {
+            job->use_alpha = 1;
+        }
+        else if(string_equal(option, "--active-set"))
+        {
+            job->use_active_set = 1;
+        }
+        else if(string_equal(option, "--memo-grid"))
+        {
+            job->use_memo_grid = 1;
+        }
+        else if(string_equal(option, "--color-sort"))
+        {
+            job->use_color_sort = 1;
+        }
+        else if(string_equal(option, "--perf-counters"))
+        {
+            job->perf_counters = 1;
+        }
+        else if(string_skip_prefix(option, "--huge-pages="))
+        {
+            if(!parse_huge_page_mode(&job->huge_page_mode, string_skip_prefix(option, "--huge-pages=")))
+            {
+                printf("invalid huge pages '%s'\n", option);
+            }
+        }
+        else if(string_skip_prefix(option, "--affinity="))
+        {
+            if(!parse_affinity_option(&job->affinity_option, string_skip_prefix(option, "--affinity=")))
+            {
+                printf("invalid affinity '%s'\n", option);
+            }
+        }
+        else if(option[1] == 'q' && option[2] == 0)
+        {
+            job->verbose = 0;
+        }
+        else if(option[1] == 'h' && option[2] == 0)
+        {
+            show_usage = 1;
+        }
+        else
         {
             printf("unknown option '%s'\n", option);
         }
     }
-    
-    if(show_usage || (parsing_arg_index + 2 != arg_count))
-    {
-        char *usage = "usage: kmean [option] ... input_path output_path\n"
-                      "options:\n"
-                      "    -n={cluster_count}  number of clusters (default is 4)\n"
-                      "    -m={max_iteration}  max iteration of kmean clustering (default is 200)\n"
-                      "    -t={thread_count}   number of used threads (default is the number of logical core)\n"
-                      "    -r={threshold}      exit when the data point migration ratio between clusters exceeds this value (default is 0.01)\n"
-                      "    -q                  quiet mode (no output)\n"
-                      "    -h                  print this help information\n";
-        //NOTE: pass the string via '%s' to shut up the compiler warning
-        if(verbose) printf("%s", usage);
-        return 0;
+
+    int result = 0;
+    if(!show_usage)
+    {
+        if(job->daemon_path)
+        {
+            result = (parsing_arg_index == arg_count);
+        }
+        else if(parsing_arg_index + 2 == arg_count)
+        {
+            job->input_path = args[parsing_arg_index + 0];
+            job->output_path = args[parsing_arg_index + 1];
+            result = 1;
+        }
     }
-    
-    char *input_path = args[parsing_arg_index + 0];
-    char *output_path = args[parsing_arg_index + 1];
-    size_t output_path_len = string_len(output_path);
-    if(output_path_len >= 4 && 
-       (output_path[output_path_len-4] == '.') && 
-       (output_path[output_path_len-3] == 'p' || output_path[output_path_len-3] == 'P') && 
-       (output_path[output_path_len-2] == 'n' || output_path[output_path_len-2] == 'N') && 
-       (output_path[output_path_len-1] == 'g' || output_path[output_path_len-1] == 'G'))
+    return result;
+}
+
+static void
+print_usage(void)
+{
+    char *usage = "usage: kmean [option] ... input_path output_path\n"
+                  "       kmean --daemon={socket_path} [-t={thread_count}] [--affinity={mode}] [--huge-pages={mode}] [-q]\n"
+                  "16 bit and .hdr inputs keep their precision and are written as 16 bit .png or as .hdr\n"
+                  "options:\n"
+                  "    -n={cluster_count}  number of clusters (default is 4)\n"
+                  "    -m={max_iteration}  max iteration of kmean clustering (default is 200)\n"
+                  "    -t={thread_count}   number of used threads (default is the number of logical core)\n"
+                  "    -r={threshold}      exit when the data point migration ratio between clusters exceeds this value (default is 0.01)\n"
+                  "    --sse-tolerance={x} also exit when the SSE improved by less than this fraction (default is off)\n"
+                  "    --max-shift={d}     also exit when no cluster moved further than d (default is off)\n"
+                  "    --incremental[={n}] update the clusters from the migrated pixels only, with a full recompute\n"
+                  "                        every n iterations (default is 10 when given, 0 recomputes every iteration)\n"
+                  "    --active-set        only re-classify the pixels near a decision boundary, bounded by how far\n"
+                  "                        the clusters moved since the pixel was last classified\n"
+                  "    --memo-grid         resolve pixels through a coarse color grid that is filled lazily every iteration\n"
+                  "                        with the cluster that wins the whole cell, only boundary cells compute distances\n"
+                  "    --color-sort        iterate on the pixels sorted by the Morton code of their color and put the\n"
+                  "                        output back in place at the end (integer engine, ignored with --sample and --pyramid)\n"
+                  "    --restarts={n}      run n differently seeded clusterings side by side, drop the worse half by\n"
+                  "                        SSE every few iterations and keep the best one (default is 1)\n"
+                  "    --bisecting[={n}]   build the clusters by recursively splitting them in two, then run n flat\n"
+                  "                        iterations to refine them (default is 0), much faster for large cluster counts\n"
+                  "    --color-space={s}   cluster in 'srgb' (default), 'oklab' or 'cielab', the perceptual spaces use\n"
+                  "                        float features and ignore --incremental, --active-set, --restarts and --bisecting\n"
+                  "    --spatial={w}       also cluster on the pixel position weighted by w, 1 weighs crossing the image\n"
+                  "                        like crossing the color range, uses the float features like --color-space\n"
+                  "    --sample={f}        iterate on a stratified fraction f of the pixels, then classify every pixel\n"
+                  "                        once against the clusters found (default is 1, integer engine only)\n"
+                  "    --pyramid={l}       converge on a l level box filtered pyramid from the coarsest level up, every\n"
+                  "                        finer level starts from the clusters of the one below (integer engine only)\n"
+                  "    --pyramid-iterations={a,b,...}\n"
+                  "                        iteration caps per level from the coarsest, the coarsest defaults to -m and\n"
+                  "                        the others to 2\n"
+                  "    --alpha             keep the alpha channel, fully transparent pixels are left out of the clustering\n"
+                  "                        and pass through unchanged (8 bit input only, ignores --spatial and --pyramid)\n"
+                  "    --cache={dir}       reuse the output of an earlier run on the same pixels and options from dir\n"
+                  "                        (8 bit input only, dir is created when missing)\n"
+                  "    --cache-size={mb}   evict the least recently used cache entries beyond this size (default is 256)\n"
+                  "    --palette-in={path} skip the clustering and map every pixel to the nearest color of a GIMP palette\n"
+                  "                        through a 3D lookup table (8 bit input only, sRGB distances)\n"
+                  "    --palette-out={path} also write the colors of the result as a GIMP palette (8 bit input only)\n"
+                  "    --dither={mode}     redraw the output with its own colors (or the --palette-in colors) dithered,\n"
+                  "                        'floyd-steinberg', 'atkinson' or the ordered 'bayer' (8 bit input only)\n"
+                  "    --daemon={path}     serve jobs sent by kmeans_client on a unix socket with one persistent thread pool\n"
+                  "    --trace={path}      write per-phase and per-thread timings as a Chrome trace JSON file\n"
+                  "    --perf-counters     print per-iteration IPC, LLC traffic and branch misses of the classify and update phases\n"
+                  "    --affinity={mode}   pin threads: 'compact' fills one NUMA node first, 'scatter' spreads over nodes,\n"
+                  "                        or an explicit cpu list like '0-3,8' (default is no pinning)\n"
+                  "    --huge-pages={mode} back the buffers with 'transparent' or 'explicit' 2MB huge pages, explicit ones\n"
+                  "                        come from vm.nr_hugepages and fall back to normal pages (default is 'off')\n"
+                  "    -q                  quiet mode (no output)\n"
+                  "    -h                  print this help information\n";
+    //NOTE: pass the string via '%s' to shut up the compiler warning
+    printf("%s", usage);
+}
+
+// NOTE: loads, clusters and writes one image on an existing work queue of thread_count threads.
+// Messages only go to stdout in verbose mode, the outcome is always reported in stats. Every
+// buffer of the job comes from the arena, which is reset rather than freed between jobs.
+static void
+run_kmeans_job(KmeansJob *job, MemoryArena *arena, WorkQueue *work_queue, int thread_count, KmeansJobStats *stats)
+{
+    int verbose = job->verbose;
+    clear_memory(stats, sizeof(*stats));
+    reset_memory_arena(arena);
+    char *output_path = job->output_path;
+    int output_is_hdr = has_path_extension(output_path, ".hdr");
+    if(has_path_extension(output_path, ".png") || output_is_hdr)
     {
+        char *trace_path = job->trace_path;
+        if(trace_path && !begin_trace())
+        {
+            if(verbose) printf("ERROR: out of memory, tracing disabled\n");
+            trace_path = 0;
+        }
+
         Image image;
-        if(load_image_info(&image, input_path))
-        {
-            Color4 *input = (Color4 *)malloc(image.width * image.height * sizeof(Color4));
-            Color4 *output = (Color4 *)malloc(image.width * image.height * sizeof(Color4));
-            if(input && output)
-            {
-                load_image_data(input, &image);
-                int used_iteration;
-                unsigned long long start_time = get_microsecond_from_epoch();
-                WorkQueue work_queue;
-                create_work_queue(&work_queue, thread_count - 1);
-                filter_bitmap_with_kmean(output, input, image.width, image.height, 
-                                         cluster_count, max_iteration, migration_threshold, 
-                                         &work_queue, thread_count, 
-                                         &used_iteration);
-                unsigned long long end_time = get_microsecond_from_epoch();
+        int image_loaded = job->input_data ? load_image_info_from_memory(&image, job->input_data, job->input_data_size) :
+                                             load_image_info(&image, job->input_path);
+        if(image_loaded)
+        {
+            // NOTE: 16 bit and HDR images, or any image written as HDR, go through the wide float
+            // pixels so that no precision is lost on the way in or out
+            int pixel_count = image.width * image.height;
+            int use_wide = image.is_16_bit || image.is_hdr || output_is_hdr;
+            int keep_alpha = job->use_alpha && !use_wide;
+            float spatial_weight = job->spatial_weight;
+            if(job->use_alpha && verbose)
+            {
+                if(use_wide) printf("NOTE: --alpha only applies to 8 bit input, ignored\n");
+                else
+                {
+                    if(spatial_weight > 0) printf("NOTE: --alpha clusters the opaque pixels only, --spatial is ignored\n");
+                    if(job->pyramid_level_count > 1) printf("NOTE: --alpha clusters the opaque pixels only, --pyramid is ignored\n");
+                }
+            }
+            // NOTE: the opaque pixels are packed into one row, so neither their positions nor 2x2
+            // neighbourhoods mean anything any more
+            if(keep_alpha) spatial_weight = 0;
+            int pyramid_level_count = keep_alpha ? 1 : job->pyramid_level_count;
+            int use_palette = (job->palette_in_path && !use_wide);
+            int use_dither = (job->dither_mode != DitherMode_none && !use_wide);
+            int need_palette_colors = (use_palette || use_dither || (job->palette_out_path && !use_wide));
+            if(verbose)
+            {
+                if(job->palette_in_path && use_wide) printf("NOTE: --palette-in only applies to 8 bit input, ignored\n");
+                if(job->palette_out_path && use_wide) printf("NOTE: --palette-out only applies to 8 bit input, ignored\n");
+                if(job->dither_mode != DitherMode_none && use_wide) printf("NOTE: --dither only applies to 8 bit input, ignored\n");
+                if(use_palette && (job->color_space != ColorSpace_srgb || spatial_weight > 0))
+                {
+                    printf("NOTE: --palette-in maps by sRGB distance, --color-space and --spatial are ignored\n");
+                }
+            }
+            Color4 *palette_colors = 0;
+            int palette_color_count = 0;
+            if(need_palette_colors)
+            {
+                palette_colors = push_array(arena, PALETTE_MAX_COLOR_COUNT, Color4);
+            }
+            if(use_palette && palette_colors)
+            {
+                palette_color_count = load_palette(job->palette_in_path, palette_colors, PALETTE_MAX_COLOR_COUNT);
+            }
+            stats->width = image.width;
+            stats->height = image.height;
+            Color4 *input = 0;
+            Color4 *output = 0;
+            WideBitmap wide_input, wide_output;
+            clear_memory(&wide_input, sizeof(wide_input));
+            clear_memory(&wide_output, sizeof(wide_output));
+            if(use_wide)
+            {
+                wide_input.rgb = push_array(arena, pixel_count * 3, float);
+                wide_output.rgb = push_array(arena, pixel_count * 3, float);
+            }
+            else
+            {
+                input = push_array(arena, pixel_count, Color4);
+                output = push_array(arena, pixel_count, Color4);
+            }
+            if(use_palette && palette_color_count <= 0)
+            {
+                stats->status = KmeansJobStatus_palette_read_failed;
+                if(verbose) printf("ERROR: read palette '%s' failed\n", job->palette_in_path);
+            }
+            else if((use_wide ? (wide_input.rgb && wide_output.rgb) : (input && output)) && 
+                    (palette_colors || !need_palette_colors))
+            {
+                unsigned long long decode_begin_time;
+                unsigned long long decode_start_time = get_nanosecond_monotonic();
+                if(use_wide)
+                {
+                    first_touch_pixel_slices(work_queue, thread_count, wide_input.rgb, 3 * sizeof(float), pixel_count);
+                    first_touch_pixel_slices(work_queue, thread_count, wide_output.rgb, 3 * sizeof(float), pixel_count);
+                    decode_begin_time = get_trace_time();
+                    load_wide_image_data(&wide_input, &image);
+                    wide_output.max_value = wide_input.max_value;
+                }
+                else
+                {
+                    first_touch_pixel_slices(work_queue, thread_count, input, sizeof(Color4), pixel_count);
+                    first_touch_pixel_slices(work_queue, thread_count, output, sizeof(Color4), pixel_count);
+                    decode_begin_time = get_trace_time();
+                    load_image_data(input, &image, keep_alpha);
+                }
+                record_trace_event("decode", 0, decode_begin_time);
+                KmeansOptions options;
+                options.cluster_count = job->cluster_count;
+                options.max_iteration = job->max_iteration;
+                options.migration_threshold = job->migration_threshold;
+                options.sse_tolerance = job->sse_tolerance;
+                options.max_shift = job->max_shift;
+                options.full_update_period = job->full_update_period;
+                options.use_active_set = job->use_active_set;
+                options.restart_count = job->restart_count;
+                options.use_bisecting = job->use_bisecting;
+                options.bisect_refine_iteration = job->bisect_refine_iteration;
+                options.color_space = job->color_space;
+                options.spatial_weight = spatial_weight;
+                options.sample_fraction = job->sample_fraction;
+                options.initial_cluster_colors = 0;
+                options.use_memo_grid = job->use_memo_grid;
+                options.use_color_sort = job->use_color_sort;
+                options.report_perf_counters = job->perf_counters && verbose;
+                KmeansResult result;
+                unsigned long long start_time = get_nanosecond_monotonic();
+                stats->decode_time = start_time - decode_start_time;
+                if(job->perf_counters) begin_perf_counters();
+
+                int level_iterations[PYRAMID_MAX_LEVEL_COUNT];
+                for(int level = 0; level < PYRAMID_MAX_LEVEL_COUNT; ++level)
+                {
+                    level_iterations[level] = level ? PYRAMID_DEFAULT_FINE_ITERATION : job->max_iteration;
+                    if(level < job->pyramid_iteration_count) level_iterations[level] = job->pyramid_iterations[level];
+                }
+                int use_features = !use_palette && (use_wide || job->color_space != ColorSpace_srgb || spatial_weight > 0);
+
+                // NOTE: a hit skips the clustering and rebuilds the output from the stored labels
+                KmeansCache *cache = &job->cache;
+                int use_cache = (cache->directory && !use_wide && !use_palette);
+                int cache_hit = 0;
+                unsigned long long cache_key = 0;
+                if(use_cache)
+                {
+                    unsigned long long cache_begin_time = get_trace_time();
+                    cache_key = get_kmeans_cache_key(&options, image.width, image.height, keep_alpha,
+                                                     pyramid_level_count, level_iterations, input);
+                    KmeansCacheEntry cache_entry;
+                    cache_hit = load_cache_entry(cache, cache_key, image.width, image.height, &cache_entry);
+                    if(cache_hit)
+                    {
+                        apply_cache_entry(output, input, pixel_count, &cache_entry);
+                        clear_memory(&result, sizeof(result));
+                        result.used_iteration = cache_entry.header.used_iteration;
+                        result.coarse_iteration = cache_entry.header.coarse_iteration;
+                        result.best_restart = cache_entry.header.best_restart;
+                        result.sse = cache_entry.header.sse;
+                        result.feature_sse = cache_entry.header.feature_sse;
+                        free_cache_entry(&cache_entry);
+                    }
+                    record_trace_event("cache lookup", 0, cache_begin_time);
+                }
+
+                if(use_palette)
+                {
+                    filter_bitmap_with_palette(output, input, pixel_count, keep_alpha, palette_colors, palette_color_count,
+                                               arena, work_queue, thread_count, &result);
+                }
+                else if(!cache_hit)
+                {
+                    // NOTE: with alpha the engines run on the packed opaque pixels as a single row
+                    TemporaryMemory filter_temporary = begin_temporary_memory(arena);
+                    Color4 *filter_input = input;
+                    Color4 *filter_output = output;
+                    int filter_width = image.width;
+                    int filter_height = image.height;
+                    Color4 *opaque_pixels = 0;
+                    Color4 *opaque_output = 0;
+                    int *opaque_pixel_indices = 0;
+                    int opaque_count = 0;
+                    if(keep_alpha)
+                    {
+                        opaque_pixels = push_array(arena, pixel_count, Color4);
+                        opaque_output = push_array(arena, pixel_count, Color4);
+                        opaque_pixel_indices = push_array(arena, pixel_count, int);
+                        if(opaque_pixels && opaque_output && opaque_pixel_indices)
+                        {
+                            unsigned long long compact_begin_time = get_trace_time();
+                            first_touch_pixel_slices(work_queue, thread_count, opaque_pixels, sizeof(Color4), pixel_count);
+                            first_touch_pixel_slices(work_queue, thread_count, opaque_output, sizeof(Color4), pixel_count);
+                            opaque_count = compact_opaque_pixels(input, pixel_count, opaque_pixels, opaque_pixel_indices);
+                            record_trace_event("compact", 0, compact_begin_time);
+                            filter_input = opaque_pixels;
+                            filter_output = opaque_output;
+                            filter_width = opaque_count;
+                            filter_height = 1;
+                            if(verbose) printf("[alpha] %d of %d pixels are opaque\n", opaque_count, pixel_count);
+                        }
+                        else
+                        {
+                            if(verbose) printf("ERROR: out of memory, transparent pixels are clustered too\n");
+                        }
+                    }
+
+                    if(!use_features && pyramid_level_count > 1)
+                    {
+                        filter_bitmap_with_pyramid_kmean(filter_output, filter_input, filter_width, filter_height, &options,
+                                                         pyramid_level_count, level_iterations,
+                                                         arena, work_queue, thread_count, &result);
+                    }
+                    else if(!use_features && job->sample_fraction > 0 && job->sample_fraction < 1)
+                    {
+                        filter_bitmap_with_sampled_kmean(filter_output, filter_input, filter_width, filter_height, &options,
+                                                         arena, work_queue, thread_count, &result);
+                    }
+                    else if(!use_features && job->use_color_sort)
+                    {
+                        filter_bitmap_with_sorted_kmean(filter_output, filter_input, filter_width, filter_height, &options,
+                                                        arena, work_queue, thread_count, &result);
+                    }
+                    else if(!use_features)
+                    {
+                        filter_bitmap_with_kmean(filter_output, filter_input, filter_width, filter_height, &options,
+                                                 arena, work_queue, thread_count, &result, 0);
+                    }
+                    else
+                    {
+                        init_color_space_tables();
+                        filter_bitmap_with_feature_kmean(filter_output, filter_input,
+                                                         use_wide ? &wide_output : 0, use_wide ? &wide_input : 0,
+                                                         filter_width, filter_height, &options,
+                                                         arena, work_queue, thread_count, &result);
+                    }
+                    if(filter_input != input)
+                    {
+                        expand_opaque_pixels(output, input, pixel_count, opaque_output, opaque_pixel_indices, opaque_count);
+                    }
+                    else if(keep_alpha)
+                    {
+                        for(int i = 0; i < pixel_count; ++i) output[i].a = input[i].a;
+                    }
+                    end_temporary_memory(filter_temporary);
+                }
+
+                if(use_cache)
+                {
+                    if(!cache_hit)
+                    {
+                        unsigned long long cache_begin_time = get_trace_time();
+                        KmeansCacheEntry cache_entry;
+                        clear_memory(&cache_entry, sizeof(cache_entry));
+                        if(build_cache_entry(&cache_entry, output, input, pixel_count, keep_alpha))
+                        {
+                            cache_entry.header.width = image.width;
+                            cache_entry.header.height = image.height;
+                            cache_entry.header.used_iteration = result.used_iteration;
+                            cache_entry.header.coarse_iteration = result.coarse_iteration;
+                            cache_entry.header.best_restart = result.best_restart;
+                            cache_entry.header.sse = result.sse;
+                            cache_entry.header.feature_sse = result.feature_sse;
+                            if(store_cache_entry(cache, cache_key, &cache_entry)) evict_cache_entries(cache);
+                            else if(verbose) printf("ERROR: write to cache '%s' failed\n", cache->directory);
+                        }
+                        free_cache_entry(&cache_entry);
+                        record_trace_event("cache store", 0, cache_begin_time);
+                    }
+                    update_cache_counters(cache, cache_hit);
+                }
+                if(use_dither)
+                {
+                    int color_count = use_palette ? palette_color_count :
+                                      collect_output_palette(output, input, pixel_count, keep_alpha,
+                                                             palette_colors, PALETTE_MAX_COLOR_COUNT, arena);
+                    if(color_count > 0 &&
+                       !dither_bitmap_with_palette(output, input, image.width, image.height, keep_alpha, job->dither_mode,
+                                                   palette_colors, color_count, arena, work_queue, thread_count))
+                    {
+                        if(verbose) printf("ERROR: out of memory, the output is not dithered\n");
+                    }
+                }
+                if(job->palette_out_path && !use_wide)
+                {
+                    int color_count = collect_output_palette(output, input, pixel_count, keep_alpha, 
+                                                             palette_colors, PALETTE_MAX_COLOR_COUNT, arena);
+                    if(!write_palette(job->palette_out_path, palette_colors, color_count))
+                    {
+                        stats->status = KmeansJobStatus_write_failed;
+                        if(verbose) printf("ERROR: write '%s' failed\n", job->palette_out_path);
+                    }
+                }
+                unsigned long long end_time = get_nanosecond_monotonic();
+                stats->cluster_time = end_time - start_time;
+                stats->result = result;
+                stats->use_features = use_features;
+                stats->cache_hit = cache_hit;
                 if(verbose)
                 {
                     printf("[summary]\n");
-                    printf("    used iteration = %d\n", used_iteration);
-                    printf("    time = %fs\n", (end_time - start_time) / 1000000.0f);
+                    printf("    used iteration = %d\n", result.used_iteration);
+                    if(!use_features) printf("    sse = %llu\n", result.sse);
+                    else printf("    sse = %f\n", result.feature_sse);
+                    if(job->restart_count > 1) printf("    best restart = %d\n", result.best_restart);
+                    if(result.coarse_iteration) printf("    coarse iteration = %d\n", result.coarse_iteration);
+                    if(use_palette) printf("    palette = %d colors\n", palette_color_count);
+                    if(use_dither) printf("    dither = %s\n", get_dither_mode_name(job->dither_mode));
+                    if(use_cache)
+                    {
+                        printf("    cache = %s (hits = %llu, misses = %llu)\n", cache_hit ? "hit" : "miss",
+                               cache->hit_count, cache->miss_count);
+                    }
+                    printf("    time = %fs\n", (end_time - start_time) / 1000000000.0f);
+                    if(arena->huge_page_mode != HugePageMode_off)
+                    {
+                        printf("    arena = %.1f MB mapped, %.1f MB on explicit huge pages\n",
+                               arena->mapped_size / 1048576.0, arena->huge_page_size / 1048576.0);
+                    }
+                    if(job->perf_counters) print_perf_counter_availability();
                 }
-                
-                if(write_image(output_path, output, image.width, image.height))
+                if(job->perf_counters) end_perf_counters();
+
+                unsigned long long encode_begin_time = get_trace_time();
+                int written = use_wide ? write_wide_image(output_path, &wide_output, image.width, image.height, output_is_hdr, arena) :
+                                         write_image(output_path, output, image.width, image.height, keep_alpha, arena);
+                if(written)
                 {
                     // NOTE: success
                 }
                 else
                 {
+                    stats->status = KmeansJobStatus_write_failed;
                     if(verbose) printf("ERROR: write '%s' failed\n", output_path);
                 }
+                record_trace_event("encode", 0, encode_begin_time);
+                stats->encode_time = get_nanosecond_monotonic() - end_time;
+
+                if(trace_path)
+                {
+                    if(verbose) print_trace_summary();
+                    if(!write_chrome_trace(trace_path))
+                    {
+                        if(verbose) printf("ERROR: write '%s' failed\n", trace_path);
+                    }
+                }
             }
             else
             {
+                stats->status = KmeansJobStatus_out_of_memory;
                 if(verbose) printf("ERROR: out of memory\n");
             }
-            
-            if(input) free(input);
-            if(output) free(output);
+
             free_image_info(&image);
         }
         else
         {
-            if(verbose) printf("ERROR: read '%s' failed\n", input_path);
+            stats->status = KmeansJobStatus_read_failed;
+            if(verbose) printf("ERROR: read '%s' failed\n", job->input_data ? "-" : job->input_path);
         }
+        end_trace();
     }
     else
     {
-       if(verbose) printf("ERROR: output should end with '.png' extension\n");
+       stats->status = KmeansJobStatus_bad_output_path;
+       if(verbose) printf("ERROR: output should end with '.png' or '.hdr' extension\n");
     }
-    
+}
+
+#if defined(__unix__)
+// NOTE: returns the listening socket or -1, a stale socket file left by a dead daemon is replaced
+static int
+listen_on_socket(char *path)
+{
+    int result = -1;
+    struct sockaddr_un address;
+    if(fill_socket_address(&address, path))
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd != -1)
+        {
+            unlink(path);
+            if(bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0 && listen(fd, 128) == 0)
+            {
+                result = fd;
+            }
+            else
+            {
+                close(fd);
+            }
+        }
+    }
+    return result;
+}
+
+// NOTE: the connection threads only move bytes, every job runs on the thread that owns the work
+// queue. Jobs are served one at a time in arrival order: each of them already spreads over the
+// whole pool, and the engines need idle workers (run_on_every_thread) and the main thread's
+// scratch index, so overlapping two jobs on one pool wouldn't be safe anyway.
+static void
+push_daemon_job(KmeansDaemon *daemon, KmeansDaemonJob *job)
+{
+    job->next = 0;
+    job->queued_time = get_nanosecond_monotonic();
+    begin_ticket_mutex(&daemon->job_mutex);
+    if(daemon->last_job) daemon->last_job->next = job;
+    else daemon->first_job = job;
+    daemon->last_job = job;
+    end_ticket_mutex(&daemon->job_mutex);
+    increment_semaphore(&daemon->job_semaphore);
+}
+
+static KmeansDaemonJob *
+pop_daemon_job(KmeansDaemon *daemon)
+{
+    wait_for_semaphore(&daemon->job_semaphore);
+    begin_ticket_mutex(&daemon->job_mutex);
+    KmeansDaemonJob *result = daemon->first_job;
+    daemon->first_job = result->next;
+    if(!daemon->first_job) daemon->last_job = 0;
+    end_ticket_mutex(&daemon->job_mutex);
+    return result;
+}
+
+static
+THREAD_PROC(daemon_connection_proc)
+{
+    KmeansDaemonJob *job = (KmeansDaemonJob *)param;
+    KmeansDaemon *daemon = job->daemon;
+    KmeansDaemonRequest *request = &job->request;
+    clear_memory(&job->response, sizeof(job->response));
+    job->response.magic = KMEANS_DAEMON_MAGIC;
+    job->response.status = KmeansJobStatus_bad_request;
+
+    int is_valid = (read_socket_exact(job->fd, request, sizeof(*request)) &&
+                    request->magic == KMEANS_DAEMON_MAGIC &&
+                    request->arg_count >= 0 && request->arg_count <= request->args_size &&
+                    request->args_size >= 0 && request->args_size <= KMEANS_DAEMON_MAX_ARGS_SIZE &&
+                    request->inline_size >= 0 && request->inline_size <= KMEANS_DAEMON_MAX_INLINE_SIZE);
+    if(is_valid)
+    {
+        job->arg_text = (char *)malloc(request->args_size + 1);
+        job->args = (char **)malloc((request->arg_count + 1) * sizeof(char *));
+        job->inline_data = request->inline_size ? malloc((size_t)request->inline_size) : 0;
+        is_valid = (job->arg_text && job->args && (job->inline_data || !request->inline_size) &&
+                    read_socket_exact(job->fd, job->arg_text, request->args_size) &&
+                    read_socket_exact(job->fd, job->inline_data, (size_t)request->inline_size));
+    }
+    if(is_valid)
+    {
+        // NOTE: split the NUL separated arguments, the text is terminated once more in case the
+        // client left the last one open
+        job->arg_text[request->args_size] = 0;
+        char *at = job->arg_text;
+        for(int i = 0; i < request->arg_count; ++i)
+        {
+            job->args[i] = at;
+            if(at < job->arg_text + request->args_size) at += string_len(at) + 1;
+        }
+        push_daemon_job(daemon, job);
+        wait_for_semaphore(&job->done);
+    }
+    else
+    {
+        snprintf(job->response.message, sizeof(job->response.message), "malformed request");
+    }
+
+    write_socket_exact(job->fd, &job->response, sizeof(job->response));
+    close(job->fd);
+    if(is_valid && request->command == KmeansDaemonCommand_shutdown) increment_semaphore(&daemon->shutdown_semaphore);
+    if(job->arg_text) free(job->arg_text);
+    if(job->args) free(job->args);
+    if(job->inline_data) free(job->inline_data);
+    free(job);
+    return 0;
+}
+
+static
+THREAD_PROC(daemon_accept_proc)
+{
+    KmeansDaemon *daemon = (KmeansDaemon *)param;
+    for(;;)
+    {
+        int fd = accept(daemon->listen_fd, 0, 0);
+        if(fd == -1) continue;
+
+        KmeansDaemonJob *job = (KmeansDaemonJob *)malloc(sizeof(KmeansDaemonJob));
+        if(job)
+        {
+            clear_memory(job, sizeof(*job));
+            job->daemon = daemon;
+            job->fd = fd;
+            create_semaphore(&job->done, 1);
+            create_thread(daemon_connection_proc, job);
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+static void
+run_daemon_job(KmeansDaemonJob *daemon_job, MemoryArena *arena, WorkQueue *work_queue, int thread_count)
+{
+    KmeansDaemonResponse *response = &daemon_job->response;
+    KmeansJob job;
+    init_kmeans_job(&job);
+    if(parse_kmeans_job(&job, daemon_job->request.arg_count, daemon_job->args) && !job.daemon_path)
+    {
+        // NOTE: the pool, its pinning, the arena and the process wide trace and counters belong to
+        // the daemon
+        job.verbose = 0;
+        job.trace_path = 0;
+        job.perf_counters = 0;
+        if(string_equal(job.input_path, "-"))
+        {
+            job.input_data = daemon_job->inline_data;
+            job.input_data_size = (size_t)daemon_job->request.inline_size;
+        }
+
+        KmeansJobStats stats;
+        run_kmeans_job(&job, arena, work_queue, thread_count, &stats);
+        response->status = stats.status;
+        response->width = stats.width;
+        response->height = stats.height;
+        response->used_iteration = stats.result.used_iteration;
+        response->coarse_iteration = stats.result.coarse_iteration;
+        response->best_restart = stats.result.best_restart;
+        response->use_features = stats.use_features;
+        response->cache_hit = stats.cache_hit;
+        response->sse = stats.result.sse;
+        response->feature_sse = stats.result.feature_sse;
+        response->decode_seconds = stats.decode_time / 1000000000.0;
+        response->cluster_seconds = stats.cluster_time / 1000000000.0;
+        response->encode_seconds = stats.encode_time / 1000000000.0;
+        switch(stats.status)
+        {
+            case KmeansJobStatus_ok: snprintf(response->message, sizeof(response->message), "ok"); break;
+            case KmeansJobStatus_bad_output_path: snprintf(response->message, sizeof(response->message), "output should end with '.png' or '.hdr' extension"); break;
+            case KmeansJobStatus_read_failed: snprintf(response->message, sizeof(response->message), "read '%s' failed", job.input_path); break;
+            case KmeansJobStatus_write_failed: snprintf(response->message, sizeof(response->message), "write '%s' failed", job.output_path); break;
+            case KmeansJobStatus_out_of_memory: snprintf(response->message, sizeof(response->message), "out of memory"); break;
+            case KmeansJobStatus_palette_read_failed: snprintf(response->message, sizeof(response->message), "read palette '%s' failed", job.palette_in_path); break;
+            default: break;
+        }
+    }
+    else
+    {
+        snprintf(response->message, sizeof(response->message), "expected [option] ... input_path output_path");
+    }
+}
+
+static void
+run_daemon(char *socket_path, MemoryArena *arena, WorkQueue *work_queue, int thread_count, int verbose)
+{
+    KmeansDaemon daemon;
+    clear_memory(&daemon, sizeof(daemon));
+    create_semaphore(&daemon.job_semaphore, 0);
+    create_semaphore(&daemon.shutdown_semaphore, 1);
+    daemon.listen_fd = listen_on_socket(socket_path);
+    if(daemon.listen_fd != -1)
+    {
+        if(verbose) printf("[daemon] listening on '%s' with %d threads\n", socket_path, thread_count);
+        fflush(stdout);
+        create_thread(daemon_accept_proc, &daemon);
+        for(;;)
+        {
+            KmeansDaemonJob *job = pop_daemon_job(&daemon);
+            unsigned long long begin_time = get_nanosecond_monotonic();
+            job->response.queue_seconds = (begin_time - job->queued_time) / 1000000000.0;
+            if(job->request.command == KmeansDaemonCommand_shutdown)
+            {
+                job->response.status = KmeansJobStatus_ok;
+                snprintf(job->response.message, sizeof(job->response.message), "shutting down");
+                increment_semaphore(&job->done);
+                break;
+            }
+
+            run_daemon_job(job, arena, work_queue, thread_count);
+            if(verbose)
+            {
+                printf("[daemon] job %d: %s, %dx%d, %d iterations, %fs\n", daemon.served_count, job->response.message,
+                       job->response.width, job->response.height, job->response.used_iteration,
+                       (get_nanosecond_monotonic() - begin_time) / 1000000000.0);
+                fflush(stdout);
+            }
+            ++daemon.served_count;
+            increment_semaphore(&job->done);
+        }
+
+        // NOTE: wait for the answer to the shutdown request before the process goes away
+        wait_for_semaphore(&daemon.shutdown_semaphore);
+        close(daemon.listen_fd);
+        unlink(socket_path);
+        if(verbose) printf("[daemon] stopped after %d jobs\n", daemon.served_count);
+    }
+    else
+    {
+        if(verbose) printf("ERROR: listen on '%s' failed\n", socket_path);
+    }
+}
+#else
+static void
+run_daemon(char *socket_path, MemoryArena *arena, WorkQueue *work_queue, int thread_count, int verbose)
+{
+    if(verbose) printf("ERROR: --daemon needs unix domain sockets\n");
+}
+#endif
+
+int
+main(int arg_count, char **args)
+{
+    KmeansJob job;
+    init_kmeans_job(&job);
+    if(!parse_kmeans_job(&job, arg_count - 1, args + 1))
+    {
+        if(job.verbose) print_usage();
+        return 0;
+    }
+
+    int thread_count = job.thread_count;
+    int verbose = job.verbose;
+    ThreadAffinity thread_affinity;
+    ThreadAffinity *affinity = 0;
+    if(job.affinity_option.mode != AffinityMode_none && thread_count > 0)
+    {
+        int *thread_cpus = (int *)malloc(thread_count * sizeof(int));
+        int *thread_nodes = (int *)malloc(thread_count * sizeof(int));
+        if(thread_cpus && thread_nodes)
+        {
+            NumaTopology topology;
+            load_numa_topology(&topology);
+            build_thread_affinity(&thread_affinity, thread_cpus, thread_nodes, &topology, &job.affinity_option, thread_count);
+            affinity = &thread_affinity;
+            if(verbose)
+            {
+                printf("[affinity] %d numa node(s) used, cpus:", affinity->node_count);
+                for(int i = 0; i < thread_count; ++i) printf(" %d", thread_cpus[i]);
+                printf("\n");
+            }
+        }
+    }
+
+    WorkQueue work_queue;
+    create_work_queue(&work_queue, thread_count - 1, affinity);
+    MemoryArena arena;
+    init_memory_arena(&arena, job.huge_page_mode);
+    if(job.daemon_path)
+    {
+        run_daemon(job.daemon_path, &arena, &work_queue, thread_count, verbose);
+    }
+    else
+    {
+        KmeansJobStats stats;
+        run_kmeans_job(&job, &arena, &work_queue, thread_count, &stats);
+    }
+    free_memory_arena(&arena);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,208 @@
+#define MAX_NUMA_CPU_COUNT 1024
+#define MAX_NUMA_NODE_COUNT 64
+
+typedef enum AffinityMode
+{
+    AffinityMode_none,
+    AffinityMode_compact,
+    AffinityMode_scatter,
+    AffinityMode_list,
+} AffinityMode;
+
+typedef struct NumaTopology
+{
+    int node_count;
+    int cpu_count;
+    int cpus[MAX_NUMA_CPU_COUNT];      // sorted by node, then by cpu id
+    int cpu_nodes[MAX_NUMA_CPU_COUNT]; // node of cpus[i], nodes are renumbered to 0 ~ node_count-1
+} NumaTopology;
+
+typedef struct AffinityOption
+{
+    AffinityMode mode;
+    int cpu_count;
+    int cpus[MAX_NUMA_CPU_COUNT];
+} AffinityOption;
+
+// NOTE: parses the kernel's cpu list format, e.g. "0-3,8,10-11", returns the number of cpus written
+static int
+parse_cpu_list(char *text, int *out_cpus, int max_cpu_count)
+{
+    int result = 0;
+    char *at = text;
+    while(*at && *at != '\n')
+    {
+        if(*at < '0' || *at > '9') return -1;
+        int first = 0;
+        while(*at >= '0' && *at <= '9') first = first*10 + (*at++ - '0');
+        int last = first;
+        if(*at == '-')
+        {
+            ++at;
+            if(*at < '0' || *at > '9') return -1;
+            last = 0;
+            while(*at >= '0' && *at <= '9') last = last*10 + (*at++ - '0');
+        }
+        for(int cpu = first; cpu <= last && result < max_cpu_count; ++cpu)
+        {
+            out_cpus[result++] = cpu;
+        }
+        if(*at == ',') ++at;
+        else if(*at && *at != '\n') return -1;
+    }
+    return result;
+}
+
+static int
+parse_affinity_option(AffinityOption *option, char *text)
+{
+    int result = 1;
+    clear_memory(option, sizeof(*option));
+    if(string_equal(text, "compact"))
+    {
+        option->mode = AffinityMode_compact;
+    }
+    else if(string_equal(text, "scatter"))
+    {
+        option->mode = AffinityMode_scatter;
+    }
+    else if(string_equal(text, "none"))
+    {
+        option->mode = AffinityMode_none;
+    }
+    else
+    {
+        option->mode = AffinityMode_list;
+        option->cpu_count = parse_cpu_list(text, option->cpus, MAX_NUMA_CPU_COUNT);
+        if(option->cpu_count <= 0)
+        {
+            option->mode = AffinityMode_none;
+            option->cpu_count = 0;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+static void
+load_numa_topology(NumaTopology *topology)
+{
+    clear_memory(topology, sizeof(*topology));
+#if defined(__linux__)
+    for(int node = 0; node < MAX_NUMA_NODE_COUNT; ++node)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "rb");
+        if(file)
+        {
+            char text[4096];
+            size_t size = fread(text, 1, sizeof(text) - 1, file);
+            text[size] = 0;
+            fclose(file);
+
+            int remaining = MAX_NUMA_CPU_COUNT - topology->cpu_count;
+            int cpu_count = parse_cpu_list(text, topology->cpus + topology->cpu_count, remaining);
+            if(cpu_count > 0)
+            {
+                for(int i = 0; i < cpu_count; ++i)
+                {
+                    topology->cpu_nodes[topology->cpu_count + i] = topology->node_count;
+                }
+                topology->cpu_count += cpu_count;
+                ++topology->node_count;
+            }
+        }
+    }
+#endif
+    if(topology->node_count == 0)
+    {
+        // NOTE: no NUMA information, treat the machine as a single node
+        topology->node_count = 1;
+        topology->cpu_count = get_thread_count();
+        if(topology->cpu_count > MAX_NUMA_CPU_COUNT) topology->cpu_count = MAX_NUMA_CPU_COUNT;
+        for(int i = 0; i < topology->cpu_count; ++i)
+        {
+            topology->cpus[i] = i;
+            topology->cpu_nodes[i] = 0;
+        }
+    }
+}
+
+static int
+get_numa_node_of_cpu(NumaTopology *topology, int cpu)
+{
+    int result = 0;
+    for(int i = 0; i < topology->cpu_count; ++i)
+    {
+        if(topology->cpus[i] == cpu)
+        {
+            result = topology->cpu_nodes[i];
+            break;
+        }
+    }
+    return result;
+}
+
+// NOTE: compact fills node 0 before moving on to node 1, scatter deals the threads to the nodes
+// round robin. out_thread_cpus and out_thread_nodes hold thread_count entries, indexed like
+// ThreadAffinity. Nodes that end up without a thread are dropped from the numbering.
+static void
+build_thread_affinity(ThreadAffinity *affinity, int *out_thread_cpus, int *out_thread_nodes,
+                      NumaTopology *topology, AffinityOption *option, int thread_count)
+{
+    int node_cpu_counts[MAX_NUMA_NODE_COUNT] = {0};
+    int node_first_cpus[MAX_NUMA_NODE_COUNT] = {0};
+    for(int i = topology->cpu_count - 1; i >= 0; --i)
+    {
+        node_first_cpus[topology->cpu_nodes[i]] = i;
+        node_cpu_counts[topology->cpu_nodes[i]] += 1;
+    }
+
+    for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+    {
+        int cpu = 0;
+        switch(option->mode)
+        {
+            case AffinityMode_scatter:
+            {
+                int node = thread_index % topology->node_count;
+                int index_in_node = (thread_index / topology->node_count) % node_cpu_counts[node];
+                cpu = topology->cpus[node_first_cpus[node] + index_in_node];
+            } break;
+            case AffinityMode_list:
+            {
+                cpu = option->cpus[thread_index % option->cpu_count];
+            } break;
+            default:
+            {
+                cpu = topology->cpus[thread_index % topology->cpu_count];
+            } break;
+        }
+        out_thread_cpus[thread_index] = cpu;
+        out_thread_nodes[thread_index] = get_numa_node_of_cpu(topology, cpu);
+    }
+
+    int node_remap[MAX_NUMA_NODE_COUNT];
+    for(int node = 0; node < MAX_NUMA_NODE_COUNT; ++node) node_remap[node] = -1;
+    int node_count = 0;
+    for(int node = 0; node < topology->node_count; ++node)
+    {
+        for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+        {
+            if(out_thread_nodes[thread_index] == node)
+            {
+                node_remap[node] = node_count++;
+                break;
+            }
+        }
+    }
+    for(int thread_index = 0; thread_index < thread_count; ++thread_index)
+    {
+        out_thread_nodes[thread_index] = node_remap[out_thread_nodes[thread_index]];
+    }
+
+    affinity->thread_cpus = out_thread_cpus;
+    affinity->thread_nodes = out_thread_nodes;
+    affinity->node_count = node_count;
+}
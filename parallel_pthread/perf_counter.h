@@ -0,0 +1,269 @@
+#define PERF_COUNTER_CACHE_LINE_SIZE 64
+
+typedef enum PerfCounterType
+{
+    PerfCounter_cycles,
+    PerfCounter_instructions,
+    PerfCounter_llc_misses,
+    PerfCounter_branch_misses,
+    PerfCounter_count,
+} PerfCounterType;
+
+typedef struct PerfCounters
+{
+    unsigned long long values[PerfCounter_count];
+} PerfCounters;
+
+static char *perf_counter_names[PerfCounter_count] = {"cycles", "instructions", "llc-misses", "branch-misses"};
+
+// NOTE: each thread lazily opens its own counter group on first read, the counters of
+// perf_event_open are per thread so a group can't be shared between workers. Workers keep theirs
+// open for the next job, the thread that calls begin_perf_counters closes its own in
+// end_perf_counters.
+static int global_perf_counter_mask;
+static volatile int global_perf_counter_failed_thread_count;
+static THREAD_LOCAL int perf_counter_group_state; // 0: not opened, 1: opened, -1: failed
+static THREAD_LOCAL int perf_counter_group_fd;
+static THREAD_LOCAL int perf_counter_fds[PerfCounter_count]; // NOTE: the group members, -1 when not opened
+static THREAD_LOCAL int perf_counter_slots[PerfCounter_count];
+static THREAD_LOCAL int perf_counter_slot_count;
+
+static void
+accumulate_perf_counters(PerfCounters *dest, PerfCounters *begin, PerfCounters *end)
+{
+    for(int i = 0; i < PerfCounter_count; ++i)
+    {
+        dest->values[i] += end->values[i] - begin->values[i];
+    }
+}
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static int
+open_perf_counter(PerfCounterType type, int group_fd)
+{
+    struct perf_event_attr attr;
+    clear_memory(&attr, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    switch(type)
+    {
+        case PerfCounter_cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PerfCounter_instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PerfCounter_llc_misses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case PerfCounter_branch_misses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        default: break;
+    }
+    attr.read_format = PERF_FORMAT_GROUP;
+    // NOTE: user space only, so that the counters still open under perf_event_paranoid=2
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.disabled = (group_fd == -1);
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static int
+open_perf_counter_group(int counter_mask)
+{
+    int result = 0;
+    perf_counter_group_state = -1;
+    perf_counter_slot_count = 0;
+    for(int i = 0; i < PerfCounter_count; ++i)
+    {
+        perf_counter_slots[i] = -1;
+        perf_counter_fds[i] = -1;
+    }
+
+    perf_counter_group_fd = open_perf_counter(PerfCounter_cycles, -1);
+    if(perf_counter_group_fd != -1)
+    {
+        perf_counter_fds[PerfCounter_cycles] = perf_counter_group_fd;
+        perf_counter_slots[PerfCounter_cycles] = perf_counter_slot_count++;
+        for(int type = PerfCounter_cycles + 1; type < PerfCounter_count; ++type)
+        {
+            if(counter_mask & (1 << type))
+            {
+                int fd = open_perf_counter((PerfCounterType)type, perf_counter_group_fd);
+                if(fd != -1)
+                {
+                    perf_counter_fds[type] = fd;
+                    perf_counter_slots[type] = perf_counter_slot_count++;
+                }
+            }
+        }
+        ioctl(perf_counter_group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_counter_group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        perf_counter_group_state = 1;
+        result = 1;
+    }
+    return result;
+}
+
+// NOTE: returns the mask of counters that could be opened on the calling thread, 0 when
+// perf_event_open isn't usable at all (no PMU in a VM, seccomp, perf_event_paranoid, ...)
+static int
+begin_perf_counters(void)
+{
+    int result = 0;
+    if(open_perf_counter_group((1 << PerfCounter_count) - 1))
+    {
+        for(int type = 0; type < PerfCounter_count; ++type)
+        {
+            if(perf_counter_slots[type] != -1) result |= (1 << type);
+        }
+    }
+    global_perf_counter_mask = result;
+    global_perf_counter_failed_thread_count = 0;
+    return result;
+}
+
+// NOTE: closes the group of the calling thread, so that a daemon calling begin_perf_counters for
+// every job doesn't leak its descriptors
+static void
+end_perf_counters(void)
+{
+    if(perf_counter_group_state == 1)
+    {
+        // NOTE: the members before the leader
+        for(int type = PerfCounter_count - 1; type >= 0; --type)
+        {
+            if(perf_counter_fds[type] != -1)
+            {
+                close(perf_counter_fds[type]);
+                perf_counter_fds[type] = -1;
+            }
+        }
+    }
+    perf_counter_group_state = 0;
+    global_perf_counter_mask = 0;
+}
+
+static void
+read_perf_counters(PerfCounters *counters)
+{
+    clear_memory(counters, sizeof(*counters));
+    if(global_perf_counter_mask)
+    {
+        if(perf_counter_group_state == 0)
+        {
+            if(!open_perf_counter_group(global_perf_counter_mask))
+            {
+                atomic_add(&global_perf_counter_failed_thread_count, 1);
+            }
+        }
+
+        if(perf_counter_group_state == 1)
+        {
+            unsigned long long buffer[1 + PerfCounter_count];
+            if(read(perf_counter_group_fd, buffer, sizeof(buffer)) > 0)
+            {
+                for(int type = 0; type < PerfCounter_count; ++type)
+                {
+                    int slot = perf_counter_slots[type];
+                    if(slot != -1 && slot < (int)buffer[0])
+                    {
+                        counters->values[type] = buffer[1 + slot];
+                    }
+                }
+            }
+        }
+    }
+}
+#else
+static int
+begin_perf_counters(void)
+{
+    global_perf_counter_mask = 0;
+    return 0;
+}
+
+static void
+end_perf_counters(void)
+{
+}
+
+static void
+read_perf_counters(PerfCounters *counters)
+{
+    clear_memory(counters, sizeof(*counters));
+}
+#endif
+
+static int
+is_perf_counter_available(PerfCounterType type)
+{
+    return (global_perf_counter_mask >> type) & 1;
+}
+
+static void
+print_perf_counter_ratio(char *label, PerfCounterType numerator, PerfCounterType denominator, PerfCounters *counters,
+                         double scale)
+{
+    if(is_perf_counter_available(numerator) && is_perf_counter_available(denominator) && counters->values[denominator])
+    {
+        printf(" %s = %.3f", label, scale * counters->values[numerator] / counters->values[denominator]);
+    }
+    else
+    {
+        printf(" %s = n/a", label);
+    }
+}
+
+static void
+print_perf_counters_per_pixel(char *label, PerfCounterType type, PerfCounters *counters, int pixel_count, double scale)
+{
+    if(is_perf_counter_available(type) && pixel_count > 0)
+    {
+        printf(" %s = %.3f", label, scale * counters->values[type] / pixel_count);
+    }
+    else
+    {
+        printf(" %s = n/a", label);
+    }
+}
+
+static void
+print_perf_counter_iteration(int iteration, PerfCounters *classify_counters, PerfCounters *update_counters,
+                             int pixel_count)
+{
+    printf("[perf] iteration %d:\n", iteration);
+    printf("    classify:");
+    print_perf_counter_ratio("ipc", PerfCounter_instructions, PerfCounter_cycles, classify_counters, 1.0);
+    print_perf_counters_per_pixel("cycles/pixel", PerfCounter_cycles, classify_counters, pixel_count, 1.0);
+    print_perf_counters_per_pixel("llc bytes/pixel", PerfCounter_llc_misses, classify_counters, pixel_count,
+                                  PERF_COUNTER_CACHE_LINE_SIZE);
+    print_perf_counters_per_pixel("branch-misses/pixel", PerfCounter_branch_misses, classify_counters, pixel_count, 1.0);
+    printf("\n    update:  ");
+    print_perf_counter_ratio("ipc", PerfCounter_instructions, PerfCounter_cycles, update_counters, 1.0);
+    print_perf_counters_per_pixel("cycles/pixel", PerfCounter_cycles, update_counters, pixel_count, 1.0);
+    print_perf_counters_per_pixel("llc bytes/pixel", PerfCounter_llc_misses, update_counters, pixel_count,
+                                  PERF_COUNTER_CACHE_LINE_SIZE);
+    printf("\n");
+}
+
+static void
+print_perf_counter_availability(void)
+{
+    if(global_perf_counter_mask)
+    {
+        printf("[perf] counters:");
+        for(int type = 0; type < PerfCounter_count; ++type)
+        {
+            printf(" %s%s", perf_counter_names[type], is_perf_counter_available((PerfCounterType)type) ? "" : "(n/a)");
+        }
+        printf("\n");
+        if(global_perf_counter_failed_thread_count)
+        {
+            printf("[perf] WARNING: %d threads failed to open counters, their counts are missing\n",
+                   global_perf_counter_failed_thread_count);
+        }
+    }
+    else
+    {
+        printf("[perf] hardware counters are unavailable on this system, continuing without them\n");
+    }
+}
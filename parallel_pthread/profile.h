@@ -1,30 +1,32 @@
 
+
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
-static unsigned long long 
-get_microsecond_from_epoch(void)
+static unsigned long long
+get_nanosecond_monotonic(void)
 {
     unsigned long long result = 0;
-    SYSTEMTIME system_time;
-    FILETIME nanosecond_since_epoch_div100;
-    GetSystemTime(&system_time);
-    if(SystemTimeToFileTime(&system_time, &nanosecond_since_epoch_div100))
+    LARGE_INTEGER counter, frequency;
+    if(QueryPerformanceCounter(&counter) && QueryPerformanceFrequency(&frequency))
     {
-        result = (((unsigned long long)nanosecond_since_epoch_div100.dwHighDateTime << 32) | 
-                  ((unsigned long long)nanosecond_since_epoch_div100.dwLowDateTime << 0)) / 10;
+        // NOTE: split the multiplication to avoid overflowing 64 bits on long uptimes
+        unsigned long long ticks = (unsigned long long)counter.QuadPart;
+        unsigned long long ticks_per_second = (unsigned long long)frequency.QuadPart;
+        result = (ticks / ticks_per_second) * 1000000000ull +
+                 (ticks % ticks_per_second) * 1000000000ull / ticks_per_second;
     }
     return result;
 }
 #elif defined(__unix__)
-#include <sys/time.h>
-static unsigned long long 
-get_microsecond_from_epoch(void)
+#include <time.h>
+static unsigned long long
+get_nanosecond_monotonic(void)
 {
     unsigned long long result = 0;
-    struct timeval current_clock;
-    if(gettimeofday(&current_clock, 0) == 0)
+    struct timespec current_clock;
+    if(clock_gettime(CLOCK_MONOTONIC, &current_clock) == 0)
     {
-        result = (unsigned long long)current_clock.tv_sec * 1000000 + current_clock.tv_usec;
+        result = (unsigned long long)current_clock.tv_sec * 1000000000 + current_clock.tv_nsec;
     }
     return result;
 }
@@ -9,16 +9,20 @@
     #include <unistd.h>
     #include <pthread.h>
     #include <semaphore.h>
+    #include <sched.h>
+    #include <sys/syscall.h>
 #endif
 
 #if defined(_MSC_VER)
     #define MEMORY_BARRIER _ReadWriteBarrier()
     #define atomic_add(ptr, value) InterlockedExchangeAdd((volatile LONG *)(ptr), value)
     #define atomic_compare_exchange(ptr, expected, desired) InterlockedCompareExchange((volatile LONG *)(ptr), (LONG)desired, (LONG)expected)
+    #define THREAD_LOCAL __declspec(thread)
 #elif defined(__GNUC__)
 #define MEMORY_BARRIER asm volatile("" ::: "memory")
     #define atomic_add(ptr, value) __sync_fetch_and_add(ptr, value)
     #define atomic_compare_exchange(ptr, expected, desired) __sync_val_compare_and_swap(ptr, expected, desired)
+    #define THREAD_LOCAL __thread
 #else
     #error "unknown compiler, use MSVC or GCC"
 #endif
@@ -50,17 +54,38 @@ typedef struct WorkQueueEntry
     void *data;
 } WorkQueueEntry;
 
+// NOTE: arrays are indexed by thread index, 0 is the thread that creates the queue and
+// 1 ~ thread_count are the workers, the arrays must outlive the queue
+typedef struct ThreadAffinity
+{
+    int *thread_cpus;
+    int *thread_nodes;
+    int node_count;
+} ThreadAffinity;
+
 typedef struct WorkQueue
 {
     volatile int entry_to_read;
     volatile int entry_to_write;
     volatile int completion_goal;
     volatile int completion_count;
+    volatile int started_thread_count;
+    ThreadAffinity *affinity;
     TicketMutex queue_work_mutex;
     Semaphore semaphore;
     WorkQueueEntry entries[WORK_QUEUE_SIZE];
 } WorkQueue;
 
+typedef struct EveryThreadWork
+{
+    WorkQueueEntryCallback *callback;
+    void *data;
+    int thread_count;
+    volatile int arrival_count;
+} EveryThreadWork;
+
+static THREAD_LOCAL int worker_thread_index;
+
 static void 
 begin_ticket_mutex(TicketMutex *mutex)
 {
@@ -88,6 +113,41 @@ get_thread_count(void)
     return result;
 }
 
+static int
+get_worker_thread_index(void)
+{
+    return worker_thread_index;
+}
+
+// NOTE: for spin waits that can outlast a time slice, lets the thread being waited on run when
+// there are more threads than cores
+static void
+yield_thread(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    SwitchToThread();
+#elif defined(__unix__)
+    sched_yield();
+#endif
+}
+
+static void
+set_thread_affinity(int cpu)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+    // NOTE: use the raw syscall so we don't depend on _GNU_SOURCE being defined before every header
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    clear_memory(mask, sizeof(mask));
+    if(cpu >= 0 && cpu < 1024)
+    {
+        mask[cpu / (8 * sizeof(unsigned long))] |= 1ul << (cpu % (8 * sizeof(unsigned long)));
+        syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+    }
+#endif
+}
+
 #include <stdio.h>
 static void
 create_semaphore(Semaphore *semaphore, int max_count)
@@ -136,25 +196,58 @@ create_thread(ThreadProc *thread_proc, void *param)
     CloseHandle(thread_handle);
 #elif defined(__unix__)
     pthread_t thread_handle;
-    pthread_create(&thread_handle, 0, thread_proc, param);
+    // NOTE: nobody joins the threads, detach them so that short lived ones don't leak their stack
+    if(pthread_create(&thread_handle, 0, thread_proc, param) == 0) pthread_detach(thread_handle);
 #endif
 }
 
+// NOTE: waits for the workers to take an entry when the ring is full, which happens with one work
+// per thread past WORK_QUEUE_SIZE - 1 threads. The caller doesn't run queued works meanwhile, an
+// entry of run_on_every_thread only returns once every thread has arrived.
 static void 
 queue_work(WorkQueue *queue, WorkQueueEntryCallback *callback, void *data)
 {
     begin_ticket_mutex(&queue->queue_work_mutex);
     int index = queue->entry_to_write;
+    int next_index = (index + 1) & WORK_QUEUE_MASK;
+    while(next_index == queue->entry_to_read)
+    {
+        yield_thread();
+    }
     WorkQueueEntry *entry = queue->entries + index;
     entry->callback = callback;
     entry->data = data;
     ++queue->completion_goal;
     MEMORY_BARRIER;
-    queue->entry_to_write = (queue->entry_to_write + 1) & WORK_QUEUE_MASK;
+    queue->entry_to_write = next_index;
     end_ticket_mutex(&queue->queue_work_mutex);
     increment_semaphore(&queue->semaphore);
 }
 
+// NOTE: like queue_work but returns 0 instead of waiting when the ring is full, for works that
+// queue more works and can just as well run them inline
+static int 
+try_queue_work(WorkQueue *queue, WorkQueueEntryCallback *callback, void *data)
+{
+    int result = 0;
+    begin_ticket_mutex(&queue->queue_work_mutex);
+    int index = queue->entry_to_write;
+    int next_index = (index + 1) & WORK_QUEUE_MASK;
+    if(next_index != queue->entry_to_read)
+    {
+        WorkQueueEntry *entry = queue->entries + index;
+        entry->callback = callback;
+        entry->data = data;
+        ++queue->completion_goal;
+        MEMORY_BARRIER;
+        queue->entry_to_write = next_index;
+        result = 1;
+    }
+    end_ticket_mutex(&queue->queue_work_mutex);
+    if(result) increment_semaphore(&queue->semaphore);
+    return result;
+}
+
 static int 
 do_next_work(WorkQueue *queue)
 {
@@ -188,6 +281,11 @@ static
 THREAD_PROC(thread_proc)
 {
     WorkQueue *queue = (WorkQueue *)param;
+    worker_thread_index = atomic_add(&queue->started_thread_count, 1) + 1;
+    if(queue->affinity)
+    {
+        set_thread_affinity(queue->affinity->thread_cpus[worker_thread_index]);
+    }
     for(;;)
     {
         if(do_next_work(queue))
@@ -198,9 +296,15 @@ THREAD_PROC(thread_proc)
     return 0;
 }
 static void 
-create_work_queue(WorkQueue *queue, int thread_count)
+create_work_queue(WorkQueue *queue, int thread_count, ThreadAffinity *affinity)
 {
     clear_memory(queue, sizeof(*queue));
+    queue->affinity = affinity;
+    worker_thread_index = 0;
+    if(affinity)
+    {
+        set_thread_affinity(affinity->thread_cpus[0]);
+    }
     create_semaphore(&queue->semaphore, thread_count);
     for(int thread_index = 0; thread_index < thread_count; ++thread_index)
     {
@@ -208,3 +312,31 @@ create_work_queue(WorkQueue *queue, int thread_count)
     }
 }
 
+static void
+do_every_thread_work(void *param)
+{
+    EveryThreadWork *work = (EveryThreadWork *)param;
+    atomic_add(&work->arrival_count, 1);
+    while(work->arrival_count != work->thread_count);
+    work->callback(work->data);
+}
+
+// NOTE: runs the callback exactly once on every thread (the caller and all the workers), so
+// the callback can pick its share of the work with get_worker_thread_index(). Each thread
+// holds on to its entry until every thread has arrived, which is what keeps a fast worker
+// from taking two entries. The workers must be idle when this is called.
+static void
+run_on_every_thread(WorkQueue *queue, int thread_count, WorkQueueEntryCallback *callback, void *data)
+{
+    EveryThreadWork work;
+    work.callback = callback;
+    work.data = data;
+    work.thread_count = thread_count;
+    work.arrival_count = 0;
+    for(int thread_index = 1; thread_index < thread_count; ++thread_index)
+    {
+        queue_work(queue, do_every_thread_work, &work);
+    }
+    do_every_thread_work(&work);
+    complete_all_works(queue);
+}
@@ -0,0 +1,201 @@
+#define MAX_TRACE_EVENT_COUNT (1 << 18)
+#define MAX_TRACE_PHASE_COUNT 32
+
+#include <stdio.h>
+
+typedef struct TraceEvent
+{
+    char *name;
+    int thread_index;
+    int iteration;
+    unsigned long long begin_time;
+    unsigned long long end_time;
+} TraceEvent;
+
+typedef struct Trace
+{
+    TraceEvent *events;
+    volatile int event_count;
+    volatile int thread_count;
+    unsigned long long base_time;
+} Trace;
+
+static Trace global_trace;
+static THREAD_LOCAL int trace_thread_index = -1;
+
+// NOTE: the thread that begins the trace is always reported as thread 0, the others get their
+// index on their first recorded event
+static int
+begin_trace(void)
+{
+    clear_memory(&global_trace, sizeof(global_trace));
+    global_trace.events = (TraceEvent *)malloc(MAX_TRACE_EVENT_COUNT * sizeof(TraceEvent));
+    global_trace.thread_count = 1;
+    global_trace.base_time = get_nanosecond_monotonic();
+    trace_thread_index = 0;
+    return global_trace.events != 0;
+}
+
+static void
+end_trace(void)
+{
+    if(global_trace.events) free(global_trace.events);
+    clear_memory(&global_trace, sizeof(global_trace));
+}
+
+// NOTE: returns 0 when tracing is disabled so that untraced runs don't pay for the clock read
+static unsigned long long
+get_trace_time(void)
+{
+    unsigned long long result = 0;
+    if(global_trace.events)
+    {
+        result = get_nanosecond_monotonic();
+    }
+    return result;
+}
+
+static void
+record_trace_event(char *name, int iteration, unsigned long long begin_time)
+{
+    if(global_trace.events)
+    {
+        unsigned long long end_time = get_nanosecond_monotonic();
+        if(trace_thread_index < 0)
+        {
+            trace_thread_index = atomic_add(&global_trace.thread_count, 1);
+        }
+
+        int index = atomic_add(&global_trace.event_count, 1);
+        if(index < MAX_TRACE_EVENT_COUNT)
+        {
+            TraceEvent *event = global_trace.events + index;
+            event->name = name;
+            event->thread_index = trace_thread_index;
+            event->iteration = iteration;
+            event->begin_time = begin_time;
+            event->end_time = end_time;
+        }
+    }
+}
+
+static int
+get_recorded_trace_event_count(void)
+{
+    int result = global_trace.event_count;
+    if(result > MAX_TRACE_EVENT_COUNT) result = MAX_TRACE_EVENT_COUNT;
+    return result;
+}
+
+// NOTE: Chrome trace event format, load the file with chrome://tracing or https://ui.perfetto.dev
+static int
+write_chrome_trace(char *path)
+{
+    int result = 0;
+    FILE *file = fopen(path, "wb");
+    if(file)
+    {
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        for(int thread_index = 0; thread_index < global_trace.thread_count; ++thread_index)
+        {
+            fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}},\n",
+                    thread_index, thread_index ? "worker" : "main", thread_index);
+        }
+
+        int event_count = get_recorded_trace_event_count();
+        for(int event_index = 0; event_index < event_count; ++event_index)
+        {
+            TraceEvent *event = global_trace.events + event_index;
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"iteration\":%d}}%s\n",
+                    event->name, event->thread_index,
+                    (event->begin_time - global_trace.base_time) / 1000.0,
+                    (event->end_time - event->begin_time) / 1000.0,
+                    event->iteration, (event_index + 1 < event_count) ? "," : "");
+        }
+        fprintf(file, "]}\n");
+        result = (fclose(file) == 0);
+    }
+    return result;
+}
+
+// NOTE: 'imbalance' is the slowest event over the average event of the same phase within an
+// iteration, it is 1.0 for phases that only run on one thread
+static void
+print_trace_summary(void)
+{
+    char *phase_names[MAX_TRACE_PHASE_COUNT];
+    int phase_event_counts[MAX_TRACE_PHASE_COUNT];
+    unsigned long long phase_total_times[MAX_TRACE_PHASE_COUNT];
+    double phase_imbalance_sums[MAX_TRACE_PHASE_COUNT];
+    int phase_imbalance_counts[MAX_TRACE_PHASE_COUNT];
+    int phase_count = 0;
+
+    int event_count = get_recorded_trace_event_count();
+    for(int event_index = 0; event_index < event_count; ++event_index)
+    {
+        TraceEvent *event = global_trace.events + event_index;
+        int phase_index = 0;
+        while(phase_index < phase_count && !string_equal(phase_names[phase_index], event->name)) ++phase_index;
+        if(phase_index == phase_count)
+        {
+            if(phase_count == MAX_TRACE_PHASE_COUNT) continue;
+            phase_names[phase_count] = event->name;
+            phase_event_counts[phase_count] = 0;
+            phase_total_times[phase_count] = 0;
+            phase_imbalance_sums[phase_count] = 0.0;
+            phase_imbalance_counts[phase_count] = 0;
+            ++phase_count;
+        }
+        phase_event_counts[phase_index] += 1;
+        phase_total_times[phase_index] += event->end_time - event->begin_time;
+    }
+
+    // NOTE: events of one iteration are recorded close to each other, so grouping consecutive
+    // runs by (phase, iteration) is enough here
+    for(int phase_index = 0; phase_index < phase_count; ++phase_index)
+    {
+        int group_iteration = -1;
+        int group_count = 0;
+        unsigned long long group_max = 0, group_sum = 0;
+        for(int event_index = 0; event_index <= event_count; ++event_index)
+        {
+            TraceEvent *event = global_trace.events + event_index;
+            int is_end = (event_index == event_count);
+            if(!is_end && !string_equal(event->name, phase_names[phase_index])) continue;
+            if(is_end || event->iteration != group_iteration)
+            {
+                if(group_count > 1 && group_sum > 0)
+                {
+                    phase_imbalance_sums[phase_index] += (double)group_max * group_count / group_sum;
+                    phase_imbalance_counts[phase_index] += 1;
+                }
+                if(is_end) break;
+                group_iteration = event->iteration;
+                group_count = 0;
+                group_max = 0;
+                group_sum = 0;
+            }
+            unsigned long long duration = event->end_time - event->begin_time;
+            if(duration > group_max) group_max = duration;
+            group_sum += duration;
+            ++group_count;
+        }
+    }
+
+    printf("[trace]\n");
+    for(int phase_index = 0; phase_index < phase_count; ++phase_index)
+    {
+        double imbalance = 1.0;
+        if(phase_imbalance_counts[phase_index])
+        {
+            imbalance = phase_imbalance_sums[phase_index] / phase_imbalance_counts[phase_index];
+        }
+        printf("    %-12s count = %-6d total = %fs  imbalance = %.2f\n",
+               phase_names[phase_index], phase_event_counts[phase_index],
+               phase_total_times[phase_index] / 1000000000.0, imbalance);
+    }
+    if(global_trace.event_count > MAX_TRACE_EVENT_COUNT)
+    {
+        printf("    WARNING: %d events dropped\n", global_trace.event_count - MAX_TRACE_EVENT_COUNT);
+    }
+}
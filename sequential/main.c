@@ -6,6 +6,9 @@
 #include "stb_image_write.h"
 #include <stdio.h>
 #include <malloc.h>
+#include <limits.h>
+
+#define LANE_COUNT 8
 
 typedef struct Color4
 {
@@ -14,7 +17,7 @@ typedef struct Color4
 
 typedef struct Color4_SUM
 {
-    long r, g, b, a;
+    long long r, g, b, a;
 } Color4_SUM;
 
 typedef struct Image
@@ -140,29 +143,79 @@ void AllocateRandomClusters(Color4 *centroid, Color4 *pixels, int pixel_count, s
     }
 }
 
-void classify_points(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, int cluster_count, int total_pixel)
+// NOTE: LANE_COUNT pixels are scanned side by side with the centroid broadcast to every lane,
+// the minimum is a select instead of a branch and the lowest index still wins ties
+static inline void classify_points_with_count(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int cluster_count, int total_pixel)
 {
-    for (int i = 0; i < total_pixel; i++)
+    for (int first = 0; first < total_pixel; first += LANE_COUNT)
     {
-        int index = -1;
-        int min_dist = 1000000;
+        int lane_count = total_pixel - first;
+        if (lane_count > LANE_COUNT)
+            lane_count = LANE_COUNT;
+
+        int r[LANE_COUNT], g[LANE_COUNT], b[LANE_COUNT];
+        int min_dist[LANE_COUNT], min_index[LANE_COUNT];
+        for (int lane = 0; lane < LANE_COUNT; lane++)
+        {
+            Color4 pixel = pixels[first + ((lane < lane_count) ? lane : lane_count - 1)];
+            r[lane] = pixel.r;
+            g[lane] = pixel.g;
+            b[lane] = pixel.b;
+            min_dist[lane] = INT_MAX;
+            min_index[lane] = 0;
+        }
         for (int j = 0; j < cluster_count; j++)
         {
-            int dist = 0;
-            dist = dist + (pixels[i].r - centroid[j].r) * (pixels[i].r - centroid[j].r);
-            dist = dist + (pixels[i].g - centroid[j].g) * (pixels[i].g - centroid[j].g);
-            dist = dist + (pixels[i].b - centroid[j].b) * (pixels[i].b - centroid[j].b);
-            // printf("%d ",dist);
-            if (dist < min_dist)
+            int centroid_r = centroid[j].r, centroid_g = centroid[j].g, centroid_b = centroid[j].b;
+            for (int lane = 0; lane < LANE_COUNT; lane++)
             {
-                index = j;
-                min_dist = dist;
+                int dist = 0;
+                dist = dist + (r[lane] - centroid_r) * (r[lane] - centroid_r);
+                dist = dist + (g[lane] - centroid_g) * (g[lane] - centroid_g);
+                dist = dist + (b[lane] - centroid_b) * (b[lane] - centroid_b);
+                int take = dist < min_dist[lane];
+                min_dist[lane] = take ? dist : min_dist[lane];
+                min_index[lane] = take ? j : min_index[lane];
             }
         }
-        // printf("%d\n",index);
-        if (index != label[i])
-            (*migration_count)++;
-        label[i] = index;
+
+        for (int lane = 0; lane < lane_count; lane++)
+        {
+            int i = first + lane;
+            if (min_index[lane] != label[i])
+                (*migration_count)++;
+            label[i] = min_index[lane];
+            *sse += min_dist[lane];
+        }
+    }
+}
+
+// NOTE: a constant cluster count lets the compiler unroll the scan and keep the centroids in
+// registers, the other counts go through the generic one
+#define DEFINE_CLASSIFY_POINTS(count) \
+static void classify_points_##count(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int total_pixel) \
+{ \
+    classify_points_with_count(centroid, label, pixels, migration_count, sse, count, total_pixel); \
+}
+
+DEFINE_CLASSIFY_POINTS(2)
+DEFINE_CLASSIFY_POINTS(4)
+DEFINE_CLASSIFY_POINTS(8)
+DEFINE_CLASSIFY_POINTS(16)
+DEFINE_CLASSIFY_POINTS(32)
+DEFINE_CLASSIFY_POINTS(64)
+
+void classify_points(Color4 *centroid, int *label, Color4 *pixels, int *migration_count, long long *sse, int cluster_count, int total_pixel)
+{
+    switch (cluster_count)
+    {
+    case 2: classify_points_2(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    case 4: classify_points_4(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    case 8: classify_points_8(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    case 16: classify_points_16(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    case 32: classify_points_32(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    case 64: classify_points_64(centroid, label, pixels, migration_count, sse, total_pixel); break;
+    default: classify_points_with_count(centroid, label, pixels, migration_count, sse, cluster_count, total_pixel); break;
     }
 }
 
@@ -187,13 +240,13 @@ void update_centroid(Color4_SUM *label_sum, int *label_count,
 
     for (int i = 0; i < cluster_count; i++)
     {
-        // printf("%ld",label_sum[i].r/label_count[i]);
-        if (label_sum[i].r != 0 && label_count[i] != 0)
+        // NOTE: round down and keep the old centroid of an empty cluster, same as the other backends
+        if (label_count[i] != 0)
+        {
             centroid[i].r = label_sum[i].r / label_count[i];
-        if (label_sum[i].g != 0 && label_count[i] != 0)
             centroid[i].g = label_sum[i].g / label_count[i];
-        if (label_sum[i].b != 0 && label_count[i] != 0)
             centroid[i].b = label_sum[i].b / label_count[i];
+        }
     }
 }
 
@@ -211,36 +264,69 @@ void output_result(int *label, Color4 *output, Color4 *centroid, int cluster_cou
 static void
 Kmean(Color4 *output, Color4 *pixels, int width, int height,
       int cluster_count, int max_iteration, float migration_threshold,
+      float sse_tolerance, float max_shift, long long *out_sse,
       int *out_iteration)
 {
     int pixel_count = width * height;
     Color4 *centroid = (Color4 *)malloc(cluster_count * sizeof(Color4));
     int *label = (int *)malloc(pixel_count * sizeof(int));
+    clear_memory(label, pixel_count * sizeof(int));
 
     AllocateRandomClusters(centroid, pixels, pixel_count, cluster_count);
 
     int migration_count;
+    long long sse = 0;
+    long long previous_sse = 0;
+    Color4 *previous_centroid = (Color4 *)malloc(cluster_count * sizeof(Color4));
     int i = 0;
     Color4_SUM *label_sum = (Color4_SUM *)malloc(cluster_count * sizeof(Color4_SUM));
     int *label_count = (int *)malloc(cluster_count * sizeof(int));
+    // NOTE: stays at max_iteration when no stopping rule fires before -m runs out
+    *out_iteration = max_iteration;
     while (i++ < max_iteration)
     {
         migration_count = 0;
+        previous_sse = sse;
+        sse = 0;
+        for (int j = 0; j < cluster_count; j++)
+            previous_centroid[j] = centroid[j];
 
-        classify_points(centroid, label, pixels, &migration_count, cluster_count, pixel_count);
+        classify_points(centroid, label, pixels, &migration_count, &sse, cluster_count, pixel_count);
         update_centroid(label_sum, label_count, centroid, label, pixels, cluster_count, pixel_count);
 
-        if (migration_count / (float)pixel_count < migration_threshold)
+        int max_shift_squared = 0;
+        for (int j = 0; j < cluster_count; j++)
+        {
+            int r_diff = centroid[j].r - previous_centroid[j].r;
+            int g_diff = centroid[j].g - previous_centroid[j].g;
+            int b_diff = centroid[j].b - previous_centroid[j].b;
+            int shift_squared = r_diff * r_diff + g_diff * g_diff + b_diff * b_diff;
+            if (shift_squared > max_shift_squared)
+                max_shift_squared = shift_squared;
+        }
+
+        // NOTE: same stopping rules as the pthread backend, any of them ends the loop
+        int converged = (migration_count < migration_threshold * pixel_count);
+        if (sse_tolerance > 0 && i > 1 && previous_sse > 0 &&
+            ((double)previous_sse - (double)sse) / (double)previous_sse < sse_tolerance)
+            converged = 1;
+        if (max_shift >= 0 && max_shift_squared <= max_shift * max_shift)
+            converged = 1;
+
+        if (converged)
         {
             *out_iteration = i;
             break;
         }
     }
-    printf("out_iteration: %d\n", *out_iteration);
     output_result(label, output, centroid, cluster_count, pixel_count);
 
+    *out_sse = sse;
     free(label);
     free(centroid);
+    free(previous_centroid);
+    free(label_sum);
+    free(label_count);
 }
 
 int main(int arg_count, char **args)
@@ -251,6 +337,8 @@ int main(int arg_count, char **args)
     int cluster_count = 4;
     int max_iteration = 200;
     float migration_threshold = 0.01f;
+    float sse_tolerance = 0.0f;
+    float max_shift = -1.0f;
 
     for (; parsing_arg_index < arg_count; ++parsing_arg_index)
     {
@@ -270,6 +358,14 @@ int main(int arg_count, char **args)
         {
             migration_threshold = atof(option + 3);
         }
+        else if (string_skip_prefix(option, "--sse-tolerance="))
+        {
+            sse_tolerance = atof(string_skip_prefix(option, "--sse-tolerance="));
+        }
+        else if (string_skip_prefix(option, "--max-shift="))
+        {
+            max_shift = atof(string_skip_prefix(option, "--max-shift="));
+        }
         else if (option[1] == 'q' && option[2] == 0)
         {
             verbose = 0;
@@ -291,6 +387,8 @@ int main(int arg_count, char **args)
                       "    -n={cluster_count}  number of clusters (default is 4)\n"
                       "    -m={max_iteration}  max iteration of kmean clustering (default is 200)\n"
                       "    -r={threshold}      exit when the data point migration ratio between clusters exceeds this value (default is 0.01)\n"
+                      "    --sse-tolerance={x} also exit when the SSE improved by less than this fraction (default is off)\n"
+                      "    --max-shift={d}     also exit when no cluster moved further than d (default is off)\n"
                       "    -q                  quiet mode (no output)\n"
                       "    -h                  print this help information\n";
         // NOTE: pass the string via '%s' to shut up the compiler warning
@@ -319,15 +417,18 @@ int main(int arg_count, char **args)
             {
                 load_image_data(input, &image);
                 int used_iteration;
+                long long sse;
                 unsigned long long start_time = get_microsecond_from_epoch();
                 Kmean(output, input, image.width, image.height,
                       cluster_count, max_iteration, migration_threshold,
+                      sse_tolerance, max_shift, &sse,
                       &used_iteration);
                 unsigned long long end_time = get_microsecond_from_epoch();
                 if (verbose)
                 {
                     printf("[summary]\n");
                     printf("    used iteration = %d\n", used_iteration);
+                    printf("    sse = %lld\n", sse);
                     printf("    time = %fs\n", (end_time - start_time) / 1000000.0f);
                 }
 